@@ -0,0 +1,112 @@
+#include "queue_benchmark.h"
+#include "../concurrent_data_structures/array_blocking_queue.h"
+#include "../concurrent_data_structures/sharded_queue.h"
+#include <iterator>
+using namespace hungbiu;
+using namespace hungbiu::bench;
+
+template<typename T, typename WaitPolicy = spin_park_wait<>, typename Layout = padded_layout>
+struct abq_adapter
+{
+	array_blocking_queue<T, WaitPolicy, Layout> q_;
+
+	explicit abq_adapter(std::size_t capacity) : q_(capacity) {}
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop()
+	{
+		T val{};
+		q_.pop(val);
+		return val;
+	}
+};
+template<typename T> using abq_busy = abq_adapter<T, busy_wait>;
+template<typename T> using abq_compact = abq_adapter<T, spin_park_wait<>, compact_layout>;
+
+HUNGBIU_QUEUE_BENCHMARK("array_blocking_queue", abq_adapter, sweep_bounded);
+HUNGBIU_QUEUE_BENCHMARK("array_blocking_queue/busy_wait", abq_busy, sweep_bounded_no_oversubscribe);
+HUNGBIU_QUEUE_BENCHMARK("array_blocking_queue/compact", abq_compact, sweep_bounded);
+
+// At most the total capacity of the single queue, one shard per core
+static std::size_t shard_capacity(std::size_t capacity)
+{
+	return std::max<std::size_t>(capacity / cpu_topology::get().concurrency(), 2);
+}
+template<typename T>
+struct sharded_adapter
+{
+	sharded_queue<T> q_;
+
+	explicit sharded_adapter(std::size_t capacity) :
+		q_(shard_capacity(capacity), cpu_topology::get().concurrency()) {}
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop()
+	{
+		T val{};
+		q_.pop(val);
+		return val;
+	}
+};
+HUNGBIU_QUEUE_BENCHMARK("sharded_queue", sharded_adapter, sweep_bounded);
+
+/*
+ * Batch vs single element operations: one producer and one consumer
+ * move Items_N ints through push_n/pop_n in batches of state.range(0),
+ * a batch of 1 going through push/pop instead.
+*/
+static void abq_batch(benchmark::State& state)
+{
+	const auto batch = static_cast<std::size_t>(state.range(0));
+	const auto total = Items_N / batch * batch;
+	for (auto _ : state) {
+		array_blocking_queue<int> q{ 1024 };
+		const auto start = std::chrono::steady_clock::now();
+		thread_array<1> consumer{ [&]() {
+			std::vector<int> out(batch);
+			for (std::size_t n = 0; n < total; n += batch) {
+				if (batch == 1) q.pop(out[0]);
+				else q.pop_n(out.begin(), batch);
+				benchmark::DoNotOptimize(out.data());
+			}
+		} };
+		std::vector<int> in(batch);
+		for (std::size_t n = 0; n < total; n += batch) {
+			std::iota(in.begin(), in.end(), static_cast<int>(n));
+			if (batch == 1) q.push(in[0]);
+			else q.push_n(in.begin(), in.end());
+		}
+		consumer.join_all();
+		state.SetIterationTime(std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+	state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * total));
+}
+BENCHMARK(abq_batch)
+	->Name("array_blocking_queue/batch<int>")
+	->ArgName("batch")
+	->RangeMultiplier(4)->Range(1, 256)
+	->UseManualTime()
+	->Unit(benchmark::kMillisecond);
+
+/*
+ * Uncontended cost of each wait policy: one thread pushes and pops the
+ * same int, so no turn is ever waited for and only the release path of
+ * a parking policy differs from a non-parking one.
+*/
+template<typename WaitPolicy>
+static void abq_uncontended(benchmark::State& state)
+{
+	array_blocking_queue<int, WaitPolicy> q{ 1024 };
+	int val = 0;
+	for (auto _ : state) {
+		q.push(val);
+		q.pop(val);
+		benchmark::DoNotOptimize(val);
+	}
+	state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()));
+}
+BENCHMARK_TEMPLATE(abq_uncontended, busy_wait)
+	->Name("array_blocking_queue/uncontended/busy_wait");
+BENCHMARK_TEMPLATE(abq_uncontended, spin_yield_wait<>)
+	->Name("array_blocking_queue/uncontended/spin_yield_wait");
+BENCHMARK_TEMPLATE(abq_uncontended, spin_park_wait<>)
+	->Name("array_blocking_queue/uncontended/spin_park_wait");
@@ -0,0 +1,96 @@
+#include "queue_benchmark.h"
+#include "../concurrent_data_structures/lock_free_linked_queue.h"
+#include "../concurrent_data_structures/spsc_ring.h"
+#include <boost/lockfree/queue.hpp>
+#if __has_include(<concurrentqueue/blockingconcurrentqueue.h>)
+#include <concurrentqueue/blockingconcurrentqueue.h>
+#define HUNGBIU_HAS_MOODYCAMEL
+#elif __has_include(<blockingconcurrentqueue.h>)
+#include <blockingconcurrentqueue.h>
+#define HUNGBIU_HAS_MOODYCAMEL
+#endif
+using namespace hungbiu;
+using namespace hungbiu::bench;
+
+/*
+ * Other queues to compare array_blocking_queue and
+ * linked_blocking_queue against.
+*/
+
+template<typename T>
+struct lock_free_adapter
+{
+	lock_free_linked_queue<T> q_;
+
+	explicit lock_free_adapter(std::size_t) {}
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop() { return q_.pop(); }
+};
+HUNGBIU_QUEUE_BENCHMARK("lock_free_linked_queue", lock_free_adapter, sweep_unbounded);
+
+// Single producer, single consumer only
+template<typename T>
+struct spsc_adapter
+{
+	spsc_ring<T> q_;
+
+	explicit spsc_adapter(std::size_t capacity) : q_(capacity) {}
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop()
+	{
+		T val{};
+		q_.pop(val);
+		return val;
+	}
+};
+static void sweep_spsc(benchmark::internal::Benchmark* b)
+{
+	for (std::int64_t cap : { 64, 1024, 65536 }) b->Args({ 1, 1, cap });
+	b->ArgNames({ "producers", "consumers", "capacity" });
+	b->UseManualTime();
+	b->Unit(benchmark::kMillisecond);
+}
+HUNGBIU_QUEUE_BENCHMARK("spsc_ring", spsc_adapter, sweep_spsc);
+
+/*
+ * boost::lockfree::queue, bounded by preallocating capacity nodes
+ * and pushing with bounded_push(). Requires a trivial T, so there's
+ * no std::string run.
+*/
+template<typename T>
+struct boost_adapter
+{
+	boost::lockfree::queue<T> q_;
+
+	explicit boost_adapter(std::size_t capacity) : q_(capacity) {}
+	void push(T&& val) { spin_until([&]() { return q_.bounded_push(val); }); }
+	T pop()
+	{
+		T val{};
+		spin_until([&]() { return q_.pop(val); });
+		return val;
+	}
+};
+BENCHMARK_TEMPLATE(run, boost_adapter<int>, int)
+	->Name("boost::lockfree::queue<int>")->Apply(sweep_bounded);
+BENCHMARK_TEMPLATE(run, boost_adapter<payload64>, payload64)
+	->Name("boost::lockfree::queue<payload64>")->Apply(sweep_bounded);
+
+#ifdef HUNGBIU_HAS_MOODYCAMEL
+// Unbounded, consumers block in wait_dequeue()
+template<typename T>
+struct moodycamel_adapter
+{
+	moodycamel::BlockingConcurrentQueue<T> q_;
+
+	explicit moodycamel_adapter(std::size_t) : q_(Items_N) {}
+	void push(T&& val) { q_.enqueue(std::move(val)); }
+	T pop()
+	{
+		T val{};
+		q_.wait_dequeue(val);
+		return val;
+	}
+};
+HUNGBIU_QUEUE_BENCHMARK("moodycamel::BlockingConcurrentQueue", moodycamel_adapter, sweep_unbounded);
+#endif
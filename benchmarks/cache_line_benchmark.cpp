@@ -0,0 +1,84 @@
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../concurrent_data_structures/cache_line.h"
+#include "../concurrent_data_structures/thread_pool.h"	// cpu_topology
+using namespace hungbiu;
+
+/*
+ * Effect of the padding in cache_line.h: every thread increments its own
+ * counter, laid out Stride bytes from its neighbours'. With counters on
+ * one line the threads fight over it; a line apart, x86's adjacent-line
+ * prefetcher still pairs them; False_Sharing_Size apart, as padded<>
+ * places them, they run independently.
+*/
+namespace
+{
+	constexpr std::size_t Threads_Max = 64;
+	constexpr std::size_t Increments_N = 1 << 20;
+
+	template<std::size_t Stride>
+	struct alignas(False_Sharing_Size) counters
+	{
+		static constexpr std::size_t Per_Counter = Stride / sizeof(std::atomic<std::uint64_t>);
+		std::atomic<std::uint64_t> c_[Threads_Max * Per_Counter];
+
+		std::atomic<std::uint64_t>& get(std::size_t i) noexcept { return c_[i * Per_Counter]; }
+	};
+	struct padded_counters
+	{
+		padded<std::atomic<std::uint64_t>> c_[Threads_Max];
+
+		std::atomic<std::uint64_t>& get(std::size_t i) noexcept { return *c_[i]; }
+	};
+
+	template<typename Counters>
+	void increment(benchmark::State& state)
+	{
+		const auto threads_n = static_cast<std::size_t>(state.range(0));
+		auto counters = std::make_unique<Counters>();
+		for (auto _ : state) {
+			std::atomic<std::size_t> ready{ 0 };
+			std::atomic<bool> go{ false };
+			std::vector<std::thread> threads;
+			for (std::size_t t = 0; t < threads_n; ++t) {
+				threads.emplace_back([&, t]() {
+					auto& c = counters->get(t);
+					ready.fetch_add(1);
+					while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+					for (std::size_t i = 0; i < Increments_N; ++i) {
+						c.fetch_add(1, std::memory_order_relaxed);
+					}
+				});
+			}
+			while (ready.load() != threads_n) std::this_thread::yield();
+			const auto start = std::chrono::steady_clock::now();
+			go.store(true, std::memory_order_release);
+			for (auto& t : threads) t.join();
+			state.SetIterationTime(std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count());
+		}
+		state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * threads_n * Increments_N));
+	}
+
+	void sweep_threads(benchmark::internal::Benchmark* b)
+	{
+		const auto cores = std::min<std::size_t>(cpu_topology::get().concurrency(), Threads_Max);
+		for (std::size_t n = 1; n < cores; n *= 2) b->Arg(static_cast<std::int64_t>(n));
+		b->Arg(static_cast<std::int64_t>(cores));
+		b->ArgNames({ "threads" });
+		b->UseManualTime();
+		b->Unit(benchmark::kMillisecond);
+	}
+}
+
+BENCHMARK_TEMPLATE(increment, counters<sizeof(std::uint64_t)>)
+	->Name("false_sharing/same_line")->Apply(sweep_threads);
+BENCHMARK_TEMPLATE(increment, counters<Cache_Line_Size>)
+	->Name("false_sharing/adjacent_lines")->Apply(sweep_threads);
+BENCHMARK_TEMPLATE(increment, padded_counters)
+	->Name("false_sharing/padded")->Apply(sweep_threads);
@@ -0,0 +1,36 @@
+#include "queue_benchmark.h"
+#include "../concurrent_data_structures/linked_blocking_queue.h"
+#include "../concurrent_data_structures/segmented_queue.h"
+using namespace hungbiu;
+using namespace hungbiu::bench;
+
+template<typename T>
+struct lbq_adapter
+{
+	linked_blocking_queue<T> q_;
+
+	// Unbounded; reserve one iteration's worth of nodes so the
+	// steady state doesn't measure slab allocation
+	explicit lbq_adapter(std::size_t) { q_.reserve(Items_N); }
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop() { return q_.pop(); }
+};
+
+HUNGBIU_QUEUE_BENCHMARK("linked_blocking_queue", lbq_adapter, sweep_unbounded);
+
+// The other unbounded blocking queue, segments of array_blocking_queue slots
+template<typename T>
+struct segmented_adapter
+{
+	segmented_queue<T> q_;
+
+	explicit segmented_adapter(std::size_t) {}
+	void push(T&& val) { q_.push(std::move(val)); }
+	T pop()
+	{
+		T val{};
+		q_.pop(val);
+		return val;
+	}
+};
+HUNGBIU_QUEUE_BENCHMARK("segmented_queue", segmented_adapter, sweep_unbounded);
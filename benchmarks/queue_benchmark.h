@@ -0,0 +1,214 @@
+#pragma once
+#include <benchmark/benchmark.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../concurrent_data_structures/thread_pool.h"	// thread_array, cpu_topology
+
+namespace hungbiu::bench
+{
+	/*
+	 * Shared harness for the queue benchmarks.
+	 *
+	 * Every element carries a sequence number. A producer stamps the time
+	 * right before pushing element seq into stamps[seq]; the consumer that
+	 * pops it records now - stamps[seq], so the enqueue-to-dequeue latency
+	 * includes the time spent in the queue, not only in push/pop. The queue's
+	 * own release/acquire makes the stamp visible to the consumer.
+	 *
+	 * Throughput is reported as items_per_second over the time between all
+	 * threads being released and the last one finishing, latency percentiles
+	 * as p50/p99/p999 counters in nanoseconds.
+	*/
+
+	// Element types
+	struct payload64
+	{
+		std::uint64_t seq_;
+		char pad_[56];
+	};
+	static_assert(sizeof(payload64) == 64);
+
+	template<typename T> struct element;
+	template<> struct element<int>
+	{
+		static int make(std::size_t seq) noexcept { return static_cast<int>(seq); }
+		static std::size_t seq(int v) noexcept { return static_cast<std::size_t>(v); }
+	};
+	template<> struct element<payload64>
+	{
+		static payload64 make(std::size_t seq) noexcept
+		{
+			payload64 p;
+			p.seq_ = seq;
+			std::memset(p.pad_, 0, sizeof(p.pad_));
+			return p;
+		}
+		static std::size_t seq(const payload64& v) noexcept { return v.seq_; }
+	};
+	template<> struct element<std::string>
+	{
+		// Long enough to defeat the small string optimization
+		static std::string make(std::size_t seq)
+		{
+			auto s = std::to_string(seq);
+			s.resize(32, ' ');
+			return s;
+		}
+		static std::size_t seq(const std::string& v) { return std::stoull(v); }
+	};
+
+	inline std::uint64_t now_ns() noexcept
+	{
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Elements moved per benchmark iteration
+	constexpr std::size_t Items_N = 1 << 16;
+
+	/*
+	 * @brief	producers, consumers pairs from 1 to 2 x cores in powers of two
+	 * @param	capacities	capacities to sweep, pass { 0 } for unbounded queues
+	 * @param	oversubscribe	false to skip runs with more threads than cores,
+	 *						for wait policies that never give up the CPU
+	*/
+	inline void sweep(benchmark::internal::Benchmark* b,
+					  std::vector<std::int64_t> capacities,
+					  bool oversubscribe = true)
+	{
+		const auto cores = static_cast<std::int64_t>(cpu_topology::get().concurrency());
+		const auto max_threads = 2 * cores;
+		std::vector<std::int64_t> counts;
+		for (std::int64_t n = 1; n < max_threads; n *= 2) counts.push_back(n);
+		counts.push_back(max_threads);
+		for (auto cap : capacities) {
+			for (auto p : counts) {
+				for (auto c : counts) {
+					// Always keep the 1:1 run
+					if (!oversubscribe && p + c > std::max<std::int64_t>(cores, 2)) continue;
+					b->Args({ p, c, cap });
+				}
+			}
+		}
+		b->ArgNames({ "producers", "consumers", "capacity" });
+		b->UseManualTime();
+		b->Unit(benchmark::kMillisecond);
+	}
+	inline void sweep_bounded(benchmark::internal::Benchmark* b)
+	{
+		sweep(b, { 64, 1024, 65536 });
+	}
+	inline void sweep_bounded_no_oversubscribe(benchmark::internal::Benchmark* b)
+	{
+		sweep(b, { 64, 1024, 65536 }, false);
+	}
+	inline void sweep_unbounded(benchmark::internal::Benchmark* b)
+	{
+		sweep(b, { 0 });
+	}
+
+	/*
+	 * Adapter interface expected by run():
+	 *	struct adapter {
+	 *		explicit adapter(std::size_t capacity);
+	 *		void push(T&&);		// blocks or spins until accepted
+	 *		T pop();			// blocks or spins until available
+	 *	};
+	*/
+	template<typename Adapter, typename T>
+	void run(benchmark::State& state)
+	{
+		const auto producers_n = static_cast<std::size_t>(state.range(0));
+		const auto consumers_n = static_cast<std::size_t>(state.range(1));
+		const auto capacity = static_cast<std::size_t>(state.range(2));
+		const auto per_producer = Items_N / producers_n;
+		const auto total = per_producer * producers_n;
+
+		std::vector<std::uint64_t> stamps(total);
+		std::vector<std::uint64_t> latencies;
+		std::vector<std::vector<std::uint64_t>> local(consumers_n);
+		for (auto& v : local) v.reserve(total);
+
+		for (auto _ : state) {
+			Adapter q{ capacity };
+			std::atomic<std::size_t> ready{ 0 };
+			std::atomic<bool> go{ false };
+			std::atomic<std::size_t> claimed{ 0 };
+			for (auto& v : local) v.clear();
+
+			auto wait_go = [&]() {
+				ready.fetch_add(1);
+				while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+			};
+			std::vector<std::thread> threads;
+			for (std::size_t p = 0; p < producers_n; ++p) {
+				threads.emplace_back([&, p]() {
+					wait_go();
+					for (auto seq = p * per_producer; seq < (p + 1) * per_producer; ++seq) {
+						auto val = element<T>::make(seq);
+						stamps[seq] = now_ns();
+						q.push(std::move(val));
+					}
+				});
+			}
+			for (std::size_t c = 0; c < consumers_n; ++c) {
+				threads.emplace_back([&, c]() {
+					wait_go();
+					auto& lat = local[c];
+					while (claimed.fetch_add(1, std::memory_order_relaxed) < total) {
+						auto val = q.pop();
+						const auto t = now_ns();
+						lat.push_back(t - stamps[element<T>::seq(val)]);
+						benchmark::DoNotOptimize(val);
+					}
+				});
+			}
+			while (ready.load() != threads.size()) std::this_thread::yield();
+			const auto start = std::chrono::steady_clock::now();
+			go.store(true, std::memory_order_release);
+			for (auto& t : threads) t.join();
+			const auto elapsed = std::chrono::steady_clock::now() - start;
+			state.SetIterationTime(std::chrono::duration<double>(elapsed).count());
+
+			for (auto& v : local) latencies.insert(latencies.end(), v.begin(), v.end());
+		}
+		state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * total));
+
+		auto percentile = [&](double q) {
+			if (latencies.empty()) return 0.0;
+			auto k = static_cast<std::size_t>(q * (latencies.size() - 1));
+			std::nth_element(latencies.begin(), latencies.begin() + k, latencies.end());
+			return static_cast<double>(latencies[k]);
+		};
+		state.counters["p50_ns"] = percentile(0.50);
+		state.counters["p99_ns"] = percentile(0.99);
+		state.counters["p999_ns"] = percentile(0.999);
+	}
+
+	// Busy retry for queues without blocking operations
+	template<typename F>
+	void spin_until(F f)
+	{
+		for (unsigned i = 0; !f(); ++i) {
+			if (i < 64) cpu_relax();
+			else std::this_thread::yield();
+		}
+	}
+}
+
+// Register run<Adapter<T>, T> for the three element types;
+// expects hungbiu::bench to be a using-directive in the translation unit
+#define HUNGBIU_QUEUE_BENCHMARK(name, adapter, sweep_fn)											\
+	BENCHMARK_TEMPLATE(run, adapter<int>, int)														\
+		->Name(name "<int>")->Apply(sweep_fn);														\
+	BENCHMARK_TEMPLATE(run, adapter<payload64>, payload64)							\
+		->Name(name "<payload64>")->Apply(sweep_fn);												\
+	BENCHMARK_TEMPLATE(run, adapter<std::string>, std::string)										\
+		->Name(name "<string>")->Apply(sweep_fn)
@@ -5,19 +5,62 @@
 #include <type_traits>
 #include <cstdlib>
 #include <cassert>
+#include <thread>
+#include <iterator>
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <utility>
+#include "wait_policy.h"
+#include "queue_closed.h"
+#include "divider.h"
+#include "page_allocator.h"
+#include "contention_stats.h"
+#include "cache_line.h"
 
 namespace hungbiu
 {
-	template<typename T>
+	/*
+	 * Slot layouts for array_blocking_queue
+	 * padded_layout:	every slot starts on its own cache line, so threads
+	 *					working on neighbouring tickets never share a line.
+	 *					Costs at least a cache line per element.
+	 * compact_layout:	slots are packed densely and tickets are remapped so
+	 *					that consecutive tickets still land on different lines.
+	 *					Costs sizeof(turn) + sizeof(T) per element.
+	*/
+	struct padded_layout {};
+	struct compact_layout {};
+
+	// Capacity of an array_blocking_queue given to its constructor
+	inline constexpr std::size_t dynamic_capacity = 0;
+
+	/*
+	 * Capacity:	dynamic_capacity allocates the slots on the heap, sized
+	 *				at run time. Any other value embeds Capacity slots in the
+	 *				queue itself and makes the index and turn math constant
+	 *				divisions, see static_array_blocking_queue.
+	*/
+	template<typename T, 
+			 typename WaitPolicy = spin_park_wait<>, 
+			 typename Layout = padded_layout,
+			 std::size_t Capacity = dynamic_capacity>
 	class array_blocking_queue
 	{
-		#define ALIGN_REQ alignas(std::hardware_destructive_interference_size)
+		static_assert(std::is_same_v<Layout, padded_layout> || 
+					  std::is_same_v<Layout, compact_layout>,
+					  "Layout must be padded_layout or compact_layout");
+		static constexpr bool Padded = std::is_same_v<Layout, padded_layout>;
+		static constexpr bool Static = Capacity != dynamic_capacity;
+		static_assert(Capacity != 1, "Capacity must be at least 2");
 
 		using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
 		template<typename U>
 		struct slot_t
 		{
-			ALIGN_REQ std::atomic<std::size_t> turn_{ 0 };
+			alignas(Padded ? Cache_Line_Size
+						   : alignof(std::atomic<std::size_t>))
+			std::atomic<std::size_t> turn_{ 0 };
 			storage_t val_;
 			~slot_t()
 			{
@@ -27,7 +70,18 @@ namespace hungbiu
 			}			
 			bool has_val() noexcept 
 			{
-				return turn_.load(std::memory_order_acquire) & 1;
+				const auto turn = turn_.load(std::memory_order_acquire);
+				return (turn & 1) && !(turn & Skipped_Bit);
+			}
+			// Current turn, without Parked_Bit and Skipped_Bit: a skipped
+			// slot is claimed like a written one, see skip()
+			std::size_t turn() const noexcept
+			{
+				return turn_.load(std::memory_order_acquire) & ~(Parked_Bit | Skipped_Bit);
+			}
+			bool skipped() const noexcept
+			{
+				return turn_.load(std::memory_order_acquire) & Skipped_Bit;
 			}
 			template <typename ...Args> 
 			void construct(Args&&... args) 
@@ -35,77 +89,662 @@ namespace hungbiu
 			{				
 				new (&val_) U(std::forward<Args>(args)...);
 			}
+			// Default-initialized: trivial members are left unwritten
+			void construct_default() noexcept(std::is_nothrow_default_constructible<U>::value)
+			{
+				new (&val_) U;
+			}
+			// The object constructed in val_, reached through std::launder
+			U* get() noexcept
+			{
+				return std::launder(reinterpret_cast<U*>(&val_));
+			}
 			void destroy() noexcept(std::is_nothrow_destructible<U>::value)
 			{
-				reinterpret_cast<U*>(&val_)->~U();
+				get()->~U();
 			}
 		};
 
-		const std::size_t capacity_;
-		slot_t<T>* array_;
-		ALIGN_REQ std::atomic<std::size_t> head_  { 0 };
-		ALIGN_REQ std::atomic<std::size_t> tail_  { 0 };
+		// Number of slots sharing a cache line in the compact layout, 
+		// rounded down to a power of two
+		static constexpr std::size_t slots_per_line() noexcept
+		{
+			std::size_t n = 1;
+			while (n * 2 * sizeof(slot_t<T>) <= Cache_Line_Size) {
+				n *= 2;
+			}
+			return n;
+		}
+
+		// Columns of the compact layout: the largest power of two dividing
+		// the capacity, up to a line, leaving at least two rows
+		static constexpr std::size_t compact_cols(std::size_t capacity) noexcept
+		{
+			return std::min({ slots_per_line(),
+							  capacity & (~capacity + 1),
+							  capacity / 2 });
+		}
+
+		/*
+		 * Capacity and the ticket to slot math. A run time capacity divides
+		 * through precomputed reciprocals, see divider; a compile time one
+		 * leaves it to the compiler, which does the same or a mask.
+		*/
+		struct dynamic_extent
+		{
+			std::size_t capacity_;
+			divider lap_;
+			// Ticket to index remapping of the compact layout
+			divider rows_;
+			std::size_t cols_{ 1 };
+
+			explicit dynamic_extent(std::size_t capacity) :
+				capacity_(capacity),
+				lap_(capacity)
+			{
+				if constexpr (!Padded) {
+					cols_ = compact_cols(capacity_);
+					rows_ = divider{ capacity_ / cols_ };
+				}
+			}
+			std::size_t capacity() const noexcept { return capacity_; }
+			std::size_t lap(std::size_t ticket) const noexcept
+			{
+				return static_cast<std::size_t>(lap_.divide(ticket));
+			}
+			std::size_t index(std::size_t ticket) const noexcept
+			{
+				const auto i = static_cast<std::size_t>(lap_.modulo(ticket));
+				if constexpr (Padded) {
+					return i;
+				}
+				else {
+					const auto row = static_cast<std::size_t>(rows_.divide(i));
+					return (i - row * rows_.divisor()) * cols_ + row;
+				}
+			}
+		};
+		struct static_extent
+		{
+			static constexpr std::size_t Cols = compact_cols(Capacity);
+			static constexpr std::size_t Rows = Capacity / (Cols ? Cols : 1);
+
+			static constexpr std::size_t capacity() noexcept { return Capacity; }
+			static constexpr std::size_t lap(std::size_t ticket) noexcept
+			{
+				return ticket / Capacity;
+			}
+			static constexpr std::size_t index(std::size_t ticket) noexcept
+			{
+				const auto i = ticket % Capacity;
+				if constexpr (Padded) {
+					return i;
+				}
+				else {
+					return i % Rows * Cols + i / Rows;
+				}
+			}
+		};
+
+		// Set in tail_ by close(); every write ticket drawn afterwards has it
+		static constexpr std::size_t Closed_Bit = std::size_t{ 1 } << (sizeof(std::size_t) * 8 - 1);
+		// Set in a slot's turn_ by a waiter about to park on it, cleared by
+		// the next release, which then unparks; see mark_parked()
+		static constexpr std::size_t Parked_Bit = Closed_Bit;
+		// Set with a read turn by a producer whose element failed to
+		// construct: the slot holds nothing, its consumer steps over it
+		static constexpr std::size_t Skipped_Bit = Closed_Bit >> 1;
+
+		const std::conditional_t<Static, static_extent, dynamic_extent> extent_;
+		// Embedded for a compile time capacity
+		std::conditional_t<Static, slot_t<T>[Static ? Capacity : 1], slot_t<T>*> array_;
+		// Pages holding array_, unless it came from malloc
+		struct no_region {};
+		std::conditional_t<Static, no_region, page_region> region_;
+		padded<std::atomic<std::size_t>> head_{ 0 };
+		padded<std::atomic<std::size_t>> tail_{ 0 };
+		// Number of write tickets handed out before close()
+		std::atomic<std::size_t> closed_tail_{ SIZE_MAX };
+		struct no_parking_lot {};
+		std::conditional_t<WaitPolicy::parks, parking_lot, no_parking_lot> lot_;
+		// Empty unless HUNGBIU_ENABLE_STATS is defined
+		contention_stats stats_;
 		
-		slot_t<T>* allocate()
+		// Heap slots only; embedded ones live and die with the queue
+		slot_t<T>* allocate(const memory_placement& placement)
 		{
-			auto p = malloc(sizeof(slot_t<T>) * capacity_);
+			const auto bytes = sizeof(slot_t<T>) * extent_.capacity();
+			if (!placement.is_default()) {
+				region_ = page_region{ bytes, placement };
+				return static_cast<slot_t<T>*>(region_.data());
+			}
+			auto p = malloc(bytes);
 			if (!p) throw std::bad_alloc{};
 			return static_cast<slot_t<T>*>(p);
 		}
 		void construct()
 		{
-			for (auto i = 0u; i < capacity_; ++i) {
+			for (auto i = 0u; i < extent_.capacity(); ++i) {
 				new (&array_[i]) slot_t<T>();
 			}
 		}
 		void destroy()
 		{
-			for (size_t i = 0; i < capacity_; ++i) {
+			for (size_t i = 0; i < extent_.capacity(); ++i) {
 				array_[i].~slot_t<T>();
 			}
 		}
 		void deallocate()
 		{
-			free(static_cast<void*>(array_));
+			if (!region_.data()) {
+				free(static_cast<void*>(array_));
+			}
 		}
+		/*
+		 * Padded layout maps ticket i to slot i % capacity.
+		 * Compact layout views the array as a cols x rows matrix, where 
+		 * a row is one cache line worth of slots, and fills it column by
+		 * column: consecutive tickets go to consecutive rows, i.e. to
+		 * different cache lines, and a line is only revisited after every
+		 * other line got a slot. cols divides the capacity, so it's a bijection.
+		 * Neither needs a div instruction, see the extents.
+		*/
 		std::size_t get_idx(std::size_t ticket) const noexcept
 		{
-			return ticket & (capacity_ - 1);
+			return extent_.index(ticket);
 		}
 		std::size_t get_write_turn(std::size_t ticket) const noexcept
 		{
-			return ticket / capacity_ * 2;
+			return extent_.lap(ticket) * 2;
 		}
 		std::size_t get_read_turn(std::size_t ticket) const noexcept
 		{
-			return ticket / capacity_ * 2 + 1;
+			return extent_.lap(ticket) * 2 + 1;
+		}
+		struct never_abort
+		{
+			bool operator()() const noexcept { return false; }
+		};
+		/*
+		 * Block until slot.turn_ reaches turn or abort() returns true,
+		 * following WaitPolicy. Return whether the turn was reached.
+		 * The first check is done before any spinning so the uncontended
+		 * path costs nothing more than a load.
+		*/
+		template<typename Abort = never_abort>
+		bool wait_for_turn(slot_t<T>& slot, const std::size_t idx, const std::size_t turn,
+						   Abort abort = Abort{})
+		{
+			auto is_my_turn = [&]() {
+				return turn == slot.turn();
+			};
+			auto done = [&]() {
+				return is_my_turn() || abort();
+			};
+			if (is_my_turn()) return true;
+
+			std::size_t spins = 0, yields = 0;
+			auto finish = [&](bool parked) {
+				stats_.add(stat_counter::wait_spins, spins);
+				stats_.add(stat_counter::wait_yields, yields);
+				if (parked) stats_.add(stat_counter::parks);
+				return is_my_turn();
+			};
+			backoff b;
+			while (spins < WaitPolicy::spin_limit) {
+				spins += b.pause();
+				if (done()) return finish(false);
+			}
+			while (yields < WaitPolicy::yield_limit) {
+				std::this_thread::yield();
+				++yields;
+				if (done()) return finish(false);
+			}
+			if constexpr (WaitPolicy::parks) {
+				lot_.park(idx, [&]() { mark_parked(slot); return done(); });
+				return finish(true);
+			}
+			else {
+				while (!done()) {
+					std::this_thread::yield();
+					++yields;
+				}
+				return finish(false);
+			}
+		}
+		/*
+		 * A read ticket drawn at or after the closing tail will never be
+		 * written to. Its consumer gives up instead of waiting.
+		*/
+		bool never_written(const std::size_t read_ticket) const noexcept
+		{
+			return read_ticket >= closed_tail_.load(std::memory_order_acquire);
+		}
+		bool drained() const noexcept
+		{
+			return never_written(head_->load(std::memory_order_acquire));
+		}
+		/*
+		 * Destroy and release the elements of read tickets [first, last),
+		 * claimed by a batch pop that threw halfway, so their slots go
+		 * back to the producers. Waits for each to be written, stopping
+		 * at the first one that never will be.
+		*/
+		void discard_claimed(std::size_t first, const std::size_t last)
+		{
+			for (; first != last; ++first) {
+				const auto idx = get_idx(first);
+				auto& slot = array_[idx];
+				if (!wait_for_turn(slot, idx, get_read_turn(first),
+								   [&]() { return never_written(first); })) {
+					return;
+				}
+				if (!slot.skipped()) slot.destroy();
+				done_reading(slot, first);
+			}
+		}
+		/*
+		 * Skip write tickets [first, last), claimed by a batch push whose
+		 * element at first failed to construct. Waits for each to come
+		 * round, like the push would have.
+		*/
+		void skip_claimed(std::size_t first, const std::size_t last)
+		{
+			for (; first != last; ++first) {
+				const auto idx = get_idx(first);
+				auto& slot = array_[idx];
+				wait_for_turn(slot, idx, get_write_turn(first));
+				skip(slot, first);
+			}
+		}
+		/*
+		 * Timed counterpart of wait_for_turn: block until ready() or deadline,
+		 * following WaitPolicy, and return the last value of ready().
+		 * The clock is only read once the backoff has reached its cap.
+		*/
+		template<typename Pred, typename Clock, typename Duration>
+		bool wait_until(slot_t<T>& slot, const std::size_t idx, Pred ready,
+						const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			if (ready()) return true;
+
+			backoff b;
+			for (std::size_t spins = 0; spins < WaitPolicy::spin_limit; ) {
+				spins += b.pause();
+				if (ready()) return true;
+				if (b.rounds() == Backoff_Cap && Clock::now() >= deadline) return false;
+			}
+			for (std::size_t i = 0; i < WaitPolicy::yield_limit; ++i) {
+				std::this_thread::yield();
+				if (ready()) return true;
+				if (Clock::now() >= deadline) return false;
+			}
+			if constexpr (WaitPolicy::parks) {
+				return lot_.park_until(idx, [&]() { mark_parked(slot); return ready(); }, deadline);
+			}
+			else {
+				while (!ready()) {
+					if (Clock::now() >= deadline) return false;
+					std::this_thread::yield();
+				}
+				return true;
+			}
+		}
+		/*
+		 * Try-then-park loop behind the timed operations.
+		 * No ticket is claimed until try_op() succeeds, so giving up at the
+		 * deadline leaves nothing behind. Between attempts the thread waits
+		 * on the slot at the current ticket of end (head_ or tail_): the
+		 * next attempt can only succeed after that slot changes turn, which
+		 * unparks its index once the waiter has flagged it.
+		*/
+		template<typename TryOp, typename GiveUp, typename Clock, typename Duration>
+		bool retry_until(const std::atomic<std::size_t>& end, TryOp try_op, GiveUp give_up,
+						 const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			for (;;) {
+				// Observe the slot before trying, so a change in
+				// between makes the wait return at once
+				const auto ticket = end.load(std::memory_order_acquire);
+				const auto idx = get_idx(ticket);
+				auto& slot = array_[idx];
+				const auto turn = slot.turn();
+
+				if (try_op()) return true;
+				if (give_up()) return false;
+
+				auto changed = [&]() {
+					return turn != slot.turn() ||
+						   ticket != end.load(std::memory_order_acquire) ||
+						   give_up();
+				};
+				if (!wait_until(slot, idx, changed, deadline)) {
+					// Deadline reached, one last attempt
+					return try_op();
+				}
+			}
+		}
+		/*
+		 * Parking is paid for by the waiters: one about to sleep on a slot
+		 * flags it with an RMW on its turn_, from inside park() after it has
+		 * registered in its cell. A release swaps in the next turn with an
+		 * RMW too; both RMWs being ordered on turn_, either the waiter sees
+		 * the new turn and doesn't sleep, or the release sees Parked_Bit and
+		 * unparks. A release finding no flag leaves the parking lot alone,
+		 * so an uncontended push or pop costs one RMW on the slot's own line
+		 * and never touches the cells shared between slots.
+		 * Without parking the release stays a plain store.
+		*/
+		void mark_parked(slot_t<T>& slot) noexcept
+		{
+			slot.turn_.fetch_or(Parked_Bit, std::memory_order_acq_rel);
+		}
+		void release_turn(slot_t<T>& slot, const std::size_t idx, const std::size_t next_turn)
+		{
+			if constexpr (WaitPolicy::parks) {
+				if (slot.turn_.exchange(next_turn, std::memory_order_acq_rel) & Parked_Bit) {
+					lot_.unpark(idx);
+				}
+			}
+			else {
+				slot.turn_.store(next_turn, std::memory_order_release);
+			}
 		}
 		void done_writing(slot_t<T>& slot, const std::size_t write_ticket)
 		{
-			const auto read_turn = get_read_turn(write_ticket);
-			slot.turn_.store(read_turn, std::memory_order_release);
+			release_turn(slot, get_idx(write_ticket), get_read_turn(write_ticket));
+		}
+		void done_reading(slot_t<T>& slot, const std::size_t read_ticket)
+		{
+			release_turn(slot, get_idx(read_ticket), get_read_turn(read_ticket) + 1);
+		}
+		/*
+		 * Hand a write ticket whose element failed to construct over to its
+		 * consumer all the same, flagged empty: whoever claims it releases
+		 * it and moves on to the next ticket, so nobody waits on it forever
+		 * and close() still drains past it.
+		*/
+		void skip(slot_t<T>& slot, const std::size_t write_ticket)
+		{
+			release_turn(slot, get_idx(write_ticket), get_read_turn(write_ticket) | Skipped_Bit);
+		}
+		// Construct the element of a claimed write ticket and publish it,
+		// or skip the ticket and rethrow if constructing throws
+		template<typename Construct>
+		void fill(const std::size_t write_ticket, Construct construct)
+		{
+			auto& slot = array_[get_idx(write_ticket)];
+			try {
+				construct(slot);
+			}
+			catch (...) {
+				skip(slot, write_ticket);
+				throw;
+			}
+			done_writing(slot, write_ticket);
+		}
+		/*
+		 * Ticket claims shared by the modifiers: on success the caller owns
+		 * the slot of the ticket, its turn reached, and hands it back with
+		 * done_writing/done_reading. The read claims step over skipped
+		 * tickets, releasing them.
+		 *	claim_write/claim_read:			block; claim_write throws queue_closed,
+		 *									claim_read returns false once a
+		 *									closed queue is drained
+		 *	try_claim_write/try_claim_read:	return false if no slot is ready,
+		 *									see try_push/try_emplace
+		**/
+		std::size_t claim_write()
+		{
+			// Acquire a write ticket
+			const auto write_ticket = tail_->fetch_add(1, std::memory_order_acq_rel);
+			if (write_ticket & Closed_Bit) { throw queue_closed{}; }
+			const auto idx = get_idx(write_ticket);
+
+			// Wait for my turn
+			wait_for_turn(array_[idx], idx, get_write_turn(write_ticket));
+			return write_ticket;
+		}
+		bool try_claim_write(std::size_t& write_ticket) noexcept
+		{
+			// Acquire a write ticket for trying
+			write_ticket = tail_->load(std::memory_order_acquire);
+			// Paced after a lost CAS, so losers don't retry in lockstep
+			backoff b;
+			for (;;) {
+				// Closed, the CAS below could never succeed
+				if (write_ticket & Closed_Bit) { return false; }
+				auto& slot = array_[get_idx(write_ticket)];
+	
+				// If it's probably my turn,
+				if (get_write_turn(write_ticket) == slot.turn())
+				{
+					// ...no thread is competing, the slot is mine
+					if (tail_->compare_exchange_strong(write_ticket,
+													  write_ticket + 1,
+													  std::memory_order_acq_rel)) {
+						return true;
+					}
+					// ...another thread already started constructing data,
+					// wait for its completion and go get another ticket
+					else {
+						stats_.add(stat_counter::cas_failures);
+						b.pause();
+						continue;
+					}
+				}
+				// It's not my turn,
+				else {
+					// ...get another ticket for trying
+					const auto old_ticket = write_ticket;
+					write_ticket = tail_->load(std::memory_order_acquire);
+
+					// ...other threads have completed constructing data, old_ticket expired
+					// try the new ticket
+					if (old_ticket != write_ticket) { continue; }
+					// ...ticket valid, but not my turn
+					else { return false; }
+				}
+			} // end of for loop
+		}
+		bool claim_read(std::size_t& read_ticket)
+		{
+			for (;;) {
+				// Acquire read ticket
+				read_ticket = head_->fetch_add(1, std::memory_order_acq_rel);
+				const auto idx = get_idx(read_ticket);
+				auto& slot = array_[idx];
+
+				// Wait for my turn, or for the queue to be closed before it
+				if (!wait_for_turn(slot, idx, get_read_turn(read_ticket),
+								   [&]() { return never_written(read_ticket); })) {
+					return false;
+				}
+				if (!slot.skipped()) return true;
+				done_reading(slot, read_ticket);
+			}
 		}
-		void done_reading(slot_t<T>& slot)
+		bool try_claim_read(std::size_t& read_ticket) noexcept
 		{
-			slot.turn_.fetch_add(1, std::memory_order_release);
+			// Acquire a read ticket for trying
+			read_ticket = head_->load(std::memory_order_acquire);
+			// Paced after a lost CAS, so losers don't retry in lockstep
+			backoff b;
+			for (;;) {
+				auto& slot = array_[get_idx(read_ticket)];
+
+				// If it's probably my turn
+				if (get_read_turn(read_ticket) == slot.turn()) {
+					// ...no thread is competing, start reading
+					if (head_->compare_exchange_strong(read_ticket,
+													  read_ticket + 1,
+													  std::memory_order_acq_rel)) {
+						if (!slot.skipped()) return true;
+						// ...nothing in it, release it and try the next one
+						done_reading(slot, read_ticket);
+						read_ticket = head_->load(std::memory_order_acquire);
+						continue;
+					}
+					// ...another thread already started reading,
+					// wait for its completion and get another ticket
+					else {
+						stats_.add(stat_counter::cas_failures);
+						b.pause();
+						continue;
+					}
+				}
+				// It's not my turn
+				else
+				{
+					const auto old_ticket = read_ticket;
+					read_ticket = head_->load(std::memory_order_acquire);
+
+					// ...other thread has completed reading the data, read_ticket expired
+					// try the new ticket
+					if (read_ticket != old_ticket) { continue; }
+					// ...ticket valid but not my turn
+					else { return false; }
+				}
+			}// end of for loop
 		}
+
+		// The handle of a claimed write ticket, see reserve
+		template<typename ...Args>
+		auto reserved(const std::size_t write_ticket, Args&&... args)
+		{
+			auto& slot = array_[get_idx(write_ticket)];
+			try {
+				construct_reserved(slot, std::forward<Args>(args)...);
+			}
+			catch (...) {
+				skip(slot, write_ticket);
+				throw;
+			}
+			return slot_handle<true>{ this, write_ticket };
+		}
+		// Without args default-initialized, see reserve
+		template<typename ...Args>
+		static void construct_reserved(slot_t<T>& slot, Args&&... args)
+		{
+			if constexpr (sizeof...(Args) == 0) {
+				slot.construct_default();
+			}
+			else {
+				slot.construct(std::forward<Args>(args)...);
+			}
+		}
+
+		/*
+		 * A claimed slot handed out by reserve (Write) or peek: the element
+		 * in it is reached like through a pointer. Finishing it, by commit()
+		 * or release() or when the handle goes out of scope, publishes the
+		 * element to consumers (Write) or destroys it and frees the slot
+		 * for producers.
+		**/
+		template<bool Write>
+		class slot_handle
+		{
+			friend class array_blocking_queue;
+
+			array_blocking_queue* q_ = nullptr;
+			slot_t<T>* slot_ = nullptr;
+			std::size_t ticket_ = 0;
+
+			slot_handle(array_blocking_queue* q, const std::size_t ticket) noexcept :
+				q_(q), slot_(&q->array_[q->get_idx(ticket)]), ticket_(ticket)
+			{}
+			void finish() noexcept
+			{
+				if (!q_) return;
+				if constexpr (Write) {
+					q_->done_writing(*slot_, ticket_);
+				}
+				else {
+					slot_->destroy();
+					q_->done_reading(*slot_, ticket_);
+				}
+				q_ = nullptr;
+			}
+		public:
+			// Empty, holds no slot
+			slot_handle() = default;
+			slot_handle(slot_handle&& other) noexcept :
+				q_(std::exchange(other.q_, nullptr)), slot_(other.slot_), ticket_(other.ticket_)
+			{}
+			slot_handle& operator=(slot_handle&& other) noexcept
+			{
+				if (this != &other) {
+					finish();
+					q_ = std::exchange(other.q_, nullptr);
+					slot_ = other.slot_;
+					ticket_ = other.ticket_;
+				}
+				return *this;
+			}
+			~slot_handle()
+			{
+				finish();
+			}
+
+			explicit operator bool() const noexcept { return q_ != nullptr; }
+			T& operator*() const noexcept { return *slot_->get(); }
+			T* operator->() const noexcept { return slot_->get(); }
+
+			// Publish the element, the handle is empty afterwards
+			template<bool W = Write, std::enable_if_t<W, int> = 0>
+			void commit() noexcept { finish(); }
+			// Destroy the element and free the slot, the handle is empty afterwards
+			template<bool W = Write, std::enable_if_t<!W, int> = 0>
+			void release() noexcept { finish(); }
+		};
 	public:
 		// ctor
-		array_blocking_queue(std::size_t capacity) :
-			capacity_(capacity)
+		/*
+		 * placement:	pages and NUMA nodes for the slot array, which comes
+		 *				from malloc by default; see memory_placement.
+		 *				Prefaulting keeps page faults out of push and pop.
+		*/
+		template<bool S = Static, std::enable_if_t<!S, int> = 0>
+		array_blocking_queue(std::size_t capacity, const memory_placement& placement = {}) :
+			extent_(capacity)
 		{
-			assert(capacity_ > 1);
-			assert(capacity_ % 2 == 0);
-
-			array_ = allocate();
+			assert(capacity > 1);
+			array_ = allocate(placement);
 			construct();
 		}
-					
+		// Compile time capacity, nothing to allocate
+		template<bool S = Static, std::enable_if_t<S, int> = 0>
+		array_blocking_queue() :
+			extent_{}
+		{}
+
 		// dtor
 		~array_blocking_queue()
 		{
-			destroy();
-			deallocate();
+			if constexpr (!Static) {
+				destroy();
+				deallocate();
+			}
+		}
+
+		std::size_t capacity() const noexcept
+		{
+			return extent_.capacity();
+		}
+
+		/*
+		 * Contention counters, all zero unless HUNGBIU_ENABLE_STATS is
+		 * defined, see contention_stats: lost CASes of the try_ operations,
+		 * spins, yields and parks waiting on a turn. depth_ is the number of
+		 * tickets between head_ and tail_, up to the capacity.
+		*/
+		stats_snapshot stats() const noexcept
+		{
+			auto snap = stats_.snapshot();
+			const auto tail = tail_->load(std::memory_order_relaxed) & ~Closed_Bit;
+			const auto head = head_->load(std::memory_order_relaxed);
+			snap.depth_ = tail > head ? std::min(tail - head, extent_.capacity()) : 0;
+			return snap;
 		}
 		
 		// Delete copy constructor and assignment operator
@@ -129,63 +768,30 @@ namespace hungbiu
 		*     return false; // NOT OUR TURN YET, OUT
 		* if (position.turn != turn_to_enqueue && ticket != tail_)
 		*     continue; // // SOMEONE HAVE DONE CONSTRUCTED, GET ANOTHER TICKET
+		* push/emplace block while the queue is full.
+		* If constructing the element throws, its ticket is skipped: the
+		* consumer drawing it steps over it, and the exception propagates.
 		**/
 		template<typename ...Args,
 			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
 		bool try_emplace(Args&&... args)
 			noexcept(std::is_nothrow_constructible<T, Args&&...>::value)
 		{
-			// Acquire a write ticket for trying
-			auto write_ticket = tail_.load(std::memory_order_acquire);
-			for (;;) {
-				auto& slot = array_[get_idx(write_ticket)];
-	
-				// If it's probably my turn,
-				if (get_write_turn(write_ticket) == slot.turn_.load(std::memory_order_acquire))
-				{
-					// ...no thread is competing, construct data
-					if (tail_.compare_exchange_strong(write_ticket,
-													  write_ticket + 1,
-													  std::memory_order_acq_rel)) {
-						slot.construct(std::forward<Args>(args)...);
-						done_writing(slot, write_ticket);
-						return true;
-					}
-					// ...another thread already started constructing data,
-					// wait for its completion and go get another ticket
-					else { continue; }
-				}
-				// It's not my turn,
-				else {
-					// ...get another ticket for trying
-					const auto old_ticket = write_ticket;
-					write_ticket = tail_.load(std::memory_order_acquire);
+			std::size_t write_ticket;
+			if (!try_claim_write(write_ticket)) { return false; }
 
-					// ...other threads have completed constructing data, old_ticket expired
-					// try the new ticket
-					if (old_ticket != write_ticket) { continue; }
-					// ...ticket valid, but not my turn
-					else { return false; }
-				}
-			} // end of for loop
+			// Construct data
+			fill(write_ticket, [&](slot_t<T>& slot) { slot.construct(std::forward<Args>(args)...); });
+			return true;
 		}
 		template<typename ...Args,
 			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
 		void emplace(Args&&... args)
-			noexcept(std::is_nothrow_constructible<T, Args&&...>::value)
-		{		
-			// Acquire a write ticket
-			const auto write_ticket = tail_.fetch_add(1, std::memory_order_acq_rel);
-			auto& slot = array_[get_idx(write_ticket)];
-			const auto turn = get_write_turn(write_ticket);
-
-			// Wait for my turn
-			while (turn != slot.turn_.load(std::memory_order_acquire))
-				;
+		{
+			const auto write_ticket = claim_write();
 
 			// Construct data
-			slot.construct(std::forward<Args>(args)...);
-			done_writing(slot, write_ticket);
+			fill(write_ticket, [&](slot_t<T>& slot) { slot.construct(std::forward<Args>(args)...); });
 		}
 		bool try_push(const T& val)
 		{
@@ -205,59 +811,360 @@ namespace hungbiu
 		}
 
 
+		// Consuming
+		/*
+		 * try_consume/consume:
+		 * Claim the next element like try_pop/pop, but call f on it in place,
+		 * as a T& to the object in its slot, and release the slot after f
+		 * returns. Nothing is moved out, so a large T is never copied and T
+		 * needs no default constructor; f may move from the element.
+		 * The slot stays claimed while f runs, so a producer wrapping around
+		 * to it waits for f: keep f short. See also peek.
+		 * If f throws, the element is destroyed and the slot released all the
+		 * same, then the exception propagates: the element is lost, but the
+		 * queue keeps working.
+		 *	try_consume:	returns false if no element is ready, else true
+		 *	consume:		blocks, returns what f returns; throws queue_closed
+		 *					once the queue is closed and drained
+		**/
+		template<typename F>
+		bool try_consume(F&& f)
+		{
+			auto elem = try_peek();
+			if (!elem) { return false; }
+			std::forward<F>(f)(*elem);
+			return true;
+		}
+
+		template<typename F>
+		decltype(auto) consume(F&& f)
+		{
+			// The slot is released once the result is made
+			auto elem = peek();
+			return std::forward<F>(f)(*elem);
+		}
+
+		/*
+		 * try_pop/pop:
+		 * Take the next element, either by move-assigning it to val or by
+		 * returning it, move-constructed straight from its slot. The returning
+		 * forms need T to be move constructible only.
+		 *	try_pop:	returns false, or an empty optional, if no element is ready
+		 *	pop:		blocks; throws queue_closed once the queue is closed
+		 *				and drained
+		**/
 		bool try_pop(T& val)
 		{
-			// Acquire a read ticket for trying
-			auto read_ticket = head_.load(std::memory_order_acquire);
-			for (;;) {
-				auto& slot = array_[get_idx(read_ticket)];
+			return try_consume([&](T& elem) { val = std::move(elem); });
+		}
+		[[nodiscard]] std::optional<T> try_pop()
+		{
+			std::optional<T> ret{};
+			try_consume([&](T& elem) { ret.emplace(std::move(elem)); });
+			return ret;
+		}
 
-				// If it's probably my turn
-				if (get_read_turn(read_ticket) == slot.turn_.load(std::memory_order_acquire)) {
-					// ...no thread is competing, start reading
-					if (head_.compare_exchange_strong(read_ticket,
-													  read_ticket + 1,
-													  std::memory_order_acq_rel)) {
-						val = std::move(reinterpret_cast<T&&>(slot.val_));
-						slot.destroy();
-						done_reading(slot);
-						return true;
-					}
-					// ...another thread already started reading,
-					// wait for its completion and get another ticket
-					else { continue; }
+		void pop(T& val)
+		{
+			consume([&](T& elem) { val = std::move(elem); });
+		}
+		[[nodiscard]] T pop()
+		{
+			return consume([](T& elem) { return T(std::move(elem)); });
+		}
+
+		// In-place access
+		using write_handle = slot_handle<true>;
+		using read_handle = slot_handle<false>;
+		/*
+		 * reserve/try_reserve/peek/try_peek:
+		 * Claim a slot and hand it out as a handle to the element in it, so
+		 * a producer fills it and a consumer reads it right in queue memory,
+		 * e.g. decoding a packet straight into its slot.
+		 * reserve constructs T in the slot from args; without args T is
+		 * default-initialized, leaving trivial members such as a byte buffer
+		 * unwritten for the producer to fill. commit() then publishes it.
+		 * peek claims the next element; release() destroys it and frees the
+		 * slot for producers.
+		 * A handle going out of scope commits or releases its slot, so no
+		 * ticket is lost to an exception: a producer has to leave the element
+		 * in a state its consumers can tell apart if filling it fails.
+		 * Until then the slot stays claimed and whoever wraps around to it
+		 * waits: keep handles short-lived.
+		 *	reserve/peek:			block; throw queue_closed like emplace/pop
+		 *	try_reserve/try_peek:	return an empty handle if no slot is ready
+		 * If constructing T throws, the ticket is skipped, same as emplace().
+		**/
+		template<typename ...Args,
+			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
+		[[nodiscard]] write_handle reserve(Args&&... args)
+		{
+			const auto write_ticket = claim_write();
+			return reserved(write_ticket, std::forward<Args>(args)...);
+		}
+		template<typename ...Args,
+			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
+		[[nodiscard]] write_handle try_reserve(Args&&... args)
+		{
+			std::size_t write_ticket;
+			if (!try_claim_write(write_ticket)) { return {}; }
+			return reserved(write_ticket, std::forward<Args>(args)...);
+		}
+
+		[[nodiscard]] read_handle peek()
+		{
+			std::size_t read_ticket;
+			if (!claim_read(read_ticket)) { throw queue_closed{}; }
+			return read_handle{ this, read_ticket };
+		}
+		[[nodiscard]] read_handle try_peek() noexcept
+		{
+			std::size_t read_ticket;
+			if (!try_claim_read(read_ticket)) { return {}; }
+			return read_handle{ this, read_ticket };
+		}
+
+		// Closing
+		/*
+		 * close:
+		 * Reject every push from now on and release waiting consumers once
+		 * the elements already pushed are drained.
+		 * Sets Closed_Bit in tail_, so the write tickets handed out before it
+		 * are exactly those below the returned tail. Those pushes complete
+		 * normally and are popped as usual; a read ticket at or past that
+		 * tail is never written to, so its consumer gives up.
+		 *	push/emplace/push_n:	throw queue_closed
+		 *	reserve:				throws queue_closed
+		 *	try_push/push_for:		return false
+		 *	try_reserve:			returns an empty handle
+		 *	pop/peek/consume:		drain, then throw queue_closed
+		 *	pop_n:					drains, then returns early
+		 *	try_pop/pop_for:		drain, then return false
+		 * A producer blocked on a full queue with a ticket drawn before
+		 * close() still waits for a consumer to make room.
+		 * Calling close() more than once has no further effect.
+		**/
+		void close()
+		{
+			const auto tail = tail_->fetch_or(Closed_Bit, std::memory_order_acq_rel);
+			if (tail & Closed_Bit) { return; }
+			closed_tail_.store(tail, std::memory_order_release);
+			if constexpr (WaitPolicy::parks) {
+				lot_.unpark_all();
+			}
+		}
+		bool is_closed() const noexcept
+		{
+			return tail_->load(std::memory_order_acquire) & Closed_Bit;
+		}
+		/*
+		 * True once the queue is closed and every element pushed before
+		 * close() has been claimed by a consumer, i.e. no pop can succeed
+		 * any more. A try_pop() failing on a closed queue that isn't drained
+		 * means a push from before close() is still being written.
+		**/
+		bool is_drained() const noexcept
+		{
+			return drained();
+		}
+
+		// Timed modifiers
+		/*
+		 * push_until/push_for/pop_until/pop_for:
+		 * Like push/pop but give up once the deadline is reached.
+		 * Return true on success and false on timeout, in which case the
+		 * queue is left untouched and, for push, val is not moved from.
+		 * They also return false, without waiting, once the queue is closed
+		 * (push) or closed and drained (pop).
+		 * The waiting itself goes through WaitPolicy, so a parking policy
+		 * sleeps until a slot is handed over or the deadline expires.
+		**/
+		template<typename Clock, typename Duration>
+		bool push_until(const T& val, const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			return retry_until(*tail_, [&]() { return try_push(val); },
+							   [&]() { return is_closed(); }, deadline);
+		}
+		template<typename Clock, typename Duration>
+		bool push_until(T&& val, const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			return retry_until(*tail_, [&]() { return try_push(std::move(val)); },
+							   [&]() { return is_closed(); }, deadline);
+		}
+		template<typename Rep, typename Period>
+		bool push_for(const T& val, const std::chrono::duration<Rep, Period>& timeout)
+		{
+			return push_until(val, std::chrono::steady_clock::now() + timeout);
+		}
+		template<typename Rep, typename Period>
+		bool push_for(T&& val, const std::chrono::duration<Rep, Period>& timeout)
+		{
+			return push_until(std::move(val), std::chrono::steady_clock::now() + timeout);
+		}
+
+		template<typename Clock, typename Duration>
+		bool pop_until(T& val, const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			return retry_until(*head_, [&]() { return try_pop(val); },
+							   [&]() { return drained(); }, deadline);
+		}
+		template<typename Rep, typename Period>
+		bool pop_for(T& val, const std::chrono::duration<Rep, Period>& timeout)
+		{
+			return pop_until(val, std::chrono::steady_clock::now() + timeout);
+		}
+
+		// Batch modifiers
+		/*
+		 * push_n/pop_n/try_pop_n:
+		 * Claim a contiguous range of tickets with a single RMW on tail_/head_,
+		 * then fill or drain the matching slots in ticket order.
+		 * A batch larger than the capacity is fine for the blocking versions,
+		 * its later slots simply wait for consumers to catch up.
+		 * If constructing an element throws, its ticket and the rest of the
+		 * batch are skipped, same as emplace(): push_n still waits for each of
+		 * them to come round, then hands it over empty, and rethrows.
+		 * A skipped ticket yields nothing to pop_n, so a batch may come back
+		 * shorter than n with the queue open.
+		 * If writing to out throws, the slot being popped is still destroyed and
+		 * released, and so are the rest of the batch once written, their
+		 * elements discarded; the exception is then rethrown.
+		 * push_n throws queue_closed after close(); pop_n returns early once a
+		 * closed queue is drained, out then marks the end of what was popped.
+		**/
+		template<typename ForwardIt>
+		void push_n(ForwardIt first, ForwardIt last)
+		{
+			const auto n = static_cast<std::size_t>(std::distance(first, last));
+			if (n == 0) return;
+
+			// Acquire n write tickets at once
+			auto write_ticket = tail_->fetch_add(n, std::memory_order_acq_rel);
+			if (write_ticket & Closed_Bit) { throw queue_closed{}; }
+			const auto end = write_ticket + n;
+			for (; first != last; ++first, ++write_ticket) {
+				const auto idx = get_idx(write_ticket);
+				auto& slot = array_[idx];
+				wait_for_turn(slot, idx, get_write_turn(write_ticket));
+				try {
+					slot.construct(*first);
 				}
-				// It's not my turn
-				else
-				{
-					const auto old_ticket = read_ticket;
-					read_ticket = head_.load(std::memory_order_acquire);
+				catch (...) {
+					skip_claimed(write_ticket, end);
+					throw;
+				}
+				done_writing(slot, write_ticket);
+			}
+		}
 
-					// ...other thread has completed reading the data, read_ticket expired
-					// try the new ticket
-					if (read_ticket != old_ticket) { continue; }
-					// ...ticket valid but not my turn
-					else { return false; }
+		template<typename OutputIt>
+		OutputIt pop_n(OutputIt out, std::size_t n)
+		{
+			if (n == 0) return out;
+
+			// Acquire n read tickets at once
+			auto read_ticket = head_->fetch_add(n, std::memory_order_acq_rel);
+			for (const auto end = read_ticket + n; read_ticket != end; ++read_ticket) {
+				const auto idx = get_idx(read_ticket);
+				auto& slot = array_[idx];
+				// Tickets are consecutive, if this one is never written
+				// to neither are the following ones
+				if (!wait_for_turn(slot, idx, get_read_turn(read_ticket),
+								   [&]() { return never_written(read_ticket); })) {
+					break;
 				}
-			}// end of for loop
+				if (slot.skipped()) {
+					done_reading(slot, read_ticket);
+					continue;
+				}
+				try {
+					read_handle elem{ this, read_ticket };
+					*out = std::move(*elem);
+					++out;
+				}
+				catch (...) {
+					discard_claimed(read_ticket + 1, end);
+					throw;
+				}
+			}
+			return out;
 		}
 
-		void pop(T& val)
+		/*
+		 * Pop up to max elements that are ready right now, without blocking.
+		 * Counts the run of readable slots starting at head_ and claims all of
+		 * them with one CAS. Returns the number of elements written to out.
+		 * If writing to out throws, the whole run is released as in pop_n.
+		**/
+		template<typename OutputIt>
+		std::size_t try_pop_n(OutputIt out, std::size_t max)
 		{
-			// Acquire read ticket
-			const auto read_ticket = head_.fetch_add(1, std::memory_order_acq_rel);
-			auto& slot = array_[get_idx(read_ticket)];
-			const auto turn = get_read_turn(read_ticket);
+			max = std::min(max, extent_.capacity());
+			auto read_ticket = head_->load(std::memory_order_acquire);
+			// Paced after a lost CAS, so losers don't retry in lockstep
+			backoff b;
+			for (;;) {
+				// Count the slots that are ready to be read
+				std::size_t n = 0;
+				while (n < max &&
+					   get_read_turn(read_ticket + n) ==
+					   array_[get_idx(read_ticket + n)].turn()) {
+					++n;
+				}
 
-			// Wait for my turn
-			while (turn != slot.turn_.load(std::memory_order_acquire))
-				; //yield()?
+				// Nothing to read
+				if (n == 0) {
+					const auto old_ticket = read_ticket;
+					read_ticket = head_->load(std::memory_order_acquire);
+					if (read_ticket != old_ticket) { continue; }
+					else { return 0; }
+				}
 
-			// Read data
-			val = std::move(reinterpret_cast<T&&>(slot.val_));
-			slot.destroy();
-			done_reading(slot);
+				// Claim the whole run, or start over from the new head
+				if (!head_->compare_exchange_strong(read_ticket,
+												   read_ticket + n,
+												   std::memory_order_acq_rel)) {
+					stats_.add(stat_counter::cas_failures);
+					b.pause();
+					continue;
+				}
+				std::size_t popped = 0;
+				for (const auto end = read_ticket + n; read_ticket != end; ++read_ticket) {
+					auto& slot = array_[get_idx(read_ticket)];
+					if (slot.skipped()) {
+						done_reading(slot, read_ticket);
+						continue;
+					}
+					try {
+						read_handle elem{ this, read_ticket };
+						*out = std::move(*elem);
+						++out;
+						++popped;
+					}
+					catch (...) {
+						discard_claimed(read_ticket + 1, end);
+						throw;
+					}
+				}
+				// Only skipped tickets, look further
+				if (popped == 0) {
+					read_ticket = head_->load(std::memory_order_acquire);
+					continue;
+				}
+				return popped;
+			}
 		}
 
 	}; // end of class
+
+	/*
+	 * array_blocking_queue with N slots embedded in the object: no heap
+	 * allocation, so it can live in static storage or inside another object,
+	 * and the index and turn math divide by a constant.
+	*/
+	template<typename T,
+			 std::size_t N,
+			 typename WaitPolicy = spin_park_wait<>,
+			 typename Layout = padded_layout>
+	using static_array_blocking_queue = array_blocking_queue<T, WaitPolicy, Layout, N>;
 }
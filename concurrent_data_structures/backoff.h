@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <emmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+#include <intrin.h>
+#endif
+
+namespace hungbiu
+{
+	/*
+	 * @brief	hint the CPU that the caller is in a spin-wait loop
+	 *
+	 * Issues PAUSE on X86 so that a spinning hyper-thread doesn't steal
+	 * execution resources from its sibling, YIELD on ARM. No-op on other
+	 * targets.
+	*/
+	inline void cpu_relax() noexcept
+	{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		_mm_pause();
+#elif defined(_MSC_VER) && (defined(_M_ARM) || defined(_M_ARM64))
+		__yield();
+#elif defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield" ::: "memory");
+#endif
+	}
+
+	/*
+	 * Cap of the exponential backoff, in cpu_relax() rounds.
+	 * PAUSE takes about 140 cycles since Skylake, while YIELD is close
+	 * to a no-op on Neoverse cores, so ARM needs more rounds for a
+	 * similar delay.
+	*/
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+	inline constexpr std::uint32_t Backoff_Cap = 16;
+#else
+	inline constexpr std::uint32_t Backoff_Cap = 128;
+#endif
+
+	/*
+	 * Exponential backoff for spin loops: every pause() issues twice as
+	 * many cpu_relax() as the previous one, up to Cap, so a waiter that
+	 * keeps finding its condition false re-reads the contended line less
+	 * and less often. WFE isn't used: it needs an exclusive monitor armed
+	 * on the line being waited on, which plain atomic loads don't do.
+	*/
+	template<std::uint32_t Cap = Backoff_Cap>
+	class basic_backoff
+	{
+		static_assert(Cap > 0 && (Cap & (Cap - 1)) == 0, "Cap must be a power of two");
+		std::uint32_t rounds_{ 1 };
+	public:
+		/*
+		 * @brief	relax for the current number of rounds, then double it
+		 * @return	the number of cpu_relax() issued
+		*/
+		std::uint32_t pause() noexcept
+		{
+			const auto n = rounds_;
+			for (std::uint32_t i = 0; i < n; ++i) {
+				cpu_relax();
+			}
+			if (rounds_ < Cap) rounds_ <<= 1;
+			return n;
+		}
+		// Start over from a single round, e.g. after losing a race for the lock
+		void reset() noexcept
+		{
+			rounds_ = 1;
+		}
+		std::uint32_t rounds() const noexcept
+		{
+			return rounds_;
+		}
+	};
+	using backoff = basic_backoff<>;
+}
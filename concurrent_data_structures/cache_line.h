@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace hungbiu
+{
+	/*
+	 * Cache geometry the library pads for, fixed at compile time instead
+	 * of std::hardware_destructive_interference_size, which GCC warns may
+	 * change between compiler versions, which MSVC pins to 64, and which
+	 * doesn't account for prefetching.
+	 *
+	 * Cache_Line_Size:		one line of the L1 data cache
+	 * False_Sharing_Size:	the span two hot objects must not both touch;
+	 *						twice the line on x86, whose spatial prefetcher
+	 *						fetches lines in aligned pairs
+	 *
+	 * Both can be overridden by defining HUNGBIU_CACHE_LINE_SIZE or
+	 * HUNGBIU_FALSE_SHARING_SIZE, identically in every translation unit.
+	*/
+#if defined(HUNGBIU_CACHE_LINE_SIZE)
+	inline constexpr std::size_t Cache_Line_Size = HUNGBIU_CACHE_LINE_SIZE;
+#elif defined(__APPLE__) && defined(__aarch64__)
+	inline constexpr std::size_t Cache_Line_Size = 128;	// M-series
+#elif defined(__powerpc64__) || defined(_ARCH_PPC64)
+	inline constexpr std::size_t Cache_Line_Size = 128;
+#elif defined(__s390x__)
+	inline constexpr std::size_t Cache_Line_Size = 256;
+#else
+	inline constexpr std::size_t Cache_Line_Size = 64;
+#endif
+
+#if defined(HUNGBIU_FALSE_SHARING_SIZE)
+	inline constexpr std::size_t False_Sharing_Size = HUNGBIU_FALSE_SHARING_SIZE;
+#elif defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+	inline constexpr std::size_t False_Sharing_Size = 2 * Cache_Line_Size;
+#else
+	inline constexpr std::size_t False_Sharing_Size = Cache_Line_Size;
+#endif
+
+	static_assert((Cache_Line_Size & (Cache_Line_Size - 1)) == 0 &&
+				  (False_Sharing_Size & (False_Sharing_Size - 1)) == 0 &&
+				  False_Sharing_Size >= Cache_Line_Size,
+				  "cache sizes must be powers of two, False_Sharing_Size the larger");
+
+	/*
+	 * A T alone in its False_Sharing_Size span: aligned to it and, since
+	 * sizeof is a multiple of alignof, padded to it as well, so nothing
+	 * placed before or after shares the span. Accessed like a pointer,
+	 * e.g. head_->load().
+	*/
+	template<typename T, std::size_t Align = False_Sharing_Size>
+	struct alignas(Align) padded
+	{
+		T value_;
+
+		padded() = default;
+		template<typename... Args>
+		constexpr explicit padded(std::in_place_t, Args&&... args) :
+			value_(std::forward<Args>(args)...)
+		{}
+		template<typename U, typename = std::enable_if_t<std::is_constructible_v<T, U&&>>>
+		constexpr padded(U&& u) :
+			value_(std::forward<U>(u))
+		{}
+
+		T& operator*() noexcept { return value_; }
+		const T& operator*() const noexcept { return value_; }
+		T* operator->() noexcept { return &value_; }
+		const T* operator->() const noexcept { return &value_; }
+	};
+}
@@ -0,0 +1,661 @@
+#pragma once
+#include <cstddef>  // size_t
+#include <cstdint>
+#include <cstring>  // memset()
+#include <optional> // optional<V>
+#include <atomic>
+#include <memory>   // unique_ptr
+#include <functional> // hash<K>, equal_to<K>
+#include <utility>  // pair, move()
+#include <mutex>    // unique_lock
+#include <shared_mutex> // shared_lock
+#include <new>      // launder()
+#include <type_traits>
+#include <algorithm>
+#include <thread>   // hardware_concurrency()
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HUNGBIU_HASH_MAP_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h> // _BitScanForward
+#endif
+#include "spinlock.h" // spinlock
+#include "contention_stats.h" // contention_stats
+#include "cache_line.h" // padded, False_Sharing_Size
+
+namespace hungbiu {
+
+    namespace detail {
+        template<typename L, typename = void>
+        struct is_shared_lockable : std::false_type {};
+        template<typename L>
+        struct is_shared_lockable<L, std::void_t<decltype(std::declval<L&>().lock_shared())>>
+            : std::true_type {};
+
+        inline unsigned lowest_bit(std::uint32_t mask) noexcept {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward(&i, mask);
+            return static_cast<unsigned>(i);
+#else
+            return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+        }
+
+        /*
+         * Control bytes of one group of 16 slots, as in Swiss tables:
+         * a full slot holds 7 bits of its hash, the top bit marks empty
+         * and deleted slots. A probe compares all 16 with one SSE2
+         * compare, or with a plain loop elsewhere.
+        */
+        struct alignas(16) ctrl_group {
+            static constexpr std::size_t Width = 16;
+            static constexpr std::int8_t Empty = -128;  // 0x80
+            static constexpr std::int8_t Deleted = -2;  // 0xfe
+
+            std::int8_t ctrl_[Width];
+
+            // Bit i set for every slot i whose byte is b
+            std::uint32_t match(std::int8_t b) const noexcept {
+#if defined(HUNGBIU_HASH_MAP_SSE2)
+                const auto c = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl_));
+                return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(b), c)));
+#else
+                std::uint32_t mask = 0;
+                for (std::size_t i = 0; i < Width; ++i) {
+                    mask |= static_cast<std::uint32_t>(ctrl_[i] == b) << i;
+                }
+                return mask;
+#endif
+            }
+            std::uint32_t match_empty() const noexcept {
+                return match(Empty);
+            }
+            std::uint32_t match_free() const noexcept {
+#if defined(HUNGBIU_HASH_MAP_SSE2)
+                const auto c = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl_));
+                return static_cast<std::uint32_t>(_mm_movemask_epi8(c));
+#else
+                std::uint32_t mask = 0;
+                for (std::size_t i = 0; i < Width; ++i) {
+                    mask |= static_cast<std::uint32_t>(ctrl_[i] < 0) << i;
+                }
+                return mask;
+#endif
+            }
+            std::uint32_t match_full() const noexcept {
+                return ~match_free() & 0xffff;
+            }
+        };
+    }
+
+    /*
+     * Concurrent hash map of open-addressing tables, one per segment.
+     *
+     * The top bits of a key's hash pick the segment, whose Lock guards
+     * it; when Lock is shared-lockable, e.g. rw_spinlock, lookups only
+     * take it shared. A segment is a Swiss table: slots come in groups
+     * of 16 whose control bytes are probed at once, and a probe moves
+     * to the next group, quadratically, only while the current one is full.
+     *
+     * Resizing doesn't stop the world, nor even the segment: a segment
+     * outgrowing its table allocates one twice as large and keeps the
+     * old one, from which every write then migrates a couple of groups.
+     * Until it's empty, lookups fall back to the old table.
+     *
+     * Values are handed out by copy (find()) or visited under the lock
+     * (visit(), update()); references never escape it. A visitor must
+     * not call back into the map.
+    */
+    template <typename K,
+              typename V,
+              typename Hash = std::hash<K>,
+              typename KeyEqual = std::equal_to<K>,
+              typename Lock = spinlock>
+    class concurrent_hash_map
+    {
+    public:
+        using key_type = K;
+        using mapped_type = V;
+        using value_type = std::pair<K, V>;
+        using size_type = std::size_t;
+        using hasher = Hash;
+        using key_equal = KeyEqual;
+
+    private:
+        static_assert(std::is_nothrow_move_constructible_v<value_type>,
+            "migrating between tables moves elements and must not throw");
+
+        using lock_t = Lock;
+        using group = detail::ctrl_group;
+        using read_lock_t = std::conditional_t<detail::is_shared_lockable<Lock>::value,
+                                               std::shared_lock<Lock>, std::unique_lock<Lock>>;
+        static constexpr size_type Width = group::Width;
+        static constexpr size_type npos = static_cast<size_type>(-1);
+        // Old groups moved to the new table by every write during a resize
+        static constexpr size_type Migrate_N = 2;
+
+        /*
+         * Groups and slots of one open-addressing table; the number of
+         * groups is a power of two, or zero before the first insert
+        */
+        class table
+        {
+            using storage_t = std::aligned_storage_t<sizeof(value_type), alignof(value_type)>;
+
+            std::unique_ptr<group[]> groups_;
+            std::unique_ptr<storage_t[]> slots_;
+            size_type groups_n_{ 0 };
+            size_type size_{ 0 };
+            size_type deleted_{ 0 };
+
+        public:
+            table() = default;
+            explicit table(size_type groups_n) :
+                groups_(std::make_unique<group[]>(groups_n)),
+                slots_(std::make_unique<storage_t[]>(groups_n * Width)),
+                groups_n_(groups_n)
+            {
+                std::memset(groups_.get(), static_cast<unsigned char>(group::Empty),
+                            groups_n * sizeof(group));
+            }
+            table(table&& other) noexcept :
+                groups_(std::move(other.groups_)),
+                slots_(std::move(other.slots_)),
+                groups_n_(std::exchange(other.groups_n_, 0)),
+                size_(std::exchange(other.size_, 0)),
+                deleted_(std::exchange(other.deleted_, 0))
+            {}
+            table& operator=(table&& other) noexcept
+            {
+                if (this != &other) {
+                    clear();
+                    groups_ = std::move(other.groups_);
+                    slots_ = std::move(other.slots_);
+                    groups_n_ = std::exchange(other.groups_n_, 0);
+                    size_ = std::exchange(other.size_, 0);
+                    deleted_ = std::exchange(other.deleted_, 0);
+                }
+                return *this;
+            }
+            ~table()
+            {
+                clear();
+            }
+
+            // Destroy every element, keeping the groups allocated
+            void clear() noexcept
+            {
+                for (size_type g = 0; g < groups_n_ && size_; ++g) {
+                    for (auto full = groups_[g].match_full(); full; full &= full - 1) {
+                        const auto i = g * Width + detail::lowest_bit(full);
+                        slot(i)->~value_type();
+                        --size_;
+                    }
+                }
+                if (groups_n_) {
+                    std::memset(groups_.get(), static_cast<unsigned char>(group::Empty),
+                                groups_n_ * sizeof(group));
+                }
+                size_ = deleted_ = 0;
+            }
+
+            size_type groups() const noexcept { return groups_n_; }
+            size_type size() const noexcept { return size_; }
+            size_type capacity() const noexcept { return groups_n_ * Width; }
+            // Loaded to 7/8, counting tombstones, a table is full
+            bool full_for(size_type n) const noexcept
+            {
+                return (size_ + deleted_ + n) * 8 > capacity() * 7;
+            }
+            bool has_deleted_majority() const noexcept
+            {
+                return deleted_ > size_;
+            }
+
+            value_type* slot(size_type i) const noexcept
+            {
+                return std::launder(reinterpret_cast<value_type*>(&slots_[i]));
+            }
+            group& group_at(size_type g) const noexcept
+            {
+                return groups_[g];
+            }
+
+            // Visit the groups of h's probe sequence until f returns true
+            // or a group with an empty slot ends it
+            template<typename F>
+            size_type probe(std::uint64_t h, F f) const
+            {
+                if (!groups_n_) return npos;
+                const auto mask = groups_n_ - 1;
+                auto g = static_cast<size_type>(h >> 7) & mask;
+                for (size_type step = 1; step <= groups_n_; ++step) {
+                    const auto found = f(g);
+                    if (found != npos) return found;
+                    if (groups_[g].match_empty()) return npos;
+                    g = (g + step) & mask;
+                }
+                return npos;
+            }
+
+            template<typename Key, typename Eq>
+            size_type find(const Key& key, std::uint64_t h, const Eq& eq) const
+            {
+                const auto tag = static_cast<std::int8_t>(h & 0x7f);
+                return probe(h, [&](size_type g) {
+                    for (auto m = groups_[g].match(tag); m; m &= m - 1) {
+                        const auto i = g * Width + detail::lowest_bit(m);
+                        if (eq(slot(i)->first, key)) return i;
+                    }
+                    return npos;
+                });
+            }
+
+            /*
+             * @brief   construct an element in the first free slot of h's
+             *          probe sequence; the key must not be in the table
+             *          and the table must not be full
+            */
+            template<typename... Args>
+            value_type* emplace(std::uint64_t h, Args&&... args)
+            {
+                const auto mask = groups_n_ - 1;
+                auto g = static_cast<size_type>(h >> 7) & mask;
+                for (size_type step = 1; ; ++step) {
+                    if (const auto free = groups_[g].match_free()) {
+                        const auto i = g * Width + detail::lowest_bit(free);
+                        auto p = new (&slots_[i]) value_type(std::forward<Args>(args)...);
+                        auto& c = groups_[g].ctrl_[i % Width];
+                        if (c == group::Deleted) --deleted_;
+                        c = static_cast<std::int8_t>(h & 0x7f);
+                        ++size_;
+                        return p;
+                    }
+                    g = (g + step) & mask;
+                }
+            }
+
+            /*
+             * @brief   destroy the element in slot i
+             *
+             * A group with an empty slot already ends every probe passing
+             * through it, so the slot can become empty again; otherwise it
+             * becomes a tombstone that probes go past.
+            */
+            void erase(size_type i) noexcept
+            {
+                slot(i)->~value_type();
+                auto& grp = groups_[i / Width];
+                if (grp.match_empty()) {
+                    grp.ctrl_[i % Width] = group::Empty;
+                }
+                else {
+                    grp.ctrl_[i % Width] = group::Deleted;
+                    ++deleted_;
+                }
+                --size_;
+            }
+        };
+
+        struct alignas(False_Sharing_Size) segment
+        {
+            mutable lock_t  lock_;
+            table           cur_;
+            // Table being migrated into cur_, empty when not resizing
+            table           old_;
+            size_type       migrated_{ 0 };
+            std::atomic<size_type> size_{ 0 };
+        };
+
+        std::unique_ptr<segment[]> segments_;
+        unsigned segment_bits_;
+        Hash hash_;
+        KeyEqual eq_;
+
+        /*
+         * std::hash is the identity for integers on common implementations;
+         * mixing (murmur3's finalizer) spreads any hash over all 64 bits,
+         * which the segment, group and tag are taken from.
+        */
+        std::uint64_t hash(const K& key) const
+        {
+            auto h = static_cast<std::uint64_t>(hash_(key));
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+        segment& segment_of(std::uint64_t h) const noexcept
+        {
+            return segments_[segment_bits_ ? static_cast<size_type>(h >> (64 - segment_bits_)) : 0];
+        }
+
+        // Move up to n groups from old_ to cur_; holding the lock exclusively
+        void migrate(segment& s, size_type n) noexcept
+        {
+            auto& old = s.old_;
+            for (; n > 0 && s.migrated_ < old.groups(); --n, ++s.migrated_) {
+                auto& grp = old.group_at(s.migrated_);
+                for (auto full = grp.match_full(); full; full &= full - 1) {
+                    const auto i = s.migrated_ * Width + detail::lowest_bit(full);
+                    auto p = old.slot(i);
+                    s.cur_.emplace(hash(p->first), std::move(*p));
+                    // Leaves a tombstone, so old probes still reach the rest
+                    old.erase(i);
+                }
+            }
+            if (old.groups() && s.migrated_ == old.groups()) {
+                old = table{};
+                s.migrated_ = 0;
+            }
+        }
+
+        /*
+         * @brief   make room for one more element in cur_
+         * @exception   allocating a larger table may throw std::bad_alloc
+        */
+        void make_room(segment& s)
+        {
+            migrate(s, Migrate_N);
+            if (s.cur_.groups() && !s.cur_.full_for(1)) return;
+            // Finish the previous resize before starting another one
+            migrate(s, static_cast<size_type>(-1));
+            if (!s.cur_.groups()) {
+                s.cur_ = table{ 1 };
+                return;
+            }
+            // Mostly tombstones: rebuild at the same size
+            const auto groups_n = s.cur_.has_deleted_majority() ? s.cur_.groups() : s.cur_.groups() * 2;
+            table bigger{ groups_n };
+            s.old_ = std::move(s.cur_);
+            s.cur_ = std::move(bigger);
+            s.migrated_ = 0;
+            migrate(s, Migrate_N);
+        }
+
+        // Slot of key in either table, nullptr if absent
+        value_type* locate(const segment& s, const K& key, std::uint64_t h) const
+        {
+            auto i = s.cur_.find(key, h, eq_);
+            if (i != npos) return s.cur_.slot(i);
+            i = s.old_.find(key, h, eq_);
+            return i != npos ? s.old_.slot(i) : nullptr;
+        }
+
+        /*
+         * @brief   insert key if absent, else call on_found(value) unless
+         *          it's nullptr
+         * @return  whether key was inserted
+        */
+        template<typename OnFound, typename Key, typename... Args>
+        bool emplace_impl(OnFound on_found, Key&& key, Args&&... args)
+        {
+            const auto h = hash(key);
+            auto& s = segment_of(h);
+            std::unique_lock lk{ s.lock_ };
+            if (auto p = locate(s, key, h)) {
+                if constexpr (!std::is_same_v<OnFound, std::nullptr_t>) {
+                    on_found(p->second);
+                }
+                return false;
+            }
+            make_room(s);
+            s.cur_.emplace(h, std::piecewise_construct,
+                           std::forward_as_tuple(std::forward<Key>(key)),
+                           std::forward_as_tuple(std::forward<Args>(args)...));
+            s.size_.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+    public:
+        /*
+         * @param   segments_n  number of independently locked segments,
+         *                      rounded up to a power of two; by default four
+         *                      per hardware thread
+        */
+        explicit concurrent_hash_map(size_type segments_n = 4 * std::thread::hardware_concurrency(),
+                                     const Hash& hash = Hash(),
+                                     const KeyEqual& eq = KeyEqual()) :
+            segment_bits_(0),
+            hash_(hash),
+            eq_(eq)
+        {
+            segments_n = std::max<size_type>(segments_n, 1);
+            while ((size_type{ 1 } << segment_bits_) < segments_n) ++segment_bits_;
+            segments_ = std::make_unique<segment[]>(size_type{ 1 } << segment_bits_);
+        }
+
+        concurrent_hash_map(const concurrent_hash_map&) = delete;
+        concurrent_hash_map& operator=(const concurrent_hash_map&) = delete;
+
+        // Capacity
+        /*
+         * @brief   number of elements; only a hint while other threads
+         *          insert or erase
+        */
+        size_type size() const noexcept
+        {
+            size_type n = 0;
+            for (size_type i = 0; i < segments(); ++i) {
+                n += segments_[i].size_.load(std::memory_order_relaxed);
+            }
+            return n;
+        }
+        bool empty() const noexcept
+        {
+            return size() == 0;
+        }
+        size_type segments() const noexcept
+        {
+            return size_type{ 1 } << segment_bits_;
+        }
+
+        /*
+         * @brief   size every segment's table for its share of n elements,
+         *          so that inserting them doesn't resize
+         * @exception   allocation may throw std::bad_alloc
+        */
+        void reserve(size_type n)
+        {
+            const auto per_segment = n / segments() + 1;
+            size_type groups_n = 1;
+            while (groups_n * Width * 7 < per_segment * 8) groups_n *= 2;
+            for (size_type i = 0; i < segments(); ++i) {
+                auto& s = segments_[i];
+                std::unique_lock lk{ s.lock_ };
+                if (s.cur_.groups() >= groups_n) continue;
+                migrate(s, static_cast<size_type>(-1));
+                table bigger{ groups_n };
+                s.old_ = std::move(s.cur_);
+                s.cur_ = std::move(bigger);
+                s.migrated_ = 0;
+                migrate(s, static_cast<size_type>(-1));
+            }
+        }
+
+        /*
+         * @brief   contention counters, all zero unless HUNGBIU_ENABLE_STATS
+         *          is defined; see contention_stats
+         * @return  waits on the segment locks and size() as depth
+        */
+        stats_snapshot stats() const noexcept
+        {
+            stats_snapshot snap;
+            for (size_type i = 0; i < segments(); ++i) {
+                snap += stats_of(segments_[i].lock_);
+            }
+            snap.depth_ = size();
+            return snap;
+        }
+
+        // Lookup
+        /*
+         * @return  a copy of key's value, or an empty optional
+        */
+        [[nodiscard]] std::optional<V> find(const K& key) const
+        {
+            std::optional<V> ret{};
+            visit(key, [&](const V& v) { ret.emplace(v); });
+            return ret;
+        }
+        bool contains(const K& key) const
+        {
+            return visit(key, [](const V&) {});
+        }
+        /*
+         * @brief   call f(const V&) on key's value holding its segment's lock,
+         *          shared if Lock allows it
+         * @return  whether key was found
+        */
+        template<typename F>
+        bool visit(const K& key, F&& f) const
+        {
+            const auto h = hash(key);
+            auto& s = segment_of(h);
+            read_lock_t lk{ s.lock_ };
+            if (auto p = locate(s, key, h)) {
+                f(static_cast<const V&>(p->second));
+                return true;
+            }
+            return false;
+        }
+
+        // Modifiers
+        /*
+         * @brief   insert key with a value constructed from args, if absent
+         * @return  whether the element was inserted
+         * @exception   constructing the element or growing the table may throw,
+         *              leaving the map unchanged
+        */
+        template<typename... Args>
+        bool try_emplace(const K& key, Args&&... args)
+        {
+            return emplace_impl(nullptr, key, std::forward<Args>(args)...);
+        }
+        template<typename... Args>
+        bool try_emplace(K&& key, Args&&... args)
+        {
+            return emplace_impl(nullptr, std::move(key), std::forward<Args>(args)...);
+        }
+        bool insert(const value_type& kv)
+        {
+            return try_emplace(kv.first, kv.second);
+        }
+        bool insert(value_type&& kv)
+        {
+            return try_emplace(std::move(kv.first), std::move(kv.second));
+        }
+        /*
+         * @brief   insert key or assign to its value
+         * @return  whether the element was inserted
+        */
+        template<typename M>
+        bool insert_or_assign(K key, M&& value)
+        {
+            return emplace_impl([&](V& v) { v = std::forward<M>(value); },
+                                std::move(key), std::forward<M>(value));
+        }
+        /*
+         * @brief   call f(V&) on key's value holding its segment's lock,
+         *          to read-modify-write it in place
+         * @return  whether key was found
+        */
+        template<typename F>
+        bool update(const K& key, F&& f)
+        {
+            const auto h = hash(key);
+            auto& s = segment_of(h);
+            std::unique_lock lk{ s.lock_ };
+            if (auto p = locate(s, key, h)) {
+                f(p->second);
+                return true;
+            }
+            return false;
+        }
+        /*
+         * @brief   call f(V&) on key's value, inserting a value constructed
+         *          from args first if key is absent
+         * @return  whether the element was inserted
+        */
+        template<typename F, typename... Args>
+        bool upsert(const K& key, F&& f, Args&&... args)
+        {
+            const auto h = hash(key);
+            auto& s = segment_of(h);
+            std::unique_lock lk{ s.lock_ };
+            if (auto p = locate(s, key, h)) {
+                f(p->second);
+                return false;
+            }
+            make_room(s);
+            auto p = s.cur_.emplace(h, std::piecewise_construct,
+                                    std::forward_as_tuple(key),
+                                    std::forward_as_tuple(std::forward<Args>(args)...));
+            s.size_.fetch_add(1, std::memory_order_relaxed);
+            f(p->second);
+            return true;
+        }
+        /*
+         * @return  whether key was found and erased
+        */
+        bool erase(const K& key)
+        {
+            const auto h = hash(key);
+            auto& s = segment_of(h);
+            std::unique_lock lk{ s.lock_ };
+            auto i = s.cur_.find(key, h, eq_);
+            if (i != npos) {
+                s.cur_.erase(i);
+            }
+            else if ((i = s.old_.find(key, h, eq_)) != npos) {
+                s.old_.erase(i);
+            }
+            else {
+                return false;
+            }
+            s.size_.fetch_sub(1, std::memory_order_relaxed);
+            migrate(s, Migrate_N);
+            return true;
+        }
+        /*
+         * @brief   erase every element, one segment at a time; not atomic
+         *          with respect to concurrent inserts
+        */
+        void clear()
+        {
+            for (size_type i = 0; i < segments(); ++i) {
+                auto& s = segments_[i];
+                std::unique_lock lk{ s.lock_ };
+                s.cur_.clear();
+                s.old_ = table{};
+                s.migrated_ = 0;
+                s.size_.store(0, std::memory_order_relaxed);
+            }
+        }
+        /*
+         * @brief   call f(const K&, V&) on every element, one segment at a
+         *          time holding its lock
+        */
+        template<typename F>
+        void for_each(F&& f)
+        {
+            for (size_type i = 0; i < segments(); ++i) {
+                auto& s = segments_[i];
+                std::unique_lock lk{ s.lock_ };
+                for (const table* t : { &s.cur_, &s.old_ }) {
+                    for (size_type g = 0; g < t->groups(); ++g) {
+                        for (auto full = t->group_at(g).match_full(); full; full &= full - 1) {
+                            auto p = t->slot(g * Width + detail::lowest_bit(full));
+                            f(static_cast<const K&>(p->first), p->second);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+};
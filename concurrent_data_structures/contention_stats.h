@@ -0,0 +1,164 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <array>
+#include <type_traits>
+#include <utility>
+#include "cache_line.h"
+
+namespace hungbiu
+{
+    /*
+     * Contention counters, compiled in only when HUNGBIU_ENABLE_STATS is
+     * defined. Otherwise contention_stats is an empty class whose add() does
+     * nothing, so instrumented code costs nothing. Every translation unit of
+     * a program has to agree on the macro.
+    */
+    enum class stat_counter : std::size_t
+    {
+        cas_failures,       // lost CAS in try_push/try_pop and friends
+        wait_spins,         // cpu_relax() rounds waiting on a slot or a lock
+        wait_yields,        // yields waiting on a slot
+        parks,              // waits that went to sleep
+        lock_waits,         // lock acquisitions that found the lock taken
+        lock_wait_ns,       // time spent acquiring those
+        free_list_hits,     // node allocations served from a free list
+        slab_allocations,   // node allocations that went to the allocator
+        pushes,
+        pops,
+        elisions,           // critical sections committed as transactions
+        elision_aborts,     // transactions aborted before falling back
+        count_
+    };
+    inline constexpr std::size_t Stats_N = static_cast<std::size_t>(stat_counter::count_);
+
+    inline const char* stat_name(stat_counter s) noexcept
+    {
+        constexpr const char* names[Stats_N] = {
+            "cas_failures", "wait_spins", "wait_yields", "parks", "lock_waits",
+            "lock_wait_ns", "free_list_hits", "slab_allocations", "pushes", "pops",
+            "elisions", "elision_aborts"
+        };
+        return names[static_cast<std::size_t>(s)];
+    }
+
+    /*
+     * Totals read from a contention_stats, plus the approximate number
+     * of elements in the structure when it has one.
+    */
+    struct stats_snapshot
+    {
+        std::array<std::uint64_t, Stats_N> values_{};
+        std::uint64_t depth_{ 0 };
+
+        std::uint64_t operator[](stat_counter s) const noexcept
+        {
+            return values_[static_cast<std::size_t>(s)];
+        }
+        stats_snapshot& operator+=(const stats_snapshot& other) noexcept
+        {
+            for (std::size_t i = 0; i < Stats_N; ++i) {
+                values_[i] += other.values_[i];
+            }
+            depth_ += other.depth_;
+            return *this;
+        }
+
+        /*
+         * @brief   call f(name, value) for every counter and "depth",
+         *          e.g. to export them as Prometheus samples
+        */
+        template<typename F>
+        void for_each(F&& f) const
+        {
+            for (std::size_t i = 0; i < Stats_N; ++i) {
+                f(stat_name(static_cast<stat_counter>(i)), values_[i]);
+            }
+            f("depth", depth_);
+        }
+    };
+
+    template<bool Enabled>
+    class basic_contention_stats;
+
+    /*
+     * Counters sharded over cache lines; a thread always adds to the same
+     * shard, so threads rarely share a line and add() stays a relaxed
+     * fetch_add. snapshot() sums the shards and is only approximate while
+     * other threads keep adding.
+    */
+    template<>
+    class basic_contention_stats<true>
+    {
+        static constexpr std::size_t Shards_N = 16;
+        struct alignas(False_Sharing_Size) shard
+        {
+            std::array<std::atomic<std::uint64_t>, Stats_N> values_{};
+        };
+        std::array<shard, Shards_N> shards_;
+
+        static std::size_t thread_shard() noexcept
+        {
+            static std::atomic<std::size_t> next{ 0 };
+            thread_local const std::size_t idx =
+                next.fetch_add(1, std::memory_order_relaxed) % Shards_N;
+            return idx;
+        }
+    public:
+        static constexpr bool enabled = true;
+
+        void add(stat_counter s, std::uint64_t n = 1) noexcept
+        {
+            shards_[thread_shard()].values_[static_cast<std::size_t>(s)]
+                .fetch_add(n, std::memory_order_relaxed);
+        }
+        stats_snapshot snapshot() const noexcept
+        {
+            stats_snapshot snap;
+            for (const auto& sh : shards_) {
+                for (std::size_t i = 0; i < Stats_N; ++i) {
+                    snap.values_[i] += sh.values_[i].load(std::memory_order_relaxed);
+                }
+            }
+            return snap;
+        }
+    };
+
+    template<>
+    class basic_contention_stats<false>
+    {
+    public:
+        static constexpr bool enabled = false;
+
+        void add(stat_counter, std::uint64_t = 1) noexcept {}
+        stats_snapshot snapshot() const noexcept { return {}; }
+    };
+
+    /*
+     * @brief   t.stats() if T has one, e.g. the locks of spinlock.h,
+     *          an empty snapshot for any other type
+    */
+    template<typename T, typename = void>
+    struct has_stats : std::false_type {};
+    template<typename T>
+    struct has_stats<T, std::void_t<decltype(std::declval<const T&>().stats())>> : std::true_type {};
+
+    template<typename T>
+    stats_snapshot stats_of(const T& t) noexcept
+    {
+        if constexpr (has_stats<T>::value) {
+            return t.stats();
+        }
+        else {
+            return {};
+        }
+    }
+
+#if defined(HUNGBIU_ENABLE_STATS)
+    using contention_stats = basic_contention_stats<true>;
+#else
+    using contention_stats = basic_contention_stats<false>;
+#endif
+
+} // end of namespace
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace hungbiu
+{
+	/*
+	 * Unsigned division by a divisor fixed at run time, without a div
+	 * instruction: n / d is computed as a multiply-high by a precomputed
+	 * reciprocal, an add and a shift (the branchfree 64-bit scheme of
+	 * libdivide, after Granlund & Montgomery). Exact for every n.
+	 *
+	 * A power of two d gets a zero reciprocal and falls out of the same
+	 * formula as n >> log2(d), so the division path has no branch at all.
+	*/
+	class divider
+	{
+		std::uint64_t magic_{ 0 };
+		unsigned shift_{ 0 };
+		std::uint64_t d_{ 2 };
+
+		static std::uint64_t mulhi(std::uint64_t a, std::uint64_t b) noexcept
+		{
+#if defined(_MSC_VER) && defined(_M_X64)
+			return __umulh(a, b);
+#elif defined(__SIZEOF_INT128__)
+			return static_cast<std::uint64_t>(
+				(static_cast<unsigned __int128>(a) * b) >> 64);
+#else
+			const std::uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+			const std::uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+			const std::uint64_t lo_lo = a_lo * b_lo;
+			const std::uint64_t hi_lo = a_hi * b_lo;
+			const std::uint64_t lo_hi = a_lo * b_hi;
+			const std::uint64_t hi_hi = a_hi * b_hi;
+			const std::uint64_t mid = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+			return hi_hi + (hi_lo >> 32) + (mid >> 32);
+#endif
+		}
+		static unsigned floor_log2(std::uint64_t n) noexcept
+		{
+			unsigned r = 0;
+			while (n >>= 1) ++r;
+			return r;
+		}
+	public:
+		divider() = default;
+		/*
+		 * @param	d	divisor, at least 2
+		*/
+		explicit divider(std::uint64_t d) noexcept :
+			d_(d)
+		{
+			assert(d > 1);
+			const auto more = floor_log2(d);
+			if ((d & (d - 1)) == 0) {
+				shift_ = more - 1;
+				return;
+			}
+			// floor(2^(64 + more) / d) by long division; 2^more < d,
+			// so the quotient fits in 64 bits
+			std::uint64_t q = 0;
+			std::uint64_t rem = std::uint64_t{ 1 } << more;
+			for (int i = 0; i < 64; ++i) {
+				const bool carry = rem >> 63;
+				rem <<= 1;
+				q <<= 1;
+				if (carry || rem >= d) {
+					rem -= d;
+					q |= 1;
+				}
+			}
+			// One more bit of precision, whose top bit is implicit in divide()
+			q += q;
+			const auto twice_rem = rem + rem;
+			if (twice_rem >= d || twice_rem < rem) {
+				q += 1;
+			}
+			magic_ = q + 1;
+			shift_ = more;
+		}
+
+		std::uint64_t divisor() const noexcept
+		{
+			return d_;
+		}
+		std::uint64_t divide(std::uint64_t n) const noexcept
+		{
+			const auto t = mulhi(magic_, n);
+			return (t + ((n - t) >> 1)) >> shift_;
+		}
+		std::uint64_t modulo(std::uint64_t n) const noexcept
+		{
+			return n - divide(n) * d_;
+		}
+	};
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include <cstddef>  // size_t
+#include <atomic>   // atomic<T*>
+#include <vector>   // vector<T*>
+#include <algorithm>// sort(), binary_search()
+#include "cache_line.h"
+
+namespace hungbiu {
+
+    /*
+     * Hazard pointers for safe memory reclamation in lock-free structures,
+     * as described by Maged M. Michael, "Hazard Pointers: Safe Memory
+     * Reclamation for Lock-Free Objects", 2004.
+     *
+     * A thread announces the nodes it is about to dereference in a hazard
+     * slot. Removed nodes are retired instead of being reused immediately,
+     * and a retired node is only handed back to its owner once no hazard slot
+     * points to it. This also rules out ABA on CAS'd pointers, since a node
+     * can't come back at the same address while someone still holds it.
+     *
+     * A domain is owned by one data structure. Threads borrow a record of K
+     * hazard slots for the duration of one operation through a guard; records
+     * are never freed before the domain, so they're recycled between threads.
+    */
+    template <typename T, std::size_t K = 2>
+    class hazard_domain
+    {
+        struct alignas(False_Sharing_Size) record
+        {
+            std::atomic<bool>   active_{ false };
+            std::atomic<T*>     hazards_[K]{};
+            record*             next_{ nullptr };
+            // Only touched by the thread currently holding the record
+            std::vector<T*>     retired_;
+        };
+
+        std::atomic<record*>        head_{ nullptr };
+        std::atomic<std::size_t>    records_n_{ 0 };
+
+        /*
+         * @brief   take an inactive record, or append a new one to the list
+         * @exception   may throw std::bad_alloc when allocating a new record
+        */
+        record* acquire()
+        {
+            for (auto p = head_.load(std::memory_order_acquire); p; p = p->next_) {
+                if (!p->active_.load(std::memory_order_relaxed) &&
+                    !p->active_.exchange(true, std::memory_order_acquire)) {
+                    return p;
+                }
+            }
+            auto p = new record;
+            p->active_.store(true, std::memory_order_relaxed);
+            p->next_ = head_.load(std::memory_order_relaxed);
+            while (!head_.compare_exchange_weak(p->next_,
+                                                p,
+                                                std::memory_order_acq_rel)) ;
+            records_n_.fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+
+        void release(record* p) noexcept
+        {
+            for (auto& h : p->hazards_) {
+                h.store(nullptr, std::memory_order_release);
+            }
+            p->active_.store(false, std::memory_order_release);
+        }
+
+        /*
+         * @brief   hand every retired node of rec that isn't protected to reclaim
+        */
+        template <typename F>
+        void scan(record* rec, F& reclaim)
+        {
+            std::vector<T*> protected_ptrs;
+            protected_ptrs.reserve(records_n_.load(std::memory_order_relaxed) * K);
+            for (auto p = head_.load(std::memory_order_acquire); p; p = p->next_) {
+                for (auto& h : p->hazards_) {
+                    if (auto hp = h.load(std::memory_order_seq_cst)) {
+                        protected_ptrs.push_back(hp);
+                    }
+                }
+            }
+            std::sort(protected_ptrs.begin(), protected_ptrs.end());
+
+            auto& retired = rec->retired_;
+            auto keep = std::partition(retired.begin(), retired.end(),
+                [&](T* p) {
+                    return std::binary_search(protected_ptrs.begin(), protected_ptrs.end(), p);
+                });
+            std::for_each(keep, retired.end(), reclaim);
+            retired.erase(keep, retired.end());
+        }
+
+    public:
+        /*
+         * RAII handle on a hazard record, valid for a single operation.
+         * Not to be shared between threads.
+        */
+        class guard
+        {
+            hazard_domain&  domain_;
+            record*         rec_;
+        public:
+            explicit guard(hazard_domain& domain) :
+                domain_(domain),
+                rec_(domain.acquire()) {}
+            guard(const guard&) = delete;
+            guard& operator=(const guard&) = delete;
+            ~guard()
+            {
+                domain_.release(rec_);
+            }
+
+            /*
+             * @brief   load src and protect the loaded pointer in slot i
+             * @return  a pointer that stays valid until slot i is changed
+             *
+             * Re-reads src after publishing the hazard; if src changed in
+             * between, the node may have been retired before we were visible.
+            */
+            T* protect(std::size_t i, const std::atomic<T*>& src) noexcept
+            {
+                auto p = src.load(std::memory_order_relaxed);
+                for (;;) {
+                    rec_->hazards_[i].store(p, std::memory_order_seq_cst);
+                    auto q = src.load(std::memory_order_seq_cst);
+                    if (p == q) return p;
+                    p = q;
+                }
+            }
+
+            void clear(std::size_t i) noexcept
+            {
+                rec_->hazards_[i].store(nullptr, std::memory_order_release);
+            }
+
+            /*
+             * @brief   retire a node already unlinked from the structure
+             * @param   reclaim     called with every node that's safe to reuse
+             *
+             * Scanning costs a pass over all hazard slots, so it only happens
+             * once the retired list outgrows the number of slots; this keeps
+             * the cost per retired node constant.
+            */
+            template <typename F>
+            void retire(T* p, F&& reclaim)
+            {
+                rec_->retired_.push_back(p);
+                const auto threshold =
+                    2 * K * domain_.records_n_.load(std::memory_order_relaxed) + 16;
+                if (rec_->retired_.size() >= threshold) {
+                    domain_.scan(rec_, reclaim);
+                }
+            }
+        };
+
+        hazard_domain() = default;
+        hazard_domain(const hazard_domain&) = delete;
+        hazard_domain& operator=(const hazard_domain&) = delete;
+
+        /*
+         * @brief   destructor
+         *
+         * Owner must have called drain() beforehand if retired nodes
+         * need to be released.
+        */
+        ~hazard_domain()
+        {
+            auto p = head_.exchange(nullptr, std::memory_order_acq_rel);
+            while (p) {
+                auto tmp = p;
+                p = p->next_;
+                delete tmp;
+            }
+        }
+
+        /*
+         * @brief   hand every retired node to reclaim, regardless of hazards
+         *
+         * Only to be called when no other thread is using the domain.
+        */
+        template <typename F>
+        void drain(F&& reclaim)
+        {
+            for (auto p = head_.load(std::memory_order_acquire); p; p = p->next_) {
+                std::for_each(p->retired_.begin(), p->retired_.end(), reclaim);
+                p->retired_.clear();
+            }
+        }
+    };
+
+} // end of namespace
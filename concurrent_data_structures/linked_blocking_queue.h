@@ -4,54 +4,66 @@
 #include <cstddef>  // size_t
 #include <optional> // optional<T>
 #include <atomic>   // atomic<size_type>
-#include <memory>   // shared_ptr<node>
+#include <memory>   // allocator<T>
+#include <memory_resource> // pmr::polymorphic_allocator<T>
 #include <utility>  // move()
 #include <mutex>    // scoped_lock
 #include <condition_variable>
+#include <chrono>   // time_point, duration
 #include <cassert>
 #include <type_traits>
-#include <cstring>
-#include <cstdlib>  // Use malloc for allocator
-#include "spinlock.h" // spinlock
+#include <new>      // launder()
+#include <vector>   // vector<T>
+#include <iterator> // back_inserter()
+#include "spinlock.h" // spinlock, ticket_lock, mcs_lock, hybrid_lock
+#include "node_pool.h" // node_pool<node>
+#include "contention_stats.h" // contention_stats
+#include "queue_closed.h" // queue_closed
+#include "cache_line.h" // padded, False_Sharing_Size
 
 
 namespace hungbiu {
-    static constexpr auto Target_Cache_Line_Size = 64u;
-    #define ALIGN_REQ alignas(Target_Cache_Line_Size)
 
-    template <typename T>
+    /*
+     * Unbounded two-lock MPMC queue.
+     * Nodes come from Alloc through std::allocator_traits, carved out in
+     * slabs by a node_pool, so any standard allocator or a
+     * std::pmr::memory_resource (see pmr::linked_blocking_queue) can be used.
+     * Lock guards either end; any Lockable works, see spinlock.h for the
+     * fair and sleeping alternatives to the default spinlock.
+    */
+    template <typename T, typename Alloc = std::allocator<T>, typename Lock = spinlock>
     class linked_blocking_queue
     {
     public:
         // Container template typedef
         using value_type = T;
         using size_type = std::size_t;
+        using allocator_type = Alloc;
 
     private:
         struct node;
         using atomic_ptr = std::atomic<node*>;
-        using lock_t = spinlock;
+        using lock_t = Lock;
 
         /* 
          * Represents a node in the underlying linked list of the queue.
-         * The only ctor has no args, thus its contents need be specified later.
-         * The default construct is never called and val_ is contructed using placement new,
+         * The node is created empty and val_ is contructed later using placement new,
          * hence it doesn't require T can be default constructed to use this container.
+         * The last node of the list is always empty; a node holds a value iff
+         * next_ is not null.
         */
         struct node
         {
-            T       val_;
-            node*   next_;
-            
-            node(const T& val) :
-                val_(val), 
-                next_(nullptr) {}
-            node(T&& val) :
-                val_(std::move(val)), 
-                next_(nullptr) {}
-            node(const node&) = delete;
-            ~node() = default;
-            node& operator=(const node&) = delete;            
+            using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+            atomic_ptr  next_{ nullptr };
+            storage_t   val_;
+
+            T* get_val() noexcept
+            {
+                return std::launder(reinterpret_cast<T*>(&val_));
+            }
         };
         
         /*
@@ -59,96 +71,68 @@ namespace hungbiu {
          * It packs a pointer to an node and a spinlock, 
          * which needs to be locked before modifying the pointer.
          * 
-         * It aligns to cache line size to prevent false sharing.
+         * It aligns to False_Sharing_Size to prevent false sharing.
         */
-        struct ALIGN_REQ end
+        struct alignas(False_Sharing_Size) end
         {
             mutable lock_t  lock_;
             atomic_ptr      ptr_;
         };
         
         // Members
-        ALIGN_REQ atomic_ptr free_list_{ nullptr };
+        node_pool<node, Alloc> pool_;
         end front_;
         end back_;
-        std::condition_variable_any cv_;
+        // Off back_'s span: waiters touch it while producers hold back.lock
+        padded<std::condition_variable_any> cv_;
+        // Consumers blocked on cv_, lets producers skip notify_one()
+        std::atomic<size_type> waiters_{ 0 };
+        std::atomic<bool> closed_{ false };
+        // Pushes, pops and waits; lock and pool counters live in those
+        contention_stats stats_;
         
         /*
-         * @brief   push the newly released node to the front of the free_list_
-         *          using CAS
-         * @param   empty_node  pointer to the node released
+         * @brief   give a node whose value has been destroyed back to pool_
         */
         void free_node(node* p) noexcept
         {
-            // Does not call destructor. If T is managing some resource
-            // the resource won't be released.
-            // Swap the freed node to the head of free_list_
-            p->next_ = free_list_.load(std::memory_order_acquire);
-            while ( !free_list_.compare_exchange_weak( p->next_,
-                                                       p,
-                                                       std::memory_order_acq_rel) ) ;
-        }
-        
-        /*
-         * @brief   allocate a new node from this->free_list_
-         * @return  return the first node of the free_list_; 
-         *          if there is no node available, return nullptr
-         * 
-         * Try to pop a previously cached node from free_list_ using CAS.
-         * Using linked-list-based queue has a problem that dynamic allocation could 
-         * slow down its perfermance. Caching popped nodes may help relieve that.
-        */
-        node* alloc_from_free_list() noexcept
-        {
-            node* alloc = free_list_.load(std::memory_order_acquire);
-            while ( alloc &&
-                    !free_list_.compare_exchange_weak( alloc,           // expect
-                                                       alloc->next_,    // desire
-                                                       std::memory_order_acq_rel )) ;            
-            return alloc;
-        }
-
-        /*
-         * @brief   allocate a new node from allocator
-         * @return  pointer to the allocated node
-        */
-        static node* alloc_from_allocator()
-        {
-            return static_cast<node*>(malloc(sizeof(node)));
+            p->~node();
+            pool_.deallocate(p);
         }
 
         /* 
          * @brief   node's factory function
-         * @param   val     data to be added
          * @return  return pointer to the allocated node
-         * @exception   it may throw when both free_list_ and ::new  
-         *              are exhausted.
-         * It first tries to allocate from free_list_ to get cached nodes, 
-         * then use ::new if fails.
+         * @exception   it may throw std::bad_alloc when the pool 
+         *              needs a new slab and allocation fails.
+         * The node comes from this thread's magazine in pool_ in most cases,
+         * so it's usually neither a heap call nor a contended CAS.
         */        
         node* alloc_node() 
         {
-            // Allocate a new node
-            // but doesn't construct it
-            node* new_node = alloc_from_free_list();
-            if (!new_node) {                
-                new_node = alloc_from_allocator();
-            }
-            std::memset(new_node, 0, sizeof(node));
-            return new_node;
+            return new (pool_.allocate()) node;
         }
 
         /*
          * @brief   append new node to the end of the list
+         * @exception   throw queue_closed if the queue has been closed, or
+         *              whatever constructing T throws; the queue and its
+         *              pool are left as they were
          * 
          * After insertion, notify one of the thread (if there is any) 
          * waiting on the condition variable.
-         * And it doesn't need to acquire front.lock. If when the queue 
+         * It doesn't need to acquire front.lock to insert. If when the queue 
          * is emtpy, no thread will modify front.
+         *
+         * Producer and waiting consumers form a Dekker pair on back.ptr and
+         * waiters_ (see wait()): with nobody waiting, a push costs a fence
+         * instead of a notify. When a consumer is waiting, front.lock is
+         * taken briefly before notifying, so that a consumer that saw the
+         * queue empty is already inside cv_.wait() and can't miss it.
         */
         template<typename U, 
                  typename = std::enable_if_t<std::is_constructible_v<T, U&&>>>
-        void insert(U&& value) noexcept(std::is_nothrow_constructible_v<T, U&&>)
+        void insert(U&& value)
         {
             // Alloc a new node to be the new tail
             // Move this out of critcal section 
@@ -156,19 +140,124 @@ namespace hungbiu {
             auto new_node = alloc_node();            
             {
                 std::lock_guard lk_back{ back_.lock_ };
+                // close() sets the flag holding back.lock
+                if (closed_.load(std::memory_order_relaxed)) {
+                    free_node(new_node);
+                    throw queue_closed{};
+                }
                 auto tail = back_.ptr_.load(std::memory_order_acquire);
 
-                // Construct old tail (possibly time-consuming)
-                new (tail) node(std::forward<U>(value));
-                // new_node->next_ = nullptr;
+                // Construct old tail (possibly time-consuming); if it
+                // throws, tail stays the tail and new_node isn't needed
+                try {
+                    new (&tail->val_) T(std::forward<U>(value));
+                }
+                catch (...) {
+                    free_node(new_node);
+                    throw;
+                }
 
                 // Modify back.ptr to append new_node to the tail of the queue
-                tail->next_ = new_node;
+                tail->next_.store(new_node, std::memory_order_release);
                 back_.ptr_.store(new_node, std::memory_order_release);
             }        
+            stats_.add(stat_counter::pushes);
+
+            // Notify one waiting thread, if there is any
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters_.load(std::memory_order_relaxed) == 0) return;
+            {
+                std::lock_guard lk_front{ front_.lock_ };
+            }
+            cv_->notify_one();
+        }
+
+        /*
+         * @brief   wait on cv_ until the queue is non-empty, closed, or
+         *          wait_fn returns false
+         * @param   front_lk    unique lock on front.lock
+         * @param   wait_fn     calls cv_.wait() or a timed variant with pred
+         *
+         * Registers in waiters_ for the duration of the wait; the fence pairs
+         * with the one in insert().
+        */
+        template<typename WaitFn>
+        void wait(std::unique_lock<lock_t>& front_lk, WaitFn wait_fn)
+        {
+            auto ready = [&]() { return !empty() || is_closed(); };
+            if (ready()) return;
+            stats_.add(stat_counter::parks);
+            waiters_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wait_fn(front_lk, ready);
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+        }
 
-            // Notify one waiting thread
-            cv_.notify_one();
+        /*
+         * @brief   detach up to max values from the front in one critical section
+         * @param   front_lk    unique lock on front.lock, released on return
+         * @param   end         set to the new front, which stays in the queue
+         * @return  first detached node; the detached nodes run up to end
+         *
+         * Only pointers are touched under the lock, and never past the
+         * back_.ptr loaded here: a push links next_ before moving back.ptr,
+         * so the node after the last one may hold no value yet. Taking
+         * everything moves the front straight to that last node.
+         * The values are moved out and the nodes recycled by consume()
+         * after the lock is released.
+        */
+        node* detach(std::unique_lock<lock_t> front_lk, size_type max, node*& end) noexcept
+        {
+            auto first = front_.ptr_.load(std::memory_order_acquire);
+            const auto last = back_.ptr_.load(std::memory_order_acquire);
+            auto p = first;
+            if (max == static_cast<size_type>(-1)) {
+                p = last;
+            }
+            else {
+                for (size_type n = 0; n < max && p != last; ++n) {
+                    p = p->next_.load(std::memory_order_acquire);
+                }
+            }
+            front_.ptr_.store(p, std::memory_order_release);
+            front_lk.unlock();
+            end = p;
+            return first;
+        }
+
+        /*
+         * @brief   move the values of the detached nodes [p, end) to out and
+         *          free the nodes
+         * @param   n   number of values written to out
+         * @exception   assignment to out may throw, in which case the
+         *              remaining values are destroyed
+        */
+        template<typename OutputIt>
+        OutputIt consume(node* p, node* end, OutputIt out, size_type& n)
+        {
+            n = 0;
+            try {
+                for (; p != end; ++n) {
+                    auto next = p->next_.load(std::memory_order_relaxed);
+                    *out = std::move(*p->get_val());
+                    ++out;
+                    p->get_val()->~T();
+                    free_node(p);
+                    p = next;
+                }
+            }
+            catch (...) {
+                stats_.add(stat_counter::pops, n);
+                while (p != end) {
+                    auto next = p->next_.load(std::memory_order_relaxed);
+                    p->get_val()->~T();
+                    free_node(p);
+                    p = next;
+                }
+                throw;
+            }
+            stats_.add(stat_counter::pops, n);
+            return out;
         }
 
         /*
@@ -196,15 +285,18 @@ namespace hungbiu {
             // Construct return value from old
             // If this shall throw, the queue stay un-modified,
             // and front_lk's dtor will be called before exiting the function frame
-            T e = std::move(old->val_);
+            T e = std::move(*old->get_val());
 
             // Pop node
-            front_.ptr_.store(old->next_, std::memory_order_release);
+            front_.ptr_.store(old->next_.load(std::memory_order_acquire), 
+                              std::memory_order_release);
 
             // Release front.lock here
             front_lk.unlock();
+            stats_.add(stat_counter::pops);
 
             // Delete old_front
+            old->get_val()->~T();
             free_node(old);
 
             return e;
@@ -217,7 +309,15 @@ namespace hungbiu {
          * Allocate a dumb node as a head node
          * which may throw std::bad_alloc.
         */
-        linked_blocking_queue() 
+        linked_blocking_queue() :
+            linked_blocking_queue(Alloc()) {}
+
+        /*
+         * @brief   construct with a given allocator
+         * @param   alloc   allocator the node slabs are obtained from
+        */
+        explicit linked_blocking_queue(const Alloc& alloc) :
+            pool_(alloc)
         {
             auto p = alloc_node();
             front_.ptr_.store(p, std::memory_order_release);
@@ -235,22 +335,17 @@ namespace hungbiu {
         {
             std::scoped_lock slk{ front_.lock_, back_.lock_ };
 
-            auto delete_list = [](node* p) {
-                while (p) {
-                    auto tmp = p;
-                    p = p->next_;
-                    tmp->~node();
-                    free( static_cast<void*>(tmp) );
-                }
-            };
-
-            // Delete nodes enqueued
+            // Destroy values enqueued, the last node is empty.
+            // Memory goes back to the allocator with pool_
             node* p = front_.ptr_.exchange(nullptr, std::memory_order_acq_rel);
-            delete_list(p);
-
-            // Delete nodes freed
-            p = free_list_.exchange(nullptr, std::memory_order_acq_rel);
-            delete_list(p);
+            while (p) {
+                auto next = p->next_.load(std::memory_order_acquire);
+                if (next) {
+                    p->get_val()->~T();
+                }
+                p->~node();
+                p = next;
+            }
         }
 
         linked_blocking_queue& operator=(const linked_blocking_queue&) = delete;
@@ -258,18 +353,87 @@ namespace hungbiu {
         // Capacity
         /*
          * @brief check if the queue is emtpy
+         *
+         * Only the last node is empty, so the queue is iff both ends point
+         * at it. Neither node is dereferenced: without front.lock, the front
+         * one may be popped and recycled by the pool meanwhile. Holding
+         * front.lock the answer is exact, otherwise it's a hint.
+         * A push stores next_ before back.ptr, so seeing back.ptr moved off
+         * the front node means its next_ is visible.
         */
         bool empty() const noexcept
         {
-            return !front_.ptr_.load(std::memory_order_acquire)->next_;
+            return front_.ptr_.load(std::memory_order_acquire) ==
+                   back_.ptr_.load(std::memory_order_acquire);
+        }
+
+        /*
+         * @brief   pre-allocate nodes for at least n elements
+         * @exception   allocator may throw std::bad_alloc
+         *
+         * Nodes are carved out of one contiguous slab, so that pushing up to
+         * n elements needs no allocation and neighbouring nodes are adjacent
+         * in memory.
+        */
+        void reserve(size_type n)
+        {
+            pool_.reserve(n);
+        }
+
+        allocator_type get_allocator() const
+        {
+            return pool_.get_allocator();
+        }
+
+        /*
+         * @brief   contention counters, all zero unless HUNGBIU_ENABLE_STATS
+         *          is defined; see contention_stats
+         * @return  waits on both locks, node pool hits and slab allocations,
+         *          pushes, pops and their difference as depth
+        */
+        stats_snapshot stats() const noexcept
+        {
+            auto snap = stats_.snapshot();
+            snap += stats_of(front_.lock_);
+            snap += stats_of(back_.lock_);
+            snap += pool_.stats();
+            snap.depth_ = snap[stat_counter::pushes] > snap[stat_counter::pops] ?
+                          snap[stat_counter::pushes] - snap[stat_counter::pops] : 0;
+            return snap;
         }
 
         // Modifiers
+        /*
+         * @brief   reject further pushes and wake every waiting consumer
+         *
+         * Elements pushed before close() can still be popped; once they're
+         * drained pop() throws queue_closed and try_pop()/pop_for() return
+         * an empty optional. Calling close() more than once has no effect.
+        */
+        void close()
+        {
+            {
+                std::lock_guard lk_back{ back_.lock_ };
+                closed_.store(true, std::memory_order_release);
+            }
+            // A consumer that has seen the flag clear is waiting already
+            // once we get front.lock
+            {
+                std::lock_guard lk_front{ front_.lock_ };
+            }
+            cv_->notify_all();
+        }
+        bool is_closed() const noexcept
+        {
+            return closed_.load(std::memory_order_acquire);
+        }
+
         /*
          * @brief push new data to the tail of the queue
          * @param   value   data to be pushed
          * @exception   memory allocation for the node and 
-                        copying the value may throw std::bad_alloc
+                        copying the value may throw std::bad_alloc,
+                        throw queue_closed if the queue has been closed
         */
         void push(const T& value)
         {
@@ -299,17 +463,99 @@ namespace hungbiu {
         /*
          * @brief   blocking pop
          * @return  value in the front node
-         * @exception   copy constructor or move constructor of T may throw
+         * @exception   copy constructor or move constructor of T may throw,
+         *              throw queue_closed if the queue is closed and drained
          * 
          * Block if the queue is empty.
         */
         [[nodiscard]] T pop()
         {
             std::unique_lock front_lk{ front_.lock_ };
-            cv_.wait(front_lk,
-                [&]() { return !empty(); });
+            wait(front_lk, [&](auto& lk, auto ready) { cv_->wait(lk, ready); });
+            if (empty()) throw queue_closed{};
             return pop( std::move(front_lk) );
         }
+        /*
+         * @brief   blocking pop with a deadline
+         * @return  the front value, or an empty optional if the queue
+         *          stayed empty until deadline or is closed and drained
+         * @exception   copy constructor or move constructor of T may throw
+        */
+        template<typename Clock, typename Duration>
+        [[nodiscard]] std::optional<T> pop_until(const std::chrono::time_point<Clock, Duration>& deadline)
+        {
+            std::optional<T> ret{};
+            std::unique_lock front_lk{ front_.lock_ };
+            wait(front_lk, [&](auto& lk, auto ready) { cv_->wait_until(lk, deadline, ready); });
+            if (empty()) {
+                return ret;
+            }
+            ret = std::move( pop(std::move(front_lk)) );
+            return ret;
+        }
+        /*
+         * @brief   blocking pop with a timeout
+         * @return  the front value, or an empty optional on timeout
+         *          or if the queue is closed and drained
+         * @exception   copy constructor or move constructor of T may throw
+        */
+        template<typename Rep, typename Period>
+        [[nodiscard]] std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return pop_until(std::chrono::steady_clock::now() + timeout);
+        }
+
+        // Batch modifiers
+        /*
+         * @brief   non-blocking batch pop
+         * @param   out     receives the values in queue order
+         * @param   max     maximum number of values to pop
+         * @return  number of values written to out
+         * @exception   assignment to out may throw, the values that were
+         *              detached but not yet written are lost
+         *
+         * front.lock is held once, only to unlink the nodes; values are
+         * moved out and nodes recycled after it's released.
+        */
+        template<typename OutputIt>
+        size_type drain_into(OutputIt out, size_type max = static_cast<size_type>(-1))
+        {
+            if (max == 0) return 0;
+            node* end = nullptr;
+            auto first = detach(std::unique_lock{ front_.lock_ }, max, end);
+            size_type n = 0;
+            consume(first, end, out, n);
+            return n;
+        }
+        /*
+         * @brief   blocking batch pop of every value in the queue
+         * @return  values in queue order, at least one
+         * @exception   throw queue_closed if the queue is closed and drained,
+         *              constructing the vector may throw std::bad_alloc
+         *
+         * Block until the queue is non-empty, then take the whole
+         * list in a single critical section.
+        */
+        [[nodiscard]] std::vector<T> pop_all()
+        {
+            std::unique_lock front_lk{ front_.lock_ };
+            wait(front_lk, [&](auto& lk, auto ready) { cv_->wait(lk, ready); });
+            if (empty()) throw queue_closed{};
+
+            node* end = nullptr;
+            auto first = detach(std::move(front_lk), static_cast<size_type>(-1), end);
+            // If push_back() throws, consume() frees the remaining nodes
+            std::vector<T> ret;
+            size_type n = 0;
+            consume(first, end, std::back_inserter(ret), n);
+            return ret;
+        }
     };
 
+    namespace pmr {
+        template <typename T, typename Lock = spinlock>
+        using linked_blocking_queue = 
+            hungbiu::linked_blocking_queue<T, std::pmr::polymorphic_allocator<T>, Lock>;
+    }
+
 };
\ No newline at end of file
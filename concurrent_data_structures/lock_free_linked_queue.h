@@ -0,0 +1,315 @@
+#pragma once
+#include <cstddef>  // size_t
+#include <optional> // optional<T>
+#include <atomic>   // atomic<node*>
+#include <utility>  // move()
+#include <mutex>    // mutex, unique_lock
+#include <condition_variable>
+#include <type_traits>
+#include <thread>   // yield()
+#include <new>      // bad_alloc, launder()
+#include <cstdlib>  // Use malloc for allocator
+#include "hazard_pointer.h"
+#include "backoff.h" // cpu_relax()
+#include "cache_line.h" // padded, False_Sharing_Size
+
+
+namespace hungbiu {
+
+    /*
+     * Unbounded lock-free MPMC queue, after Michael & Scott, "Simple, Fast,
+     * and Practical Non-Blocking and Blocking Concurrent Queue Algorithms", 1996.
+     *
+     * Same push/try_pop/pop surface as linked_blocking_queue, but neither end
+     * is locked: producers CAS the last node's next_ and consumers CAS head_.
+     * Removed nodes go through a hazard_domain before they're put on the free
+     * list, so a node is never reused while another thread may still read it.
+    */
+    template <typename T>
+    class lock_free_linked_queue
+    {
+    public:
+        // Container template typedef
+        using value_type = T;
+        using size_type = std::size_t;
+
+    private:
+        /*
+         * Represents a node in the underlying linked list of the queue.
+         * head_ always points to a dummy node whose value has either been
+         * popped or never existed; every node behind it holds a constructed value.
+        */
+        struct node
+        {
+            using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+            std::atomic<node*>  next_{ nullptr };
+            storage_t           val_;
+
+            T* get_val() noexcept
+            {
+                return std::launder(reinterpret_cast<T*>(&val_));
+            }
+        };
+        using domain_t = hazard_domain<node, 2>;
+        using guard_t = typename domain_t::guard;
+
+        // Members
+        padded<std::atomic<node*>> head_;
+        padded<std::atomic<node*>> tail_;
+        padded<std::atomic<node*>> free_list_{ nullptr };
+        mutable domain_t domain_;
+
+        // Parking for blocking pop()
+        padded<std::atomic<std::size_t>> waiters_{ 0 };
+        std::mutex mtx_;
+        std::condition_variable cv_;
+
+        /*
+         * @brief   push a node that no thread can reference any more
+         *          to the front of the free_list_
+        */
+        void free_node(node* p) noexcept
+        {
+            auto top = free_list_->load(std::memory_order_relaxed);
+            do {
+                p->next_.store(top, std::memory_order_relaxed);
+            } while (!free_list_->compare_exchange_weak(top,
+                                                       p,
+                                                       std::memory_order_release,
+                                                       std::memory_order_relaxed));
+        }
+
+        /*
+         * @brief   pop a cached node from free_list_
+         * @return  if there is no node available, return nullptr
+         *
+         * The top node is protected before reading its next_. As nodes only
+         * get back on the free list through the hazard domain, the top can't
+         * be popped and pushed back while we hold it, which rules out ABA.
+        */
+        node* alloc_from_free_list(guard_t& g) noexcept
+        {
+            for (;;) {
+                auto p = g.protect(0, *free_list_);
+                if (!p) return nullptr;
+                auto next = p->next_.load(std::memory_order_acquire);
+                if (free_list_->compare_exchange_strong(p,
+                                                       next,
+                                                       std::memory_order_acq_rel)) {
+                    g.clear(0);
+                    return p;
+                }
+            }
+        }
+
+        /*
+         * @brief   allocate a new node from allocator
+         * @exception   throw std::bad_alloc if malloc fails
+        */
+        static node* alloc_from_allocator()
+        {
+            auto p = malloc(sizeof(node));
+            if (!p) throw std::bad_alloc{};
+            return new (p) node;
+        }
+
+        node* alloc_node(guard_t& g)
+        {
+            auto p = alloc_from_free_list(g);
+            if (!p) {
+                p = alloc_from_allocator();
+            }
+            p->next_.store(nullptr, std::memory_order_relaxed);
+            return p;
+        }
+
+        /*
+         * @brief   append a constructed value to the end of the list
+         *
+         * Once the node is linked, wake a consumer if one is parked in pop().
+        */
+        template<typename U,
+                 typename = std::enable_if_t<std::is_constructible_v<T, U&&>>>
+        void insert(U&& value)
+        {
+            guard_t g{ domain_ };
+            auto new_node = alloc_node(g);
+            try {
+                new (&new_node->val_) T(std::forward<U>(value));
+            }
+            catch (...) {
+                // Not straight back onto the free list: it was its top, and
+                // another thread may still hold it protected there
+                g.retire(new_node, [this](node* p) { free_node(p); });
+                throw;
+            }
+
+            for (;;) {
+                auto tail = g.protect(0, *tail_);
+                auto next = tail->next_.load(std::memory_order_acquire);
+                if (next) {
+                    // tail_ is lagging behind, help move it forward
+                    tail_->compare_exchange_weak(tail, next, std::memory_order_acq_rel);
+                    continue;
+                }
+                if (tail->next_.compare_exchange_weak(next,
+                                                      new_node,
+                                                      std::memory_order_acq_rel)) {
+                    tail_->compare_exchange_strong(tail, new_node, std::memory_order_acq_rel);
+                    break;
+                }
+            }
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters_->load(std::memory_order_relaxed)) {
+                {
+                    std::lock_guard lk{ mtx_ };
+                }
+                cv_.notify_one();
+            }
+        }
+
+    public:
+        /*
+         * @brief   default constructor
+         *
+         * Allocate a dummy node as the head node
+         * which may throw std::bad_alloc.
+        */
+        lock_free_linked_queue()
+        {
+            auto p = alloc_from_allocator();
+            head_->store(p, std::memory_order_relaxed);
+            tail_->store(p, std::memory_order_relaxed);
+        }
+
+        lock_free_linked_queue(const lock_free_linked_queue&) = delete;
+
+        /*
+         * @brief    destructor
+         *
+         * Release all nodes back to the allocator.
+        */
+        ~lock_free_linked_queue()
+        {
+            // Retired nodes are dummies, they don't hold values
+            domain_.drain([this](node* p) { free_node(p); });
+
+            auto delete_list = [](node* p, bool has_val) {
+                while (p) {
+                    auto tmp = p;
+                    p = p->next_.load(std::memory_order_relaxed);
+                    if (has_val) {
+                        tmp->get_val()->~T();
+                    }
+                    tmp->~node();
+                    free(static_cast<void*>(tmp));
+                }
+            };
+
+            // The head node is the dummy
+            auto dummy = head_->exchange(nullptr, std::memory_order_acq_rel);
+            delete_list(dummy->next_.load(std::memory_order_relaxed), true);
+            dummy->next_.store(nullptr, std::memory_order_relaxed);
+            delete_list(dummy, false);
+
+            delete_list(free_list_->exchange(nullptr, std::memory_order_acq_rel), false);
+        }
+
+        lock_free_linked_queue& operator=(const lock_free_linked_queue&) = delete;
+
+        // Capacity
+        /*
+         * @brief check if the queue is emtpy
+        */
+        bool empty() const
+        {
+            guard_t g{ domain_ };
+            return !g.protect(0, *head_)->next_.load(std::memory_order_acquire);
+        }
+
+        // Modifiers
+        /*
+         * @brief push new data to the tail of the queue
+         * @param   value   data to be pushed
+         * @exception   memory allocation for the node and
+                        copying the value may throw std::bad_alloc
+        */
+        void push(const T& value)
+        {
+            insert(value);
+        }
+        void push(T&& value)
+        {
+            insert(std::forward<T>(value));
+        }
+
+        /*
+         * @brief non-blocking pop
+         * @return  if success, the value will be store in optional<T>,
+         *          else the value inside will not be constructed.
+         *
+         * Return immediately if the queue is empty.
+         * The value is moved out after the node is unlinked, so if T's move
+         * constructor throws the element is lost.
+        */
+        [[nodiscard]] std::optional<T> try_pop()
+        {
+            std::optional<T> ret{};
+            guard_t g{ domain_ };
+            for (;;) {
+                auto head = g.protect(0, *head_);
+                auto next = g.protect(1, head->next_);
+                // head may have been retired before next was protected
+                if (head != head_->load(std::memory_order_acquire)) continue;
+                if (!next) return ret;
+
+                // tail_ is lagging behind, help move it forward before
+                // unlinking nodes it still points to
+                auto tail = tail_->load(std::memory_order_acquire);
+                if (head == tail) {
+                    tail_->compare_exchange_weak(tail, next, std::memory_order_acq_rel);
+                    continue;
+                }
+                if (head_->compare_exchange_strong(head,
+                                                  next,
+                                                  std::memory_order_acq_rel)) {
+                    // next is the new dummy, its value is ours
+                    ret.emplace(std::move(*next->get_val()));
+                    next->get_val()->~T();
+                    g.clear(1);
+                    g.clear(0);
+                    g.retire(head, [this](node* p) { free_node(p); });
+                    return ret;
+                }
+            }
+        }
+        /*
+         * @brief   blocking pop
+         * @return  value in the front node
+         *
+         * Spin and yield for a while if the queue is emtpy,
+         * then sleep until a producer pushes.
+        */
+        [[nodiscard]] T pop()
+        {
+            for (auto i = 0u; i < 128; ++i) {
+                if (auto ret = try_pop()) return std::move(*ret);
+                if (i < 64) cpu_relax();
+                else std::this_thread::yield();
+            }
+            for (;;) {
+                {
+                    std::unique_lock lk{ mtx_ };
+                    waiters_->fetch_add(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    cv_.wait(lk, [&]() { return !empty(); });
+                    waiters_->fetch_sub(1, std::memory_order_relaxed);
+                }
+                if (auto ret = try_pop()) return std::move(*ret);
+            }
+        }
+    };
+
+};
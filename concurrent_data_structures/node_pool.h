@@ -0,0 +1,343 @@
+#pragma once
+#include <cstddef>  // size_t
+#include <cstdint>  // uint64_t, uintptr_t
+#include <atomic>   // atomic<uint64_t>
+#include <memory>   // shared_ptr<shared_state>, allocator_traits
+#include <algorithm>// max()
+#include <new>      // placement new
+#include <cassert>
+#include "contention_stats.h"
+#include "cache_line.h"
+
+namespace hungbiu {
+
+    /*
+     * Fixed-size block pool for the nodes of a linked container.
+     *
+     * Blocks are carved out of slabs and handed out through per-thread
+     * magazines, so in steady state allocate() and deallocate() only touch
+     * thread-local memory. A thread whose magazine runs dry takes a whole
+     * magazine from the shared depot, and a thread whose magazine is full
+     * pushes it to the depot, so the shared state sees one CAS per Magazine_N
+     * nodes instead of one per node.
+     *
+     * The depot is a Treiber stack of magazines whose top pointer carries a
+     * version tag that's bumped on every update. A pop that read a stale next
+     * link fails its CAS even if the same magazine is back on top, which is
+     * what makes it ABA-safe without double-width CAS.
+     *
+     * Slabs are obtained from Alloc, rebound through std::allocator_traits,
+     * so any standard allocator works, including std::pmr::polymorphic_allocator.
+     * Memory is only returned when the pool is destroyed.
+    */
+    template <typename Node, typename Alloc = std::allocator<Node>>
+    class node_pool
+    {
+        // Layout of a block while it's not in use
+        struct free_block
+        {
+            free_block*                 next_;          // next block in magazine
+            std::atomic<free_block*>    next_chain_;    // next magazine in depot
+        };
+
+        struct slab_header
+        {
+            slab_header*    next_;
+            std::size_t     blocks_n_;  // including the block holding the header
+        };
+
+        static constexpr std::size_t Magazine_N = 32;
+        static constexpr std::size_t Cache_N = 4;
+        static constexpr std::size_t Block_Align = std::max({ alignof(Node),
+                                                             alignof(free_block),
+                                                             alignof(slab_header) });
+        static constexpr std::size_t Block_Size = std::max({ sizeof(Node),
+                                                            sizeof(free_block),
+                                                            sizeof(slab_header) });
+
+        // Unit of allocation; a slab is an array of blocks and
+        // its first block holds the slab_header
+        struct alignas(Block_Align) block
+        {
+            unsigned char bytes_[Block_Size];
+        };
+        using block_alloc_t = typename std::allocator_traits<Alloc>::template rebind_alloc<block>;
+        using block_traits = std::allocator_traits<block_alloc_t>;
+
+        /*
+         * Stack of magazines with a version tag packed in the unused upper bits
+         * of the top pointer (16 bits on 64-bit targets, 32 on 32-bit ones).
+        */
+        class tagged_stack
+        {
+            static constexpr unsigned Ptr_Bits = sizeof(void*) == 8 ? 48 : 32;
+            static constexpr std::uint64_t Ptr_Mask = (std::uint64_t{ 1 } << Ptr_Bits) - 1;
+
+            alignas(False_Sharing_Size)
+            std::atomic<std::uint64_t> top_{ 0 };
+
+            static free_block* get_ptr(std::uint64_t v) noexcept
+            {
+                return reinterpret_cast<free_block*>(static_cast<std::uintptr_t>(v & Ptr_Mask));
+            }
+            static std::uint64_t next_tag(std::uint64_t v, free_block* p) noexcept
+            {
+                return (((v >> Ptr_Bits) + 1) << Ptr_Bits) |
+                       static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p));
+            }
+        public:
+            void push(free_block* chain) noexcept
+            {
+                assert((reinterpret_cast<std::uintptr_t>(chain) & ~Ptr_Mask) == 0);
+                auto old = top_.load(std::memory_order_relaxed);
+                do {
+                    chain->next_chain_.store(get_ptr(old), std::memory_order_relaxed);
+                } while (!top_.compare_exchange_weak(old,
+                                                     next_tag(old, chain),
+                                                     std::memory_order_release,
+                                                     std::memory_order_relaxed));
+            }
+            free_block* pop() noexcept
+            {
+                auto old = top_.load(std::memory_order_acquire);
+                for (;;) {
+                    auto p = get_ptr(old);
+                    if (!p) return nullptr;
+                    // p may have been popped and reused by now, in which case
+                    // next is garbage and the tag makes the CAS below fail
+                    auto next = p->next_chain_.load(std::memory_order_relaxed);
+                    if (top_.compare_exchange_weak(old,
+                                                   next_tag(old, next),
+                                                   std::memory_order_acquire,
+                                                   std::memory_order_acquire)) {
+                        return p;
+                    }
+                }
+            }
+        };
+
+        /*
+         * State shared between the pool and the thread caches holding its
+         * magazines. Threads only keep weak references, so a magazine can
+         * be flushed back from a thread's cache as long as the pool is alive.
+        */
+        struct shared_state
+        {
+            tagged_stack                depot_;
+            std::atomic<slab_header*>   slabs_{ nullptr };
+            block_alloc_t               alloc_;
+
+            explicit shared_state(const Alloc& alloc) :
+                alloc_(alloc) {}
+
+            ~shared_state()
+            {
+                auto p = slabs_.exchange(nullptr, std::memory_order_acq_rel);
+                while (p) {
+                    auto tmp = p;
+                    p = p->next_;
+                    const auto n = tmp->blocks_n_;
+                    tmp->~slab_header();
+                    block_traits::deallocate(alloc_, reinterpret_cast<block*>(tmp), n);
+                }
+            }
+
+            /*
+             * @brief   allocate a new slab of n contiguous blocks
+             * @return  the blocks of the slab linked in address order,
+             *          cut into chains of at most Magazine_N blocks linked through
+             *          next_chain_ when chained is true
+             * @exception   allocator may throw std::bad_alloc
+            */
+            free_block* new_slab(std::size_t n, bool chained = false)
+            {
+                auto raw = block_traits::allocate(alloc_, n + 1);
+                auto slab = new (static_cast<void*>(raw)) slab_header{ slabs_.load(std::memory_order_relaxed), n + 1 };
+                while (!slabs_.compare_exchange_weak(slab->next_,
+                                                     slab,
+                                                     std::memory_order_release,
+                                                     std::memory_order_relaxed)) ;
+
+                free_block* head = nullptr;
+                free_block* chain = nullptr;
+                for (auto i = n; i > 0; --i) {
+                    auto p = new (static_cast<void*>(raw + i)) free_block;
+                    if (chained && (i % Magazine_N) == 0 && head) {
+                        // Close the chain started at head and start a new one
+                        head->next_chain_.store(chain, std::memory_order_relaxed);
+                        chain = head;
+                        head = nullptr;
+                    }
+                    p->next_ = head;
+                    head = p;
+                }
+                if (chained) {
+                    head->next_chain_.store(chain, std::memory_order_relaxed);
+                }
+                return head;
+            }
+        };
+
+        struct magazine
+        {
+            std::uint64_t               id_{ 0 };
+            std::weak_ptr<shared_state> owner_;
+            free_block*                 head_{ nullptr };
+            std::size_t                 count_{ 0 };
+
+            // Return the blocks to their pool if it's still alive
+            void flush() noexcept
+            {
+                if (head_) {
+                    if (auto s = owner_.lock()) {
+                        s->depot_.push(head_);
+                    }
+                }
+                head_ = nullptr;
+                count_ = 0;
+            }
+        };
+
+        struct thread_cache
+        {
+            magazine    mags_[Cache_N];
+            std::size_t victim_{ 0 };
+
+            ~thread_cache()
+            {
+                for (auto& m : mags_) m.flush();
+            }
+        };
+
+        static thread_cache& local_cache() noexcept
+        {
+            thread_local thread_cache cache;
+            return cache;
+        }
+
+        static std::uint64_t next_id() noexcept
+        {
+            static std::atomic<std::uint64_t> id{ 0 };
+            return id.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+
+        const std::uint64_t             id_;
+        std::shared_ptr<shared_state>   state_;
+        contention_stats                stats_;
+
+        /*
+         * @brief   this thread's magazine for this pool
+         *
+         * If the thread cache has no magazine for this pool, evict one
+         * round-robin and flush it back to its own pool.
+        */
+        magazine& local_magazine() noexcept
+        {
+            auto& cache = local_cache();
+            for (auto& m : cache.mags_) {
+                if (m.id_ == id_) return m;
+            }
+            auto& m = cache.mags_[cache.victim_];
+            cache.victim_ = (cache.victim_ + 1) % Cache_N;
+            m.flush();
+            m.id_ = id_;
+            m.owner_ = state_;
+            return m;
+        }
+
+    public:
+        using allocator_type = Alloc;
+
+        explicit node_pool(const Alloc& alloc = Alloc()) :
+            id_(next_id()),
+            state_(std::make_shared<shared_state>(alloc)) {}
+        node_pool(const node_pool&) = delete;
+        node_pool& operator=(const node_pool&) = delete;
+        ~node_pool() = default;
+
+        /*
+         * @brief   allocate uninitialized storage for one Node
+         * @exception   throw std::bad_alloc when a new slab is needed
+         *              but can't be allocated
+        */
+        void* allocate()
+        {
+            auto& m = local_magazine();
+            if (!m.head_) {
+                // Refill from the depot, or carve a new slab
+                m.head_ = state_->depot_.pop();
+                if (!m.head_) {
+                    m.head_ = state_->new_slab(Magazine_N);
+                    stats_.add(stat_counter::slab_allocations);
+                }
+                else {
+                    stats_.add(stat_counter::free_list_hits);
+                }
+                m.count_ = 0;
+                for (auto p = m.head_; p; p = p->next_) ++m.count_;
+            }
+            else {
+                stats_.add(stat_counter::free_list_hits);
+            }
+            auto p = m.head_;
+            m.head_ = p->next_;
+            --m.count_;
+            p->~free_block();
+            return static_cast<void*>(p);
+        }
+
+        /*
+         * @brief   give back storage obtained from allocate()
+         *
+         * Node must have been destroyed already.
+        */
+        void deallocate(void* raw) noexcept
+        {
+            auto& m = local_magazine();
+            if (m.count_ == Magazine_N) {
+                // Magazine full, hand it over to the consumers of the depot
+                state_->depot_.push(m.head_);
+                m.head_ = nullptr;
+                m.count_ = 0;
+            }
+            auto p = new (raw) free_block;
+            p->next_ = m.head_;
+            m.head_ = p;
+            ++m.count_;
+        }
+
+        /*
+         * @brief   pre-allocate at least n blocks in one contiguous slab
+         * @exception   allocator may throw std::bad_alloc
+         *
+         * The blocks are split into magazines and put in the depot, ready for
+         * any thread to take, so that the steady state needs no allocation.
+        */
+        void reserve(std::size_t n)
+        {
+            if (n == 0) return;
+            n = (n + Magazine_N - 1) / Magazine_N * Magazine_N;
+            for (auto chain = state_->new_slab(n, true); chain; ) {
+                auto next = chain->next_chain_.load(std::memory_order_relaxed);
+                state_->depot_.push(chain);
+                chain = next;
+            }
+        }
+
+        allocator_type get_allocator() const
+        {
+            return allocator_type(state_->alloc_);
+        }
+
+        /*
+         * @brief   allocations served by a magazine or the depot as
+         *          free_list_hits, those that needed a new slab as
+         *          slab_allocations; see contention_stats
+        */
+        stats_snapshot stats() const noexcept
+        {
+            return stats_.snapshot();
+        }
+    };
+
+} // end of namespace
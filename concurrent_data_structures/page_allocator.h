@@ -0,0 +1,226 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
+namespace hungbiu
+{
+	/*
+	 * Page sizes to back a large allocation with
+	 * normal:		the system's base pages
+	 * transparent:	base pages the kernel is advised to merge into huge pages
+	 * huge_2m:		reserved 2 MB pages
+	 * huge_1g:		reserved 1 GB pages
+	 * Reserved pages fall back to the next smaller size when the system
+	 * has none left, down to transparent, so the allocation still succeeds.
+	*/
+	enum class page_size { normal, transparent, huge_2m, huge_1g };
+
+	/*
+	 * Placement of the pages over NUMA nodes
+	 * none:		first touch, i.e. the node of the thread faulting them in
+	 * bind:		only node_
+	 * preferred:	node_ while it has free memory
+	 * interleave:	round-robin over every node
+	*/
+	enum class numa_policy { none, bind, preferred, interleave };
+
+	struct memory_placement
+	{
+		page_size	pages_{ page_size::normal };
+		numa_policy	numa_{ numa_policy::none };
+		std::size_t	node_{ 0 };
+		// Fault every page in at allocation, so none is faulted at run time
+		bool		prefault_{ false };
+
+		bool is_default() const noexcept
+		{
+			return pages_ == page_size::normal && numa_ == numa_policy::none && !prefault_;
+		}
+	};
+
+	/*
+	 * Memory mapped straight from the OS following a memory_placement.
+	 * Movable, unmapped on destruction. Best effort: a page size or NUMA
+	 * policy the system can't provide degrades to what it can, see
+	 * page_bytes() for what was actually used; only running out of memory
+	 * throws std::bad_alloc.
+	*/
+	class page_region
+	{
+		void* data_{ nullptr };
+		std::size_t size_{ 0 };
+		std::size_t page_bytes_{ 0 };
+
+		static std::size_t base_page() noexcept
+		{
+#if defined(_WIN32)
+			SYSTEM_INFO si;
+			GetSystemInfo(&si);
+			return si.dwPageSize;
+#elif defined(__linux__)
+			return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#else
+			return 4096;
+#endif
+		}
+		static std::size_t round_up(std::size_t n, std::size_t page) noexcept
+		{
+			return (n + page - 1) / page * page;
+		}
+
+#if defined(__linux__)
+		// Reserved huge pages of 2^log2_bytes, nullptr if there are none
+		static void* map_hugetlb(std::size_t bytes, unsigned log2_bytes) noexcept
+		{
+			const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+				static_cast<int>(log2_bytes << MAP_HUGE_SHIFT);
+			auto p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+			return p == MAP_FAILED ? nullptr : p;
+		}
+		// Without libnuma: mbind(2) through syscall(); a failure keeps first touch
+		static void bind(void* p, std::size_t bytes, const memory_placement& placement) noexcept
+		{
+			if (placement.numa_ == numa_policy::none) return;
+			constexpr std::size_t Bits = sizeof(unsigned long) * 8;
+			unsigned long mask[16] = {};
+			const auto max_node = sizeof(mask) * 8;
+			int mode = MPOL_INTERLEAVE;
+			if (placement.numa_ == numa_policy::interleave) {
+				// The kernel keeps the nodes that are online and allowed
+				mask[0] = ~0ul;
+			}
+			else {
+				if (placement.node_ >= max_node) return;
+				mask[placement.node_ / Bits] = 1ul << (placement.node_ % Bits);
+				mode = placement.numa_ == numa_policy::bind ? MPOL_BIND : MPOL_PREFERRED;
+			}
+			syscall(SYS_mbind, p, bytes, mode, mask, max_node, 0);
+		}
+#endif
+		void map(std::size_t bytes, const memory_placement& placement)
+		{
+			page_bytes_ = base_page();
+#if defined(_WIN32)
+			DWORD node = NUMA_NO_PREFERRED_NODE;
+			if (placement.numa_ == numa_policy::bind || placement.numa_ == numa_policy::preferred) {
+				node = static_cast<DWORD>(placement.node_);
+			}
+			if (placement.pages_ == page_size::huge_2m || placement.pages_ == page_size::huge_1g) {
+				// Needs SeLockMemoryPrivilege; 1 GB pages aren't exposed separately
+				const auto large = GetLargePageMinimum();
+				if (large) {
+					size_ = round_up(bytes, large);
+					data_ = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size_,
+											   MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+											   PAGE_READWRITE, node);
+					if (data_) {
+						page_bytes_ = large;
+						return;
+					}
+				}
+			}
+			size_ = round_up(bytes, page_bytes_);
+			data_ = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size_,
+									   MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+			if (!data_) throw std::bad_alloc{};
+#elif defined(__linux__)
+			if (placement.pages_ == page_size::huge_1g) {
+				size_ = round_up(bytes, std::size_t{ 1 } << 30);
+				data_ = map_hugetlb(size_, 30);
+				if (data_) page_bytes_ = std::size_t{ 1 } << 30;
+			}
+			if (!data_ && (placement.pages_ == page_size::huge_1g ||
+						   placement.pages_ == page_size::huge_2m)) {
+				size_ = round_up(bytes, std::size_t{ 1 } << 21);
+				data_ = map_hugetlb(size_, 21);
+				if (data_) page_bytes_ = std::size_t{ 1 } << 21;
+			}
+			if (!data_) {
+				const auto transparent = placement.pages_ != page_size::normal;
+				size_ = round_up(bytes, transparent ? std::size_t{ 1 } << 21 : page_bytes_);
+				auto p = mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+							  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (p == MAP_FAILED) throw std::bad_alloc{};
+				data_ = p;
+				if (transparent) madvise(data_, size_, MADV_HUGEPAGE);
+			}
+			// Before anything faults the pages in
+			bind(data_, size_, placement);
+#else
+			(void)placement;
+			size_ = round_up(bytes, page_bytes_);
+			data_ = std::malloc(size_);
+			if (!data_) throw std::bad_alloc{};
+#endif
+		}
+		void unmap() noexcept
+		{
+			if (!data_) return;
+#if defined(_WIN32)
+			VirtualFree(data_, 0, MEM_RELEASE);
+#elif defined(__linux__)
+			munmap(data_, size_);
+#else
+			std::free(data_);
+#endif
+			data_ = nullptr;
+		}
+	public:
+		page_region() = default;
+		/*
+		 * @param	bytes		at least this many bytes, rounded up to whole pages
+		 * @exception	std::bad_alloc
+		*/
+		page_region(std::size_t bytes, const memory_placement& placement)
+		{
+			map(bytes, placement);
+			if (placement.prefault_) {
+				// Writing touches every page; the memory starts zeroed anyway
+				auto p = static_cast<volatile unsigned char*>(data_);
+				for (std::size_t i = 0; i < size_; i += base_page()) {
+					p[i] = 0;
+				}
+			}
+		}
+		page_region(page_region&& other) noexcept :
+			data_(std::exchange(other.data_, nullptr)),
+			size_(std::exchange(other.size_, 0)),
+			page_bytes_(std::exchange(other.page_bytes_, 0))
+		{}
+		page_region& operator=(page_region&& other) noexcept
+		{
+			if (this != &other) {
+				unmap();
+				data_ = std::exchange(other.data_, nullptr);
+				size_ = std::exchange(other.size_, 0);
+				page_bytes_ = std::exchange(other.page_bytes_, 0);
+			}
+			return *this;
+		}
+		page_region(const page_region&) = delete;
+		page_region& operator=(const page_region&) = delete;
+		~page_region()
+		{
+			unmap();
+		}
+
+		void* data() const noexcept { return data_; }
+		std::size_t size() const noexcept { return size_; }
+		// Size of the pages actually backing the region
+		std::size_t page_bytes() const noexcept { return page_bytes_; }
+	};
+}
@@ -0,0 +1,354 @@
+#pragma once
+#include <cstddef>  // size_t
+#include <cstdint>
+#include <optional> // optional<T>
+#include <atomic>
+#include <memory>   // unique_ptr
+#include <vector>
+#include <algorithm> // push_heap(), pop_heap()
+#include <functional> // less<T>
+#include <utility>  // move()
+#include <mutex>    // unique_lock
+#include <condition_variable>
+#include <chrono>   // time_point, duration
+#include <thread>   // hardware_concurrency()
+#include <type_traits>
+#include "spinlock.h" // spinlock
+#include "contention_stats.h" // contention_stats
+#include "queue_closed.h" // queue_closed
+#include "cache_line.h" // padded, False_Sharing_Size
+
+namespace hungbiu {
+
+    /*
+     * Unbounded MPMC priority queue: a relaxed MultiQueue (Rihani, Sanders
+     * and Dementiev) of several binary heaps, each guarded by its own Lock.
+     *
+     * A push goes to a random heap whose lock is free. A pop locks two
+     * random heaps and takes the better of their tops, so there is no
+     * global lock for threads to serialize on. The price is that ordering
+     * is relaxed: pop() returns one of the best elements rather than the
+     * best one, within a rank of about the number of heaps in expectation.
+     * With a single heap the order is exact.
+     *
+     * Like std::priority_queue, the top is the greatest element by
+     * Compare; use std::greater for earliest-deadline-first.
+     * Blocking consumers wait on a condition variable as in
+     * linked_blocking_queue; producers skip notifying when nobody waits.
+    */
+    template <typename T, typename Compare = std::less<T>, typename Lock = spinlock>
+    class priority_blocking_queue
+    {
+    public:
+        using value_type = T;
+        using size_type = std::size_t;
+        using value_compare = Compare;
+
+    private:
+        using lock_t = Lock;
+
+        // Tries at random heaps before giving up on try-locking
+        static constexpr int Attempts_N = 4;
+
+        struct alignas(False_Sharing_Size) heap
+        {
+            mutable lock_t  lock_;
+            std::vector<T>  values_;
+        };
+
+        std::unique_ptr<heap[]> heaps_;
+        size_type heaps_n_;
+        Compare comp_;
+        // Elements in the heaps, changed while holding the heap's lock
+        alignas(False_Sharing_Size) std::atomic<size_type> size_{ 0 };
+        std::mutex mtx_;
+        std::condition_variable cv_;
+        // Consumers blocked on cv_, lets producers skip notify_one()
+        std::atomic<size_type> waiters_{ 0 };
+        std::atomic<bool> closed_{ false };
+        contention_stats stats_;
+
+        // xorshift64*, one state per thread
+        static std::uint64_t random() noexcept
+        {
+            static std::atomic<std::uint64_t> seed{ 0x9e3779b97f4a7c15ull };
+            thread_local std::uint64_t x =
+                seed.fetch_add(0x9e3779b97f4a7c15ull, std::memory_order_relaxed) | 1;
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            return x * 0x2545f4914f6cdd1dull;
+        }
+        heap& random_heap() noexcept
+        {
+            return heaps_[random() % heaps_n_];
+        }
+
+        /*
+         * @brief   lock a random heap, trying others while they're taken
+         * @return  the lock held on the heap
+        */
+        std::unique_lock<lock_t> lock_random(heap*& h)
+        {
+            for (int i = 0; i < Attempts_N; ++i) {
+                h = &random_heap();
+                std::unique_lock lk{ h->lock_, std::try_to_lock };
+                if (lk) return lk;
+                stats_.add(stat_counter::cas_failures);
+            }
+            return std::unique_lock{ h->lock_ };
+        }
+
+        /*
+         * @brief   push value into a random heap
+         * @exception   growing the heap or copying the value may throw,
+         *              throw queue_closed if the queue has been closed
+         *
+         * size_ is raised holding the heap's lock, so close() sweeping
+         * every lock leaves no push uncounted behind it.
+        */
+        template<typename U,
+                 typename = std::enable_if_t<std::is_constructible_v<T, U&&>>>
+        void insert(U&& value)
+        {
+            {
+                heap* h = nullptr;
+                auto lk = lock_random(h);
+                if (closed_.load(std::memory_order_relaxed)) throw queue_closed{};
+                h->values_.emplace_back(std::forward<U>(value));
+                std::push_heap(h->values_.begin(), h->values_.end(), comp_);
+                size_.fetch_add(1, std::memory_order_release);
+            }
+            stats_.add(stat_counter::pushes);
+            notify();
+        }
+
+        // Wake one waiting consumer, if there is any; pairs with wait()
+        void notify()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters_.load(std::memory_order_relaxed) == 0) return;
+            {
+                std::lock_guard lk{ mtx_ };
+            }
+            cv_.notify_one();
+        }
+
+        /*
+         * @brief   take the top of h, whose lock the caller holds
+        */
+        T take(heap& h)
+        {
+            std::pop_heap(h.values_.begin(), h.values_.end(), comp_);
+            T ret = std::move(h.values_.back());
+            h.values_.pop_back();
+            size_.fetch_sub(1, std::memory_order_relaxed);
+            stats_.add(stat_counter::pops);
+            return ret;
+        }
+
+        /*
+         * @brief   pop the better top of two random heaps, then fall back
+         *          to sweeping every heap
+         * @return  an empty optional iff every heap was seen empty
+        */
+        std::optional<T> try_take()
+        {
+            std::optional<T> ret{};
+            for (int i = 0; i < Attempts_N && size_.load(std::memory_order_acquire); ++i) {
+                auto& a = random_heap();
+                auto& b = random_heap();
+                std::unique_lock lk_a{ a.lock_, std::try_to_lock };
+                if (!lk_a) {
+                    stats_.add(stat_counter::cas_failures);
+                    continue;
+                }
+                heap* best = a.values_.empty() ? nullptr : &a;
+                std::unique_lock<lock_t> lk_b{};
+                if (&b != &a) {
+                    lk_b = std::unique_lock{ b.lock_, std::try_to_lock };
+                    if (lk_b && !b.values_.empty() &&
+                        (!best || comp_(a.values_.front(), b.values_.front()))) {
+                        best = &b;
+                    }
+                }
+                if (best) {
+                    ret.emplace(take(*best));
+                    return ret;
+                }
+            }
+            // Everything seen empty or taken, until proven otherwise
+            const auto start = random() % heaps_n_;
+            for (size_type i = 0; i < heaps_n_ && size_.load(std::memory_order_acquire); ++i) {
+                auto& h = heaps_[(start + i) % heaps_n_];
+                std::lock_guard lk{ h.lock_ };
+                if (!h.values_.empty()) {
+                    ret.emplace(take(h));
+                    return ret;
+                }
+            }
+            return ret;
+        }
+
+        /*
+         * @brief   wait on cv_ until the queue is non-empty, closed, or
+         *          wait_fn returns false
+         * @param   wait_fn     calls cv_.wait() or a timed variant with pred
+        */
+        template<typename WaitFn>
+        void wait(WaitFn wait_fn)
+        {
+            auto ready = [&]() { return !empty() || is_closed(); };
+            if (ready()) return;
+            std::unique_lock lk{ mtx_ };
+            stats_.add(stat_counter::parks);
+            waiters_.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wait_fn(lk, ready);
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+    public:
+        /*
+         * @param   heaps_n     number of heaps, at least 1; by default two per
+         *                      hardware thread, as the MultiQueue paper suggests
+         * @param   comp        ordering of the elements
+        */
+        explicit priority_blocking_queue(size_type heaps_n = 2 * std::thread::hardware_concurrency(),
+                                         const Compare& comp = Compare()) :
+            heaps_n_(std::max<size_type>(heaps_n, 1)),
+            comp_(comp)
+        {
+            heaps_ = std::make_unique<heap[]>(heaps_n_);
+        }
+
+        priority_blocking_queue(const priority_blocking_queue&) = delete;
+        priority_blocking_queue& operator=(const priority_blocking_queue&) = delete;
+
+        // Capacity
+        /*
+         * @brief   check if the queue is empty; only a hint while other
+         *          threads push or pop
+        */
+        bool empty() const noexcept
+        {
+            return size_.load(std::memory_order_acquire) == 0;
+        }
+        size_type size() const noexcept
+        {
+            return size_.load(std::memory_order_acquire);
+        }
+        size_type heaps() const noexcept
+        {
+            return heaps_n_;
+        }
+
+        /*
+         * @brief   contention counters, all zero unless HUNGBIU_ENABLE_STATS
+         *          is defined; see contention_stats
+         * @return  waits on the heap locks, heaps found locked as
+         *          cas_failures, pushes, pops, parks and size() as depth
+        */
+        stats_snapshot stats() const noexcept
+        {
+            auto snap = stats_.snapshot();
+            for (size_type i = 0; i < heaps_n_; ++i) {
+                snap += stats_of(heaps_[i].lock_);
+            }
+            snap.depth_ = size();
+            return snap;
+        }
+
+        // Modifiers
+        /*
+         * @brief   reject further pushes and wake every waiting consumer
+         *
+         * Elements pushed before close() can still be popped; once they're
+         * drained pop() throws queue_closed and try_pop()/pop_for() return
+         * an empty optional. Calling close() more than once has no effect.
+        */
+        void close()
+        {
+            closed_.store(true, std::memory_order_release);
+            // A push that saw the flag clear is counted in size_ once
+            // its heap's lock is free
+            for (size_type i = 0; i < heaps_n_; ++i) {
+                std::lock_guard lk{ heaps_[i].lock_ };
+            }
+            {
+                std::lock_guard lk{ mtx_ };
+            }
+            cv_.notify_all();
+        }
+        bool is_closed() const noexcept
+        {
+            return closed_.load(std::memory_order_acquire);
+        }
+
+        /*
+         * @brief   push new data into the queue
+         * @exception   growing a heap and copying the value may throw
+         *              std::bad_alloc, throw queue_closed if the queue
+         *              has been closed
+        */
+        void push(const T& value)
+        {
+            insert(value);
+        }
+        void push(T&& value)
+        {
+            insert(std::forward<T>(value));
+        }
+
+        /*
+         * @brief   non-blocking pop of one of the greatest elements
+         * @return  the element, or an empty optional if the queue is empty
+         * @exception   copy constructor or move constructor of T may throw
+        */
+        [[nodiscard]] std::optional<T> try_pop()
+        {
+            return try_take();
+        }
+        /*
+         * @brief   blocking pop of one of the greatest elements
+         * @exception   copy constructor or move constructor of T may throw,
+         *              throw queue_closed if the queue is closed and drained
+        */
+        [[nodiscard]] T pop()
+        {
+            for (;;) {
+                if (auto ret = try_take()) return std::move(*ret);
+                wait([&](auto& lk, auto ready) { cv_.wait(lk, ready); });
+                if (empty() && is_closed()) throw queue_closed{};
+            }
+        }
+        /*
+         * @brief   blocking pop with a deadline
+         * @return  the element, or an empty optional if the queue stayed
+         *          empty until deadline or is closed and drained
+         * @exception   copy constructor or move constructor of T may throw
+        */
+        template<typename Clock, typename Duration>
+        [[nodiscard]] std::optional<T> pop_until(const std::chrono::time_point<Clock, Duration>& deadline)
+        {
+            for (;;) {
+                auto ret = try_take();
+                if (ret || Clock::now() >= deadline) return ret;
+                wait([&](auto& lk, auto ready) { cv_.wait_until(lk, deadline, ready); });
+                if (empty() && is_closed()) return ret;
+            }
+        }
+        /*
+         * @brief   blocking pop with a timeout
+         * @return  the element, or an empty optional on timeout
+         *          or if the queue is closed and drained
+         * @exception   copy constructor or move constructor of T may throw
+        */
+        template<typename Rep, typename Period>
+        [[nodiscard]] std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout)
+        {
+            return pop_until(std::chrono::steady_clock::now() + timeout);
+        }
+    };
+
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdexcept>    // runtime_error
+
+namespace hungbiu {
+
+    /*
+     * Thrown by the blocking operations of a queue that has been closed:
+     * by a push after close(), and by a pop once a closed queue is drained.
+     * Non-blocking and timed operations report it through their return
+     * value instead; is_closed() tells it apart from full/empty/timeout.
+    */
+    class queue_closed : public std::runtime_error
+    {
+    public:
+        queue_closed() :
+            std::runtime_error("queue is closed") {}
+    };
+
+} // end of namespace
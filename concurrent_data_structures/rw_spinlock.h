@@ -0,0 +1,278 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include "contention_stats.h"
+#include "backoff.h"
+#include "spinlock.h" // detail::contended_lock
+#include "cache_line.h"
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#include <cpuid.h>
+#define HUNGBIU_HAS_RTM 1
+// Only the functions issuing RTM instructions are compiled for it
+#define HUNGBIU_RTM_TARGET __attribute__((target("rtm")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define HUNGBIU_HAS_RTM 1
+#define HUNGBIU_RTM_TARGET
+#endif
+
+namespace hungbiu {
+
+    namespace detail {
+        /*
+         * Intel RTM (TSX) through intrinsics, checked once with CPUID.
+         * Most parts have TSX fused off or disabled by microcode, so
+         * supported() is false on them and the elided paths are skipped.
+        */
+        struct rtm {
+            static constexpr unsigned Lock_Busy = 0xff;
+            static constexpr unsigned Started = ~0u;
+
+#if defined(HUNGBIU_HAS_RTM)
+            static bool supported() noexcept {
+                static const bool rtm = []() {
+#if defined(_MSC_VER)
+                    int regs[4];
+                    __cpuid(regs, 0);
+                    if (regs[0] < 7) return false;
+                    __cpuidex(regs, 7, 0);
+                    return (regs[1] & (1 << 11)) != 0;
+#else
+                    unsigned a, b, c, d;
+                    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+                    return (b & (1u << 11)) != 0;
+#endif
+                }();
+                return rtm;
+            }
+            HUNGBIU_RTM_TARGET static unsigned begin() noexcept { return _xbegin(); }
+            HUNGBIU_RTM_TARGET static void end() noexcept { _xend(); }
+            HUNGBIU_RTM_TARGET static void abort_busy() noexcept { _xabort(Lock_Busy); }
+            HUNGBIU_RTM_TARGET static bool in_transaction() noexcept { return _xtest() != 0; }
+            // Whether the abort status says a retry may commit
+            static bool may_retry(unsigned status) noexcept {
+                return (status & _XABORT_RETRY) ||
+                       ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == Lock_Busy);
+            }
+            static bool busy(unsigned status) noexcept {
+                return (status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == Lock_Busy;
+            }
+#else
+            static bool supported() noexcept { return false; }
+            static unsigned begin() noexcept { return 0; }
+            static void end() noexcept {}
+            static void abort_busy() noexcept {}
+            static bool in_transaction() noexcept { return false; }
+            static bool may_retry(unsigned) noexcept { return false; }
+            static bool busy(unsigned) noexcept { return false; }
+#endif
+        };
+    }
+
+    /*
+     * Reader-writer spinlock for read-mostly state, usable with
+     * std::unique_lock and std::shared_lock.
+     *
+     * Readers don't share a counter: each thread counts itself in one of
+     * Slots cache lines, picked once per thread (a thread may migrate
+     * between lock and unlock, so it can't be the current core), and only
+     * reads writer_, which stays in every reader's cache while no writer
+     * comes. A writer raises writer_, then waits for every slot to drain;
+     * readers arriving meanwhile back off until it's done, so writers
+     * aren't starved.
+     *
+     * With Elide, the lock is first elided with an RTM transaction that
+     * only reads the lock, so readers and non-conflicting writers run
+     * concurrently without writing any shared line; after a few aborts,
+     * or without TSX, it's taken for real. Elided locks have to be
+     * released in the reverse order of acquisition.
+    */
+    template<bool Elide = false, std::size_t Slots = 16>
+    class basic_rw_spinlock : private contention_stats {
+        static_assert(Slots > 0);
+        static constexpr int Elide_Tries = 3;
+
+        struct alignas(False_Sharing_Size) slot {
+            std::atomic<std::uint32_t> readers_{ 0 };
+        };
+        alignas(False_Sharing_Size) std::atomic<bool> writer_{ false };
+        std::array<slot, Slots> slots_;
+
+        static std::size_t thread_slot() noexcept {
+            static std::atomic<std::size_t> next{ 0 };
+            thread_local const std::size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+            return idx % Slots;
+        }
+        std::atomic<std::uint32_t>& my_readers() noexcept {
+            return slots_[thread_slot()].readers_;
+        }
+        bool no_readers() const noexcept {
+            for (const auto& s : slots_) {
+                if (s.readers_.load(std::memory_order_seq_cst)) return false;
+            }
+            return true;
+        }
+
+        /*
+         * @brief   start a transaction in which free() held, and stay in it
+         * @return  whether the caller now runs elided
+        */
+        template<typename Free>
+        bool elide(Free free, bool once = false) noexcept {
+            if (!detail::rtm::supported()) return false;
+            for (int i = 0; i < Elide_Tries; ++i) {
+                const auto status = detail::rtm::begin();
+                if (status == detail::rtm::Started) {
+                    // Reading the lock puts it in the read set: taking it
+                    // for real aborts the transaction
+                    if (free()) return true;
+                    detail::rtm::abort_busy();
+                }
+                // Out of the transaction: counters are never written in one
+                add(stat_counter::elision_aborts);
+                if (once || !detail::rtm::may_retry(status)) break;
+                if (detail::rtm::busy(status)) {
+                    backoff b;
+                    while (!free()) b.pause();
+                }
+            }
+            return false;
+        }
+        bool end_elision() noexcept {
+            if (!detail::rtm::supported() || !detail::rtm::in_transaction()) return false;
+            detail::rtm::end();
+            add(stat_counter::elisions);
+            return true;
+        }
+
+        void lock_readers() noexcept {
+            auto& readers = my_readers();
+            readers.fetch_add(1, std::memory_order_seq_cst);
+            // Pairs with the writer raising writer_ then reading the slots
+            if (!writer_.load(std::memory_order_seq_cst)) {
+                return;
+            }
+            detail::contended_lock(static_cast<contention_stats&>(*this), [&]() {
+                std::uint64_t spins = 0;
+                for (;;) {
+                    readers.fetch_sub(1, std::memory_order_relaxed);
+                    backoff b;
+                    while (writer_.load(std::memory_order_relaxed)) {
+                        spins += b.pause();
+                    }
+                    readers.fetch_add(1, std::memory_order_seq_cst);
+                    if (!writer_.load(std::memory_order_seq_cst)) {
+                        return spins;
+                    }
+                }
+            });
+        }
+        void lock_writer() noexcept {
+            const bool owned = !writer_.exchange(true, std::memory_order_seq_cst);
+            if (owned && no_readers()) {
+                return;
+            }
+            detail::contended_lock(static_cast<contention_stats&>(*this), [&]() {
+                std::uint64_t spins = 0;
+                backoff b;
+                // Another writer holds it
+                while (!owned && (writer_.load(std::memory_order_relaxed) ||
+                                  writer_.exchange(true, std::memory_order_seq_cst))) {
+                    spins += b.pause();
+                }
+                // Then wait for the readers that were already in
+                b.reset();
+                while (!no_readers()) {
+                    spins += b.pause();
+                }
+                return spins;
+            });
+        }
+
+    public:
+        basic_rw_spinlock() = default;
+        basic_rw_spinlock(const basic_rw_spinlock&) = delete;
+        basic_rw_spinlock& operator=(const basic_rw_spinlock&) = delete;
+
+        // Exclusive ownership, for writers
+        void lock() noexcept {
+            if constexpr (Elide) {
+                if (elide([this]() {
+                    return !writer_.load(std::memory_order_relaxed) && no_readers();
+                })) return;
+            }
+            lock_writer();
+        }
+
+        bool try_lock() noexcept {
+            if constexpr (Elide) {
+                if (elide([this]() {
+                    return !writer_.load(std::memory_order_relaxed) && no_readers();
+                }, true)) return true;
+            }
+            if (writer_.load(std::memory_order_relaxed) ||
+                writer_.exchange(true, std::memory_order_seq_cst)) {
+                return false;
+            }
+            if (!no_readers()) {
+                writer_.store(false, std::memory_order_release);
+                return false;
+            }
+            return true;
+        }
+
+        void unlock() noexcept {
+            if constexpr (Elide) {
+                // Held for real, writer_ would be raised
+                if (!writer_.load(std::memory_order_relaxed) && end_elision()) return;
+            }
+            writer_.store(false, std::memory_order_release);
+        }
+
+        // Shared ownership, for readers
+        void lock_shared() noexcept {
+            if constexpr (Elide) {
+                if (elide([this]() { return !writer_.load(std::memory_order_relaxed); })) return;
+            }
+            lock_readers();
+        }
+
+        bool try_lock_shared() noexcept {
+            if constexpr (Elide) {
+                if (elide([this]() { return !writer_.load(std::memory_order_relaxed); }, true)) {
+                    return true;
+                }
+            }
+            auto& readers = my_readers();
+            readers.fetch_add(1, std::memory_order_seq_cst);
+            if (!writer_.load(std::memory_order_seq_cst)) {
+                return true;
+            }
+            readers.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        void unlock_shared() noexcept {
+            if constexpr (Elide) {
+                if (end_elision()) return;
+            }
+            my_readers().fetch_sub(1, std::memory_order_release);
+        }
+
+        /*
+         * Waits and spins of readers and writers that found the lock taken,
+         * plus with Elide the sections run as transactions and their aborts
+        */
+        stats_snapshot stats() const noexcept {
+            return snapshot();
+        }
+    };
+
+    using rw_spinlock = basic_rw_spinlock<false>;
+    using elided_rw_spinlock = basic_rw_spinlock<true>;
+}
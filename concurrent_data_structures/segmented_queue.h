@@ -0,0 +1,384 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <utility>
+#include "wait_policy.h"
+#include "hazard_pointer.h"
+#include "contention_stats.h"
+#include "cache_line.h"
+
+namespace hungbiu
+{
+	/*
+	 * Unbounded MPMC queue made of a linked list of fixed-size ring segments.
+	 *
+	 * Inside a segment it's the turn-ticket protocol of array_blocking_queue
+	 * run for a single lap: producers and consumers draw tickets from the
+	 * segment's enq_/deq_ counters, a slot's turn_ goes from Write_Turn to
+	 * Read_Turn when it's written and to Done_Turn when it's read. A ticket
+	 * past the end of the segment sends the thread to the next segment,
+	 * appending one if there's none yet, so a push never blocks.
+	 *
+	 * A segment is unlinked once both head_ and tail_ have moved past it;
+	 * it's retired through a hazard_domain, since threads that drew tickets
+	 * in it may still be reading it, and recycled through a free list
+	 * instead of going back to the heap.
+	 *
+	 * pop() waits on its ticket following WaitPolicy, like
+	 * array_blocking_queue::pop(). If constructing an element throws, its
+	 * slot stays unwritten and the consumer holding that ticket waits forever.
+	*/
+	template<typename T,
+			 typename WaitPolicy = spin_park_wait<>,
+			 std::size_t SegmentSize = 256>
+	class segmented_queue
+	{
+		static_assert(SegmentSize > 0, "SegmentSize must be positive");
+
+		static constexpr std::size_t Write_Turn = 0;
+		static constexpr std::size_t Read_Turn = 1;
+		static constexpr std::size_t Done_Turn = 2;
+		// Set in a slot's turn_ by a consumer about to park on it; see mark_parked()
+		static constexpr std::size_t Parked_Bit = std::size_t{ 1 } << (sizeof(std::size_t) * 8 - 1);
+
+		using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
+		// One line per slot, like array_blocking_queue's padded_layout;
+		// False_Sharing_Size would double a segment on x86
+		struct slot_t
+		{
+			alignas(Cache_Line_Size)
+			std::atomic<std::size_t> turn_{ Write_Turn };
+			storage_t val_;
+
+			T* get_val() noexcept
+			{
+				return std::launder(reinterpret_cast<T*>(&val_));
+			}
+			// Current turn, without Parked_Bit
+			std::size_t turn() const noexcept
+			{
+				return turn_.load(std::memory_order_acquire) & ~Parked_Bit;
+			}
+		};
+
+		struct segment
+		{
+			alignas(False_Sharing_Size)
+			std::atomic<std::size_t>	enq_{ 0 };
+			alignas(False_Sharing_Size)
+			std::atomic<std::size_t>	deq_{ 0 };
+			alignas(False_Sharing_Size)
+			std::atomic<segment*>		next_{ nullptr };
+			// Number of head_/tail_ that moved past this segment
+			std::atomic<unsigned>		passed_{ 0 };
+			slot_t						slots_[SegmentSize];
+
+			// Back to the state of a fresh segment; no thread may use it
+			void reset() noexcept
+			{
+				enq_.store(0, std::memory_order_relaxed);
+				deq_.store(0, std::memory_order_relaxed);
+				next_.store(nullptr, std::memory_order_relaxed);
+				passed_.store(0, std::memory_order_relaxed);
+				for (auto& s : slots_) {
+					s.turn_.store(Write_Turn, std::memory_order_relaxed);
+				}
+			}
+		};
+		using domain_t = hazard_domain<segment, 2>;
+		using guard_t = typename domain_t::guard;
+
+		padded<std::atomic<segment*>> head_;
+		padded<std::atomic<segment*>> tail_;
+		padded<std::atomic<segment*>> free_list_{ nullptr };
+		domain_t domain_;
+		struct no_parking_lot {};
+		std::conditional_t<WaitPolicy::parks, parking_lot, no_parking_lot> lot_;
+		// Empty unless HUNGBIU_ENABLE_STATS is defined
+		contention_stats stats_;
+
+		// Pool
+		void free_segment(segment* p) noexcept
+		{
+			auto top = free_list_->load(std::memory_order_relaxed);
+			do {
+				p->next_.store(top, std::memory_order_relaxed);
+			} while (!free_list_->compare_exchange_weak(top,
+													   p,
+													   std::memory_order_release,
+													   std::memory_order_relaxed));
+		}
+		/*
+		 * Pop a recycled segment or allocate a new one.
+		 * Segments only get back to the free list through the hazard domain,
+		 * so protecting the top rules out ABA, same as lock_free_linked_queue.
+		*/
+		segment* alloc_segment(guard_t& g)
+		{
+			for (;;) {
+				auto p = g.protect(1, *free_list_);
+				if (!p) break;
+				auto next = p->next_.load(std::memory_order_acquire);
+				if (free_list_->compare_exchange_strong(p,
+													   next,
+													   std::memory_order_acq_rel)) {
+					g.clear(1);
+					p->reset();
+					stats_.add(stat_counter::free_list_hits);
+					return p;
+				}
+			}
+			g.clear(1);
+			stats_.add(stat_counter::slab_allocations);
+			return new segment;
+		}
+
+		/*
+		 * @brief	the segment after seg, appending a new one if there's none
+		 *
+		 * Only the pointer value is returned; it's only used as the desired
+		 * value of a CAS on head_ or tail_, which keeps it reachable.
+		*/
+		segment* ensure_next(segment* seg, guard_t& g)
+		{
+			auto next = seg->next_.load(std::memory_order_acquire);
+			if (next) return next;
+			auto fresh = alloc_segment(g);
+			if (seg->next_.compare_exchange_strong(next,
+												   fresh,
+												   std::memory_order_acq_rel)) {
+				return fresh;
+			}
+			// Someone else appended first. fresh may have come off the free
+			// list, where another thread can still hold it in a hazard slot,
+			// so it goes back through the domain rather than straight to the list
+			g.retire(fresh, [this](segment* p) { free_segment(p); });
+			return next;
+		}
+
+		/*
+		 * @brief	move end from seg to next
+		 *
+		 * The thread whose CAS succeeds accounts for end having passed seg;
+		 * the second of head_ and tail_ to pass it retires the segment.
+		*/
+		void advance(std::atomic<segment*>& end, segment* seg, segment* next, guard_t& g)
+		{
+			if (!end.compare_exchange_strong(seg, next, std::memory_order_acq_rel)) return;
+			if (seg->passed_.fetch_add(1, std::memory_order_acq_rel) == 1) {
+				g.retire(seg, [this](segment* p) { free_segment(p); });
+			}
+		}
+
+		/*
+		 * Parking is paid for by the consumers, as in array_blocking_queue:
+		 * one about to sleep on a slot flags it with an RMW on its turn_,
+		 * from inside park() after it has registered in its cell, and the
+		 * producer publishes with an exchange, unparking only if it finds
+		 * the flag. An uncontended push leaves the parking lot alone.
+		*/
+		void mark_parked(slot_t& slot) noexcept
+		{
+			slot.turn_.fetch_or(Parked_Bit, std::memory_order_acq_rel);
+		}
+		void publish(slot_t& slot, std::size_t key)
+		{
+			if constexpr (WaitPolicy::parks) {
+				if (slot.turn_.exchange(Read_Turn, std::memory_order_acq_rel) & Parked_Bit) {
+					lot_.unpark(key);
+				}
+			}
+			else {
+				slot.turn_.store(Read_Turn, std::memory_order_release);
+			}
+		}
+
+		template<typename Pred>
+		void wait(slot_t& slot, std::size_t key, Pred ready)
+		{
+			if (ready()) return;
+			std::size_t spins = 0, yields = 0;
+			auto finish = [&](bool parked) {
+				stats_.add(stat_counter::wait_spins, spins);
+				stats_.add(stat_counter::wait_yields, yields);
+				if (parked) stats_.add(stat_counter::parks);
+			};
+			while (spins < WaitPolicy::spin_limit) {
+				cpu_relax();
+				++spins;
+				if (ready()) return finish(false);
+			}
+			while (yields < WaitPolicy::yield_limit) {
+				std::this_thread::yield();
+				++yields;
+				if (ready()) return finish(false);
+			}
+			if constexpr (WaitPolicy::parks) {
+				lot_.park(key, [&]() { mark_parked(slot); return ready(); });
+				finish(true);
+			}
+			else {
+				while (!ready()) {
+					std::this_thread::yield();
+					++yields;
+				}
+				finish(false);
+			}
+		}
+
+		static void read(slot_t& slot, T& val)
+		{
+			val = std::move(*slot.get_val());
+			slot.get_val()->~T();
+			slot.turn_.store(Done_Turn, std::memory_order_release);
+		}
+	public:
+		using value_type = T;
+		using size_type = std::size_t;
+
+		segmented_queue()
+		{
+			auto p = new segment;
+			head_->store(p, std::memory_order_relaxed);
+			tail_->store(p, std::memory_order_relaxed);
+		}
+		segmented_queue(const segmented_queue&) = delete;
+		segmented_queue& operator=(const segmented_queue&) = delete;
+
+		/*
+		 * Contention counters, all zero unless HUNGBIU_ENABLE_STATS is
+		 * defined, see contention_stats: lost CASes of try_pop(), waits of
+		 * pop(), recycled segments as free_list_hits and new ones as
+		 * slab_allocations. Depth isn't tracked.
+		*/
+		stats_snapshot stats() const noexcept
+		{
+			return stats_.snapshot();
+		}
+
+		/*
+		 * Destroy the remaining elements and free every segment.
+		 * Either end may be the older one: consumers run ahead of
+		 * producers when they wait on empty segments.
+		*/
+		~segmented_queue()
+		{
+			domain_.drain([this](segment* p) { free_segment(p); });
+
+			// head_ comes first unless tail_ can't be reached from it
+			const auto head = head_->load(std::memory_order_relaxed);
+			const auto tail = tail_->load(std::memory_order_relaxed);
+			auto first = tail;
+			for (auto p = head; p; p = p->next_.load(std::memory_order_relaxed)) {
+				if (p == tail) {
+					first = head;
+					break;
+				}
+			}
+			for (auto p = first; p; ) {
+				for (auto& s : p->slots_) {
+					if (s.turn() == Read_Turn) {
+						s.get_val()->~T();
+					}
+				}
+				auto next = p->next_.load(std::memory_order_relaxed);
+				delete p;
+				p = next;
+			}
+			for (auto p = free_list_->load(std::memory_order_relaxed); p; ) {
+				auto next = p->next_.load(std::memory_order_relaxed);
+				delete p;
+				p = next;
+			}
+		}
+
+		// Modifiers
+		/*
+		 * emplace/push:
+		 * Draw a ticket in the tail segment and construct the element in
+		 * its slot. Never blocks, a full segment is followed by a new one.
+		 * May throw std::bad_alloc when a segment has to be allocated.
+		**/
+		template<typename ...Args,
+			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
+		void emplace(Args&&... args)
+		{
+			guard_t g{ domain_ };
+			for (;;) {
+				auto seg = g.protect(0, *tail_);
+				const auto idx = seg->enq_.fetch_add(1, std::memory_order_acq_rel);
+				if (idx < SegmentSize) {
+					auto& slot = seg->slots_[idx];
+					new (&slot.val_) T(std::forward<Args>(args)...);
+					publish(slot, idx);
+					return;
+				}
+				advance(*tail_, seg, ensure_next(seg, g), g);
+			}
+		}
+		void push(const T& val)
+		{
+			emplace(val);
+		}
+		void push(T&& val)
+		{
+			emplace(std::move(val));
+		}
+
+		/*
+		 * try_pop:
+		 * Claim the slot at the head only if it's been written, like
+		 * array_blocking_queue::try_pop(). Return false if it's empty.
+		**/
+		bool try_pop(T& val)
+		{
+			guard_t g{ domain_ };
+			for (;;) {
+				auto seg = g.protect(0, *head_);
+				auto idx = seg->deq_.load(std::memory_order_acquire);
+				if (idx >= SegmentSize) {
+					auto next = seg->next_.load(std::memory_order_acquire);
+					if (!next) return false;
+					advance(*head_, seg, next, g);
+					continue;
+				}
+				auto& slot = seg->slots_[idx];
+				if (slot.turn() != Read_Turn) {
+					// Not written yet, unless another consumer took it meanwhile
+					if (seg->deq_.load(std::memory_order_acquire) == idx) return false;
+					continue;
+				}
+				if (seg->deq_.compare_exchange_strong(idx,
+													  idx + 1,
+													  std::memory_order_acq_rel)) {
+					read(slot, val);
+					return true;
+				}
+				stats_.add(stat_counter::cas_failures);
+			}
+		}
+		/*
+		 * pop:
+		 * Draw a ticket in the head segment and wait for its element
+		 * following WaitPolicy.
+		**/
+		void pop(T& val)
+		{
+			guard_t g{ domain_ };
+			for (;;) {
+				auto seg = g.protect(0, *head_);
+				const auto idx = seg->deq_.fetch_add(1, std::memory_order_acq_rel);
+				if (idx < SegmentSize) {
+					auto& slot = seg->slots_[idx];
+					wait(slot, idx, [&]() { return slot.turn() == Read_Turn; });
+					read(slot, val);
+					return;
+				}
+				advance(*head_, seg, ensure_next(seg, g), g);
+			}
+		}
+	};
+}
@@ -0,0 +1,232 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include "array_blocking_queue.h"
+#include "cache_line.h"
+
+namespace hungbiu
+{
+	/*
+	 * MPMC queue striped over several array_blocking_queue shards, so that
+	 * producers and consumers don't all hammer the same head_ and tail_.
+	 *
+	 * Every thread gets a home shard, assigned round-robin on first use.
+	 * A producer pushes to its home shard and only moves on to the others
+	 * when it's full; a consumer pops from its home shard first and steals
+	 * from the others when it's empty. Order is FIFO per shard only: two
+	 * elements pushed by the same thread may be popped out of order if the
+	 * home shard overflowed in between.
+	 *
+	 * Consumers finding every shard empty park on a queue-wide condition
+	 * variable. Producers only check a waiter count after pushing, so with
+	 * busy consumers a push touches no shared state outside its shard.
+	*/
+	template<typename T,
+			 typename WaitPolicy = spin_park_wait<>,
+			 typename Layout = padded_layout>
+	class sharded_queue
+	{
+		using shard_t = array_blocking_queue<T, WaitPolicy, Layout>;
+
+		std::vector<std::unique_ptr<shard_t>> shards_;
+
+		// Parking for consumers that found every shard empty
+		alignas(False_Sharing_Size)
+		std::atomic<std::size_t>	waiters_{ 0 };
+		std::mutex					mtx_;
+		std::condition_variable		cv_;
+		contention_stats			stats_;
+
+		static std::size_t thread_index() noexcept
+		{
+			static std::atomic<std::size_t> next{ 0 };
+			thread_local const std::size_t idx = next.fetch_add(1, std::memory_order_relaxed);
+			return idx;
+		}
+		std::size_t home() const noexcept
+		{
+			return thread_index() % shards_.size();
+		}
+
+		// Wake a parked consumer, if there is any
+		void notify()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (waiters_.load(std::memory_order_relaxed) == 0) return;
+			{
+				std::lock_guard lk{ mtx_ };
+			}
+			cv_.notify_one();
+		}
+
+		// Try every shard once, starting from the home shard
+		bool try_pop_any(T& val)
+		{
+			const auto n = shards_.size();
+			const auto h = home();
+			for (std::size_t i = 0; i < n; ++i) {
+				if (shards_[(h + i) % n]->try_pop(val)) return true;
+			}
+			return false;
+		}
+		bool drained() const noexcept
+		{
+			return std::all_of(shards_.cbegin(), shards_.cend(),
+				[](const auto& s) { return s->is_drained(); });
+		}
+	public:
+		/*
+		 * @param	shard_capacity	capacity of every shard, see array_blocking_queue
+		 * @param	shards_n		number of shards, at least 1; one per hardware
+		 *							thread by default
+		*/
+		explicit sharded_queue(std::size_t shard_capacity,
+							   std::size_t shards_n = std::thread::hardware_concurrency())
+		{
+			shards_n = std::max<std::size_t>(shards_n, 1);
+			shards_.reserve(shards_n);
+			for (std::size_t i = 0; i < shards_n; ++i) {
+				shards_.push_back(std::make_unique<shard_t>(shard_capacity));
+			}
+		}
+		sharded_queue(const sharded_queue&) = delete;
+		sharded_queue& operator=(const sharded_queue&) = delete;
+
+		std::size_t shards() const noexcept
+		{
+			return shards_.size();
+		}
+
+		// Contention counters and depth summed over the shards, plus the
+		// consumers that parked on the whole queue, see contention_stats
+		stats_snapshot stats() const noexcept
+		{
+			auto snap = stats_.snapshot();
+			for (const auto& s : shards_) {
+				snap += s->stats();
+			}
+			return snap;
+		}
+
+		// Modifiers
+		/*
+		 * try_push:
+		 * Try the home shard, then every other shard once.
+		 * Return false if they're all full or the queue is closed.
+		**/
+		bool try_push(const T& val)
+		{
+			const auto n = shards_.size();
+			const auto h = home();
+			for (std::size_t i = 0; i < n; ++i) {
+				if (shards_[(h + i) % n]->try_push(val)) {
+					notify();
+					return true;
+				}
+			}
+			return false;
+		}
+		bool try_push(T&& val)
+		{
+			const auto n = shards_.size();
+			const auto h = home();
+			for (std::size_t i = 0; i < n; ++i) {
+				// try_push only moves from val when it succeeds
+				if (shards_[(h + i) % n]->try_push(std::move(val))) {
+					notify();
+					return true;
+				}
+			}
+			return false;
+		}
+		/*
+		 * push:
+		 * Like try_push, but if every shard is full, block on the home shard.
+		 * Throw queue_closed if the queue is closed.
+		**/
+		void push(const T& val)
+		{
+			if (try_push(val)) return;
+			shards_[home()]->push(val);
+			notify();
+		}
+		void push(T&& val)
+		{
+			if (try_push(std::move(val))) return;
+			shards_[home()]->push(std::move(val));
+			notify();
+		}
+
+		/*
+		 * try_pop:
+		 * Try the home shard, then steal from every other shard once.
+		**/
+		bool try_pop(T& val)
+		{
+			return try_pop_any(val);
+		}
+		/*
+		 * pop:
+		 * Scan the shards following WaitPolicy's spin and yield phases, then
+		 * sleep until a producer pushes. Doesn't wait on a ticket of any
+		 * shard, so an element is taken wherever it shows up first.
+		 * Throw queue_closed once the queue is closed and drained.
+		**/
+		void pop(T& val)
+		{
+			if (try_pop_any(val)) return;
+			for (std::size_t i = 0; i < WaitPolicy::spin_limit; ++i) {
+				cpu_relax();
+				if (try_pop_any(val)) return;
+				if (drained()) throw queue_closed{};
+			}
+			for (std::size_t i = 0; i < WaitPolicy::yield_limit; ++i) {
+				std::this_thread::yield();
+				if (try_pop_any(val)) return;
+				if (drained()) throw queue_closed{};
+			}
+
+			bool popped = false;
+			{
+				std::unique_lock lk{ mtx_ };
+				stats_.add(stat_counter::parks);
+				waiters_.fetch_add(1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				cv_.wait(lk, [&]() {
+					popped = try_pop_any(val);
+					return popped || drained();
+				});
+				waiters_.fetch_sub(1, std::memory_order_relaxed);
+			}
+			if (!popped) throw queue_closed{};
+		}
+
+		// Closing
+		/*
+		 * close:
+		 * Close every shard, see array_blocking_queue::close().
+		 * Consumers drain the shards, then pop() throws queue_closed
+		 * and try_pop() returns false.
+		**/
+		void close()
+		{
+			for (auto& s : shards_) {
+				s->close();
+			}
+			{
+				std::lock_guard lk{ mtx_ };
+			}
+			cv_.notify_all();
+		}
+		bool is_closed() const noexcept
+		{
+			return shards_.front()->is_closed();
+		}
+	};
+}
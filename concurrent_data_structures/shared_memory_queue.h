@@ -0,0 +1,314 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#include "array_blocking_queue.h"
+
+namespace hungbiu
+{
+	/*
+	 * Thrown when attaching to a region that doesn't hold a queue
+	 * of the expected type, version or capacity.
+	*/
+	class shared_memory_mismatch : public std::runtime_error
+	{
+	public:
+		explicit shared_memory_mismatch(const char* what) :
+			std::runtime_error(what) {}
+	};
+
+	/*
+	 * static_array_blocking_queue placed in a named shared memory region,
+	 * so that separate processes exchange elements through it directly.
+	 *
+	 * The embedded queue holds no pointer: slots are inline and ticket math
+	 * only uses offsets, so every process can map the region at a different
+	 * address. What it does require:
+	 *   T trivially copyable, as it's copied bytewise between address spaces;
+	 *   a WaitPolicy that doesn't park, since parking_lot's mutexes and
+	 *   condition variables are private to a process;
+	 *   address-free atomics, i.e. always lock-free ones.
+	 *
+	 * The region starts with a versioned header that open() validates
+	 * against its own template arguments before using the queue.
+	 * create() owns the name: it's removed when the creating object goes
+	 * away, while processes that attached keep their mapping.
+	*/
+	template<typename T,
+			 std::size_t N,
+			 typename WaitPolicy = spin_yield_wait<>,
+			 typename Layout = padded_layout>
+	class shared_memory_queue
+	{
+		static_assert(std::is_trivially_copyable_v<T>,
+			"shared_memory_queue requires a trivially copyable T");
+		static_assert(!WaitPolicy::parks,
+			"shared_memory_queue only supports wait policies that don't park");
+		static_assert(std::atomic<std::size_t>::is_always_lock_free &&
+					  std::atomic<std::uint32_t>::is_always_lock_free,
+			"shared_memory_queue requires lock-free atomics");
+
+	public:
+		using queue_type = static_array_blocking_queue<T, N, WaitPolicy, Layout>;
+
+	private:
+		static constexpr std::uint64_t Magic = 0x6875'6e67'6269'7571;	// "hungbiuq"
+		static constexpr std::uint32_t Version = 2;
+		static constexpr std::uint32_t Initializing = 1;
+		static constexpr std::uint32_t Ready = 2;
+
+		struct header
+		{
+			std::uint64_t				magic_;
+			std::uint32_t				version_;
+			std::atomic<std::uint32_t>	state_;
+			std::uint64_t				capacity_;
+			std::uint64_t				elem_size_;
+			std::uint64_t				elem_align_;
+			std::uint64_t				queue_size_;
+			std::uint64_t				padded_;
+		};
+		static constexpr std::size_t Queue_Offset =
+			(sizeof(header) + alignof(queue_type) - 1) / alignof(queue_type) * alignof(queue_type);
+		static constexpr std::size_t Region_Size = Queue_Offset + sizeof(queue_type);
+
+		std::string name_;
+		void* base_{ nullptr };
+		bool owner_{ false };
+#if defined(_WIN32)
+		HANDLE mapping_{ nullptr };
+#endif
+
+		header* get_header() const noexcept
+		{
+			return static_cast<header*>(base_);
+		}
+
+		[[noreturn]] static void throw_last_error(const char* what)
+		{
+#if defined(_WIN32)
+			throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), what);
+#else
+			throw std::system_error(errno, std::generic_category(), what);
+#endif
+		}
+
+		// Map the region, creating it with Region_Size bytes if create
+		void map(bool create)
+		{
+#if defined(_WIN32)
+			if (create) {
+				mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+											  static_cast<DWORD>(std::uint64_t{ Region_Size } >> 32),
+											  static_cast<DWORD>(Region_Size),
+											  name_.c_str());
+				if (mapping_ && GetLastError() == ERROR_ALREADY_EXISTS) {
+					CloseHandle(mapping_);
+					mapping_ = nullptr;
+					SetLastError(ERROR_ALREADY_EXISTS);
+				}
+			}
+			else {
+				mapping_ = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name_.c_str());
+			}
+			if (!mapping_) throw_last_error("shared_memory_queue: create/open mapping");
+			base_ = MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, Region_Size);
+			if (!base_) {
+				const auto err = GetLastError();
+				CloseHandle(mapping_);
+				SetLastError(err);
+				throw_last_error("shared_memory_queue: MapViewOfFile");
+			}
+#else
+			const int fd = create ? shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600)
+								  : shm_open(name_.c_str(), O_RDWR, 0);
+			if (fd == -1) throw_last_error("shared_memory_queue: shm_open");
+			auto fail = [&](const char* what) {
+				const auto err = errno;
+				close(fd);
+				if (create) shm_unlink(name_.c_str());
+				errno = err;
+				throw_last_error(what);
+			};
+			if (create) {
+				if (ftruncate(fd, static_cast<off_t>(Region_Size)) == -1) {
+					fail("shared_memory_queue: ftruncate");
+				}
+			}
+			else {
+				struct stat st;
+				if (fstat(fd, &st) == -1) fail("shared_memory_queue: fstat");
+				if (static_cast<std::size_t>(st.st_size) < Region_Size) {
+					close(fd);
+					throw shared_memory_mismatch{ "shared_memory_queue: region is too small" };
+				}
+			}
+			auto p = mmap(nullptr, Region_Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) fail("shared_memory_queue: mmap");
+			close(fd);
+			base_ = p;
+#endif
+		}
+		void unmap() noexcept
+		{
+			if (!base_) return;
+#if defined(_WIN32)
+			UnmapViewOfFile(base_);
+			CloseHandle(mapping_);
+			mapping_ = nullptr;
+#else
+			munmap(base_, Region_Size);
+			if (owner_) shm_unlink(name_.c_str());
+#endif
+			base_ = nullptr;
+		}
+
+		// The creator publishes a zeroed region's header last, with release
+		void initialize()
+		{
+			auto h = get_header();
+			h->state_.store(Initializing, std::memory_order_relaxed);
+			new (queue_ptr()) queue_type();
+			h->magic_ = Magic;
+			h->version_ = Version;
+			h->capacity_ = N;
+			h->elem_size_ = sizeof(T);
+			h->elem_align_ = alignof(T);
+			h->queue_size_ = sizeof(queue_type);
+			h->padded_ = std::is_same_v<Layout, padded_layout>;
+			h->state_.store(Ready, std::memory_order_release);
+		}
+		// Wait a bit for the creator to finish, then check it created the same queue
+		void validate()
+		{
+			auto h = get_header();
+			const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{ 1 };
+			while (h->state_.load(std::memory_order_acquire) != Ready) {
+				if (std::chrono::steady_clock::now() > deadline) {
+					throw shared_memory_mismatch{ "shared_memory_queue: region never initialized" };
+				}
+				std::this_thread::yield();
+			}
+			if (h->magic_ != Magic) {
+				throw shared_memory_mismatch{ "shared_memory_queue: not a queue" };
+			}
+			if (h->version_ != Version) {
+				throw shared_memory_mismatch{ "shared_memory_queue: version mismatch" };
+			}
+			if (h->capacity_ != N || h->elem_size_ != sizeof(T) ||
+				h->elem_align_ != alignof(T) || h->queue_size_ != sizeof(queue_type) ||
+				h->padded_ != std::is_same_v<Layout, padded_layout>) {
+				throw shared_memory_mismatch{ "shared_memory_queue: queue type mismatch" };
+			}
+		}
+		queue_type* queue_ptr() const noexcept
+		{
+			return std::launder(reinterpret_cast<queue_type*>(
+				static_cast<char*>(base_) + Queue_Offset));
+		}
+
+		shared_memory_queue(std::string name, bool create) :
+			name_(std::move(name)),
+			owner_(create)
+		{
+			map(create);
+			try {
+				if (create) initialize();
+				else validate();
+			}
+			catch (...) {
+				unmap();
+				throw;
+			}
+		}
+	public:
+		/*
+		 * @brief	create the named region and construct an empty queue in it
+		 * @param	name	portable names start with '/' and have no other '/'
+		 * @exception	std::system_error if the name exists or mapping fails
+		*/
+		static shared_memory_queue create(std::string name)
+		{
+			return shared_memory_queue{ std::move(name), true };
+		}
+		/*
+		 * @brief	attach to a region made by create(), possibly in another process
+		 * @exception	std::system_error if there is no such region,
+		 *				shared_memory_mismatch if it holds another kind of queue
+		*/
+		static shared_memory_queue open(std::string name)
+		{
+			return shared_memory_queue{ std::move(name), false };
+		}
+		/*
+		 * @brief	remove a name left behind, e.g. by a creator that crashed
+		 * @return	whether there was such a name; always false on Windows,
+		 *			where a region goes away with its last handle
+		*/
+		static bool remove(const std::string& name) noexcept
+		{
+#if defined(_WIN32)
+			(void)name;
+			return false;
+#else
+			return shm_unlink(name.c_str()) == 0;
+#endif
+		}
+
+		shared_memory_queue(shared_memory_queue&& other) noexcept :
+			name_(std::move(other.name_)),
+			base_(std::exchange(other.base_, nullptr)),
+			owner_(std::exchange(other.owner_, false))
+#if defined(_WIN32)
+			, mapping_(std::exchange(other.mapping_, nullptr))
+#endif
+		{}
+		shared_memory_queue& operator=(shared_memory_queue&&) = delete;
+		shared_memory_queue(const shared_memory_queue&) = delete;
+		shared_memory_queue& operator=(const shared_memory_queue&) = delete;
+
+		// Unmap; the creator also removes the name
+		~shared_memory_queue()
+		{
+			unmap();
+		}
+
+		/*
+		 * The queue itself, shared with every attached process.
+		 * Its destructor is never run: elements are trivially copyable
+		 * and the region outlives any single process.
+		*/
+		queue_type& queue() const noexcept
+		{
+			return *queue_ptr();
+		}
+		queue_type* operator->() const noexcept
+		{
+			return queue_ptr();
+		}
+		const std::string& name() const noexcept
+		{
+			return name_;
+		}
+	};
+}
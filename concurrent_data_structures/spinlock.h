@@ -4,32 +4,81 @@
 */
 #pragma once
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <utility>
+#include "contention_stats.h"
+#include "backoff.h"
+#include "cache_line.h"
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
 #ifdef _MSC_VER
-#include <emmintrin.h>
-#endif // _MSC_VER
+#pragma comment(lib, "Synchronization.lib") // WaitOnAddress
+#endif
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace hungbiu {
 
-    struct spinlock {
+    namespace detail {
+        // Spins after which the FIFO locks start yielding between checks
+        inline constexpr std::uint64_t Yield_Spins = 1 << 14;
+
+        /*
+         * @brief   run the contended path of a lock, which returns its spins,
+         *          and count it in stats if they're enabled
+        */
+        template<typename Stats, typename Wait>
+        void contended_lock(Stats& stats, Wait&& wait) noexcept {
+            if constexpr (Stats::enabled) {
+                const auto start = std::chrono::steady_clock::now();
+                const std::uint64_t spins = wait();
+                stats.add(stat_counter::lock_waits);
+                stats.add(stat_counter::wait_spins, spins);
+                stats.add(stat_counter::lock_wait_ns, static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count()));
+            }
+            else {
+                wait();
+            }
+        }
+    }
+
+    /*
+     * Lock types for linked_blocking_queue and anything else taking a
+     * Lockable. All of them spin in user space first:
+     *   spinlock       test-and-test-and-set; cheapest uncontended, unfair
+     *   ticket_lock    FIFO; waiters share one line, backing off by their
+     *                  distance to the head of the line
+     *   mcs_lock       FIFO; every waiter spins on its own cache line
+     *   The FIFO locks suffer most from a preempted waiter or owner, so they
+     *   start yielding after a long spin.
+     *   hybrid_lock    unfair; spins a while, then sleeps in the kernel,
+     *                  so it survives oversubscription and preemption
+    */
+    // Empty unless HUNGBIU_ENABLE_STATS is defined, see contention_stats.h
+    struct spinlock : private contention_stats {
         std::atomic<bool> lock_ = { 0 };
 
         void lock() noexcept {
-            for (;;) {
-                // Optimistically assume the lock is free on the first try
-                if (!lock_.exchange(true, std::memory_order_acquire)) {
-                    return;
-                }
-                // Wait for lock to be released without generating cache misses
-                while (lock_.load(std::memory_order_relaxed)) {
-                    // Issue X86 PAUSE or ARM YIELD instruction to reduce contention between
-                    // hyper-threads
-                    #ifdef _MSC_VER
-                    _mm_pause(); // Only X86 pause
-                    #elif
-                    __builtin_ia32_pause();
-                    #endif                    
-                }
+            // Optimistically assume the lock is free on the first try
+            if (!lock_.exchange(true, std::memory_order_acquire)) {
+                return;
             }
+            detail::contended_lock(static_cast<contention_stats&>(*this),
+                                   [this]() { return lock_contended(); });
         }
 
         bool try_lock() noexcept {
@@ -42,6 +91,268 @@ namespace hungbiu {
         void unlock() noexcept {
             lock_.store(false, std::memory_order_release);
         }
+
+        // Lock waits and spins, the time spent in them as lock_wait_ns
+        stats_snapshot stats() const noexcept {
+            return snapshot();
+        }
+
+    private:
+        // Spin until the lock is taken, return the number of spins
+        std::uint64_t lock_contended() noexcept {
+            std::uint64_t spins = 0;
+            for (;;) {
+                // Wait for lock to be released without generating cache misses
+                // and back off exponentially, re-reading the line ever less often
+                backoff b;
+                while (lock_.load(std::memory_order_relaxed)) {
+                    // X86 PAUSE or ARM YIELD, see backoff.h
+                    spins += b.pause();
+                }
+                if (!lock_.exchange(true, std::memory_order_acquire)) {
+                    return spins;
+                }
+            }
+        }
+    };
+
+    /*
+     * FIFO spinlock: a thread takes a ticket and waits until it's served.
+     * Waiters pause in proportion to the number of tickets ahead of them,
+     * so the line holding serving_ isn't hammered by the whole queue.
+    */
+    struct ticket_lock : private contention_stats {
+        alignas(False_Sharing_Size) std::atomic<std::uint32_t> next_{ 0 };
+        alignas(False_Sharing_Size) std::atomic<std::uint32_t> serving_{ 0 };
+
+        void lock() noexcept {
+            const auto ticket = next_.fetch_add(1, std::memory_order_relaxed);
+            if (serving_.load(std::memory_order_acquire) == ticket) {
+                return;
+            }
+            detail::contended_lock(static_cast<contention_stats&>(*this), [&]() {
+                std::uint64_t spins = 0;
+                for (;;) {
+                    const auto ahead = ticket - serving_.load(std::memory_order_acquire);
+                    if (ahead == 0) return spins;
+                    for (std::uint32_t i = 0; i < ahead * Backoff_N; ++i) {
+                        cpu_relax();
+                    }
+                    spins += ahead * Backoff_N;
+                    // Likely waiting on a preempted thread
+                    if (spins > detail::Yield_Spins) std::this_thread::yield();
+                }
+            });
+        }
+
+        bool try_lock() noexcept {
+            // Acquire pairs with unlock() like the load in lock()
+            auto ticket = serving_.load(std::memory_order_acquire);
+            return next_.load(std::memory_order_relaxed) == ticket &&
+                next_.compare_exchange_strong(ticket, ticket + 1, std::memory_order_acquire);
+        }
+
+        void unlock() noexcept {
+            // Only the owner writes serving_
+            serving_.store(serving_.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_release);
+        }
+
+        stats_snapshot stats() const noexcept {
+            return snapshot();
+        }
+
+    private:
+        // Pauses per waiter ahead, about a short critical section
+        static constexpr std::uint32_t Backoff_N = 32;
+    };
+
+    /*
+     * MCS queue lock: waiters form a linked queue of nodes and each one
+     * spins on a flag in its own node, set by its predecessor on unlock.
+     * Hand-over touches one line other than the lock, whatever the number
+     * of waiters.
+     *
+     * Nodes come from a per-thread free list, so lock() and unlock() keep
+     * the Lockable signatures; holder_ remembers the owner's node for
+     * unlock(). A thread may hold any number of MCS locks at once.
+    */
+    class mcs_lock : private contention_stats {
+        struct alignas(False_Sharing_Size) qnode {
+            std::atomic<qnode*> next_{ nullptr };
+            std::atomic<bool>   locked_{ false };
+            qnode*              free_next_{ nullptr };
+        };
+        struct node_cache {
+            std::vector<std::unique_ptr<qnode>> nodes_;
+            qnode* free_{ nullptr };
+
+            qnode* get() {
+                if (!free_) {
+                    nodes_.push_back(std::make_unique<qnode>());
+                    return nodes_.back().get();
+                }
+                return std::exchange(free_, free_->free_next_);
+            }
+            void put(qnode* n) noexcept {
+                n->free_next_ = free_;
+                free_ = n;
+            }
+        };
+        static node_cache& local_nodes() {
+            thread_local node_cache cache;
+            return cache;
+        }
+
+        alignas(False_Sharing_Size) std::atomic<qnode*> tail_{ nullptr };
+        // Written by the owner only, after acquiring
+        qnode* holder_{ nullptr };
+
+        static qnode* get_node() {
+            auto n = local_nodes().get();
+            n->next_.store(nullptr, std::memory_order_relaxed);
+            n->locked_.store(true, std::memory_order_relaxed);
+            return n;
+        }
+
+    public:
+        mcs_lock() = default;
+        mcs_lock(const mcs_lock&) = delete;
+        mcs_lock& operator=(const mcs_lock&) = delete;
+
+        // May throw std::bad_alloc the first few times a thread nests locks
+        void lock() {
+            auto me = get_node();
+            auto pred = tail_.exchange(me, std::memory_order_acq_rel);
+            if (pred) {
+                pred->next_.store(me, std::memory_order_release);
+                detail::contended_lock(static_cast<contention_stats&>(*this), [&]() {
+                    std::uint64_t spins = 0;
+                    while (me->locked_.load(std::memory_order_acquire)) {
+                        cpu_relax();
+                        // Likely waiting on a preempted thread
+                        if (++spins > detail::Yield_Spins) std::this_thread::yield();
+                    }
+                    return spins;
+                });
+            }
+            holder_ = me;
+        }
+
+        bool try_lock() {
+            auto me = get_node();
+            qnode* expected = nullptr;
+            if (tail_.compare_exchange_strong(expected, me, std::memory_order_acq_rel)) {
+                holder_ = me;
+                return true;
+            }
+            local_nodes().put(me);
+            return false;
+        }
+
+        void unlock() noexcept {
+            auto me = holder_;
+            auto next = me->next_.load(std::memory_order_acquire);
+            if (!next) {
+                auto expected = me;
+                if (tail_.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+                    local_nodes().put(me);
+                    return;
+                }
+                // A successor swapped tail_ but hasn't linked itself yet
+                while (!(next = me->next_.load(std::memory_order_acquire))) {
+                    cpu_relax();
+                }
+            }
+            next->locked_.store(false, std::memory_order_release);
+            local_nodes().put(me);
+        }
+
+        stats_snapshot stats() const noexcept {
+            return snapshot();
+        }
+    };
+
+    /*
+     * Spin-then-sleep lock (Drepper's three-state futex mutex):
+     * state_ is 0 when free, 1 when locked and 2 when there may be
+     * sleepers, so unlock() only enters the kernel when someone sleeps.
+     * Sleeps on a futex on Linux and WaitOnAddress on Windows; elsewhere
+     * it yields instead.
+    */
+    class hybrid_lock : private contention_stats {
+        static constexpr std::uint32_t Free = 0;
+        static constexpr std::uint32_t Locked = 1;
+        static constexpr std::uint32_t Sleepers = 2;
+        static constexpr std::uint64_t Spin_N = 128;
+
+        std::atomic<std::uint32_t> state_{ Free };
+
+        void sleep() noexcept {
+#if defined(_WIN32)
+            auto expected = Sleepers;
+            WaitOnAddress(&state_, &expected, sizeof(expected), INFINITE);
+#elif defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&state_),
+                    FUTEX_WAIT_PRIVATE, Sleepers, nullptr, nullptr, 0);
+#else
+            std::this_thread::yield();
+#endif
+        }
+        void wake_one() noexcept {
+#if defined(_WIN32)
+            WakeByAddressSingle(&state_);
+#elif defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&state_),
+                    FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+        }
+
+    public:
+        hybrid_lock() = default;
+        hybrid_lock(const hybrid_lock&) = delete;
+        hybrid_lock& operator=(const hybrid_lock&) = delete;
+
+        void lock() noexcept {
+            auto c = Free;
+            if (state_.compare_exchange_strong(c, Locked, std::memory_order_acquire)) {
+                return;
+            }
+            detail::contended_lock(static_cast<contention_stats&>(*this), [&]() {
+                std::uint64_t spins = 0;
+                for (; spins < Spin_N; ++spins) {
+                    cpu_relax();
+                    c = Free;
+                    if (state_.load(std::memory_order_relaxed) == Free &&
+                        state_.compare_exchange_strong(c, Locked, std::memory_order_acquire)) {
+                        return spins;
+                    }
+                }
+                // Announce a sleeper; whoever unlocks next will wake one up
+                c = state_.exchange(Sleepers, std::memory_order_acquire);
+                while (c != Free) {
+                    sleep();
+                    c = state_.exchange(Sleepers, std::memory_order_acquire);
+                }
+                return spins;
+            });
+        }
+
+        bool try_lock() noexcept {
+            auto c = Free;
+            return state_.load(std::memory_order_relaxed) == Free &&
+                state_.compare_exchange_strong(c, Locked, std::memory_order_acquire);
+        }
+
+        void unlock() noexcept {
+            if (state_.exchange(Free, std::memory_order_release) == Sleepers) {
+                wake_one();
+            }
+        }
+
+        stats_snapshot stats() const noexcept {
+            return snapshot();
+        }
     };
 
 } // end of namespace
\ No newline at end of file
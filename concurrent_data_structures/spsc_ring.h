@@ -0,0 +1,213 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <cassert>
+#include <thread>
+#include "wait_policy.h"
+#include "cache_line.h"
+
+namespace hungbiu
+{
+	/*
+	 * Bounded single-producer/single-consumer ring buffer.
+	 * Same surface as array_blocking_queue, restricted to one pushing thread
+	 * and one popping thread at a time.
+	 *
+	 * There is no ticket protocol: the producer owns tail_, the consumer owns
+	 * head_ and each publishes with a release store. Each side also keeps a
+	 * private copy of the other side's index and only reloads it when the
+	 * copy says the ring is full/empty, so in steady state the two threads
+	 * don't touch each other's cache line on every operation.
+	 * Slots are packed densely, one element per slot with no per-slot state.
+	 *
+	 * Based on the design described at https://rigtorp.se/ringbuffer/
+	*/
+	template<typename T, typename WaitPolicy = spin_yield_wait<>>
+	class spsc_ring
+	{
+		static_assert(!WaitPolicy::parks,
+			"spsc_ring only supports wait policies that don't park");
+
+		using storage_t = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+		// Extra slots on both ends of the array so the first and last
+		// element don't share a cache line with adjacent heap data
+		static constexpr std::size_t Padding =
+			(False_Sharing_Size - 1) / sizeof(storage_t) + 1;
+
+		// One slot is kept empty to tell a full ring from an empty one
+		const std::size_t capacity_;
+		storage_t* array_;
+
+		// Written by consumer
+		alignas(False_Sharing_Size)
+		std::atomic<std::size_t> head_{ 0 };
+		std::size_t cached_tail_{ 0 };
+		// Written by producer
+		alignas(False_Sharing_Size)
+		std::atomic<std::size_t> tail_{ 0 };
+		std::size_t cached_head_{ 0 };
+
+		storage_t* allocate()
+		{
+			return static_cast<storage_t*>(::operator new(
+				sizeof(storage_t) * (capacity_ + 2 * Padding),
+				std::align_val_t{ alignof(storage_t) }));
+		}
+		void deallocate() noexcept
+		{
+			::operator delete(static_cast<void*>(array_),
+				std::align_val_t{ alignof(storage_t) });
+		}
+		T* get_val(std::size_t idx) noexcept
+		{
+			return std::launder(reinterpret_cast<T*>(&array_[idx + Padding]));
+		}
+		std::size_t next_idx(std::size_t idx) const noexcept
+		{
+			// A compare is cheaper than a modulo and works for any capacity
+			return ++idx == capacity_ ? 0 : idx;
+		}
+		template<typename Pred>
+		static void wait_until(Pred ready)
+		{
+			if (ready()) return;
+			for (std::size_t i = 0; i < WaitPolicy::spin_limit; ++i) {
+				cpu_relax();
+				if (ready()) return;
+			}
+			while (!ready()) {
+				std::this_thread::yield();
+			}
+		}
+	public:
+		// ctor
+		spsc_ring(std::size_t capacity) :
+			capacity_(capacity + 1)
+		{
+			assert(capacity > 0);
+			array_ = allocate();
+		}
+
+		// dtor
+		~spsc_ring()
+		{
+			auto head = head_.load(std::memory_order_relaxed);
+			const auto tail = tail_.load(std::memory_order_relaxed);
+			for (; head != tail; head = next_idx(head)) {
+				get_val(head)->~T();
+			}
+			deallocate();
+		}
+
+		// Delete copy constructor and assignment operator
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+		// Capacity
+		std::size_t capacity() const noexcept
+		{
+			return capacity_ - 1;
+		}
+		/*
+		 * Approximate when both ends are being modified.
+		**/
+		std::size_t size() const noexcept
+		{
+			const auto head = head_.load(std::memory_order_acquire);
+			const auto tail = tail_.load(std::memory_order_acquire);
+			return tail >= head ? tail - head : capacity_ - head + tail;
+		}
+		bool empty() const noexcept
+		{
+			return head_.load(std::memory_order_acquire) ==
+				   tail_.load(std::memory_order_acquire);
+		}
+
+		// Modifiers, producer side
+		template<typename ...Args,
+			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
+		bool try_emplace(Args&&... args)
+			noexcept(std::is_nothrow_constructible<T, Args&&...>::value)
+		{
+			const auto tail = tail_.load(std::memory_order_relaxed);
+			const auto next = next_idx(tail);
+
+			// Ring looks full, refresh our copy of head
+			if (next == cached_head_) {
+				cached_head_ = head_.load(std::memory_order_acquire);
+				if (next == cached_head_) return false;
+			}
+			new (&array_[tail + Padding]) T(std::forward<Args>(args)...);
+			tail_.store(next, std::memory_order_release);
+			return true;
+		}
+		template<typename ...Args,
+			typename = std::enable_if_t<std::is_constructible_v<T, Args&&...>> >
+		void emplace(Args&&... args)
+			noexcept(std::is_nothrow_constructible<T, Args&&...>::value)
+		{
+			const auto tail = tail_.load(std::memory_order_relaxed);
+			const auto next = next_idx(tail);
+
+			// Wait for the consumer to free a slot
+			wait_until([&]() {
+				if (next != cached_head_) return true;
+				cached_head_ = head_.load(std::memory_order_acquire);
+				return next != cached_head_;
+			});
+			new (&array_[tail + Padding]) T(std::forward<Args>(args)...);
+			tail_.store(next, std::memory_order_release);
+		}
+		bool try_push(const T& val)
+		{
+			return try_emplace(val);
+		}
+		bool try_push(T&& val)
+		{
+			return try_emplace(std::forward<T>(val));
+		}
+		void push(const T& val)
+		{
+			emplace(val);
+		}
+		void push(T&& val)
+		{
+			emplace(std::forward<T>(val));
+		}
+
+		// Modifiers, consumer side
+		bool try_pop(T& val)
+		{
+			const auto head = head_.load(std::memory_order_relaxed);
+
+			// Ring looks empty, refresh our copy of tail
+			if (head == cached_tail_) {
+				cached_tail_ = tail_.load(std::memory_order_acquire);
+				if (head == cached_tail_) return false;
+			}
+			auto p = get_val(head);
+			val = std::move(*p);
+			p->~T();
+			head_.store(next_idx(head), std::memory_order_release);
+			return true;
+		}
+		void pop(T& val)
+		{
+			const auto head = head_.load(std::memory_order_relaxed);
+
+			// Wait for the producer to fill a slot
+			wait_until([&]() {
+				if (head != cached_tail_) return true;
+				cached_tail_ = tail_.load(std::memory_order_acquire);
+				return head != cached_tail_;
+			});
+			auto p = get_val(head);
+			val = std::move(*p);
+			p->~T();
+			head_.store(next_idx(head), std::memory_order_release);
+		}
+	}; // end of class
+}
@@ -1,11 +1,428 @@
 #pragma once
 #include <thread>
 #include <cstddef>
+#include <cstdint>
 #include <array>
+#include <vector>
+#include <memory>
 #include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <tuple>
+#include <type_traits>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <optional>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "lock_free_linked_queue.h"
+#include "work_stealing_deque.h"
+#include "cache_line.h"
 
 namespace hungbiu
 {
+	/*
+	 * A logical CPU the process is allowed to run on.
+	 * id_ is the OS processor number; on Windows it is
+	 * processor group * 64 + number within the group.
+	*/
+	struct cpu_info
+	{
+		unsigned id_;
+		unsigned core_;		// physical core, unique across packages
+		unsigned package_;
+		unsigned node_;		// NUMA node
+	};
+
+	/*
+	 * CPUs available to this process, detected once.
+	 * Honours the process affinity mask (and thus cgroup cpusets);
+	 * concurrency() additionally honours a cgroup CPU quota.
+	*/
+	class cpu_topology
+	{
+		std::vector<cpu_info>	cpus_;
+		std::size_t				nodes_n_{ 1 };
+		std::size_t				quota_{ 0 };	// 0 if unlimited
+
+#if defined(__linux__)
+		static std::string read_file(const std::string& path)
+		{
+			std::ifstream in{ path };
+			std::string s;
+			std::getline(in, s);
+			return s;
+		}
+		static long read_long(const std::string& path, long fallback)
+		{
+			const auto s = read_file(path);
+			if (s.empty()) return fallback;
+			try { return std::stol(s); }
+			catch (...) { return fallback; }
+		}
+		// Parse a kernel cpu list such as "0-3,8,10-11"
+		static std::vector<unsigned> parse_list(const std::string& s)
+		{
+			std::vector<unsigned> ret;
+			std::stringstream ss{ s };
+			std::string range;
+			while (std::getline(ss, range, ',')) {
+				if (range.empty()) continue;
+				const auto dash = range.find('-');
+				try {
+					const auto lo = std::stoul(range.substr(0, dash));
+					const auto hi = dash == std::string::npos ? lo : std::stoul(range.substr(dash + 1));
+					for (auto i = lo; i <= hi; ++i) ret.push_back(static_cast<unsigned>(i));
+				}
+				catch (...) {}
+			}
+			return ret;
+		}
+		// CPU quota from cgroup v2 cpu.max, or v1 cfs quota/period
+		static std::size_t cgroup_quota()
+		{
+			double cpus = 0;
+			std::stringstream v2{ read_file("/sys/fs/cgroup/cpu.max") };
+			std::string quota;
+			long period = 0;
+			if (v2 >> quota >> period && quota != "max" && period > 0) {
+				try { cpus = std::stod(quota) / period; }
+				catch (...) {}
+			}
+			else {
+				const auto q = read_long("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", -1);
+				const auto p = read_long("/sys/fs/cgroup/cpu/cpu.cfs_period_us", 0);
+				if (q > 0 && p > 0) cpus = static_cast<double>(q) / p;
+			}
+			return cpus > 0 ? static_cast<std::size_t>(std::ceil(cpus)) : 0;
+		}
+		void detect()
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			if (sched_getaffinity(0, sizeof(set), &set) != 0) return;
+
+			// NUMA node of each cpu
+			std::vector<unsigned> node_of(CPU_SETSIZE, 0);
+			const auto nodes = parse_list(read_file("/sys/devices/system/node/online"));
+			for (auto n : nodes) {
+				const auto path = "/sys/devices/system/node/node" + std::to_string(n) + "/cpulist";
+				for (auto c : parse_list(read_file(path))) {
+					if (c < node_of.size()) node_of[c] = n;
+				}
+			}
+			if (!nodes.empty()) nodes_n_ = *std::max_element(nodes.begin(), nodes.end()) + 1;
+
+			for (unsigned c = 0; c < CPU_SETSIZE; ++c) {
+				if (!CPU_ISSET(c, &set)) continue;
+				const auto topo = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/";
+				const auto package = static_cast<unsigned>(read_long(topo + "physical_package_id", 0));
+				const auto core = static_cast<unsigned>(read_long(topo + "core_id", c));
+				// core_id is only unique within a package
+				cpus_.push_back(cpu_info{ c, (package << 16) | core, package, node_of[c] });
+			}
+			quota_ = cgroup_quota();
+		}
+#elif defined(_WIN32)
+		void detect()
+		{
+			DWORD len = 0;
+			GetLogicalProcessorInformationEx(RelationAll, nullptr, &len);
+			std::vector<char> buf(len);
+			auto base = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buf.data());
+			if (!GetLogicalProcessorInformationEx(RelationAll, base, &len)) return;
+
+			struct entry { unsigned core_ = 0, package_ = 0, node_ = 0; bool present_ = false; };
+			std::vector<entry> entries;
+			auto for_each_cpu = [&](const GROUP_AFFINITY& ga, auto f) {
+				for (unsigned b = 0; b < sizeof(KAFFINITY) * 8; ++b) {
+					if (!(ga.Mask & (KAFFINITY{ 1 } << b))) continue;
+					const auto id = ga.Group * 64u + b;
+					if (entries.size() <= id) entries.resize(id + 1);
+					f(entries[id]);
+				}
+			};
+
+			unsigned cores = 0, packages = 0;
+			for (DWORD off = 0; off < len; ) {
+				auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buf.data() + off);
+				switch (info->Relationship) {
+				case RelationProcessorCore:
+					for (WORD g = 0; g < info->Processor.GroupCount; ++g) {
+						for_each_cpu(info->Processor.GroupMask[g],
+							[&](entry& e) { e.core_ = cores; e.present_ = true; });
+					}
+					++cores;
+					break;
+				case RelationProcessorPackage:
+					for (WORD g = 0; g < info->Processor.GroupCount; ++g) {
+						for_each_cpu(info->Processor.GroupMask[g],
+							[&](entry& e) { e.package_ = packages; });
+					}
+					++packages;
+					break;
+				case RelationNumaNode:
+					for_each_cpu(info->NumaNode.GroupMask,
+						[&](entry& e) { e.node_ = info->NumaNode.NodeNumber; });
+					nodes_n_ = std::max<std::size_t>(nodes_n_, info->NumaNode.NodeNumber + 1);
+					break;
+				default:
+					break;
+				}
+				off += info->Size;
+			}
+
+			// Restrict to the process affinity mask (group of the process only)
+			DWORD_PTR process_mask = 0, system_mask = 0;
+			GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask);
+			USHORT group = 0, groups_n = 1;
+			GetProcessGroupAffinity(GetCurrentProcess(), &groups_n, &group);
+			for (unsigned id = 0; id < entries.size(); ++id) {
+				const auto& e = entries[id];
+				if (!e.present_) continue;
+				if (groups_n == 1 && (id / 64 != group || !(process_mask & (DWORD_PTR{ 1 } << (id % 64))))) continue;
+				cpus_.push_back(cpu_info{ id, e.core_, e.package_, e.node_ });
+			}
+		}
+#else
+		void detect() {}
+#endif
+
+		cpu_topology()
+		{
+			detect();
+			if (cpus_.empty()) {
+				// Unknown platform: one node, one core per hardware thread
+				const auto n = std::max(1u, std::thread::hardware_concurrency());
+				for (unsigned i = 0; i < n; ++i) {
+					cpus_.push_back(cpu_info{ i, i, 0, 0 });
+				}
+				nodes_n_ = 1;
+			}
+		}
+	public:
+		static const cpu_topology& get()
+		{
+			static const cpu_topology topo;
+			return topo;
+		}
+
+		const std::vector<cpu_info>& cpus() const noexcept
+		{
+			return cpus_;
+		}
+
+		std::size_t numa_nodes() const noexcept
+		{
+			return nodes_n_;
+		}
+
+		/*
+		 * @brief	number of threads worth running in parallel
+		 *
+		 * Number of CPUs in the affinity mask, capped by the cgroup
+		 * CPU quota (rounded up) when there is one.
+		*/
+		std::size_t concurrency() const noexcept
+		{
+			return quota_ ? std::min(quota_, cpus_.size()) : cpus_.size();
+		}
+	};
+
+	/*
+	 * How a worker_group places its threads
+	 * none:			leave it to the OS scheduler
+	 * compact:			fill one core's hardware threads, then the next core,
+	 *					package by package; neighbouring IDs share caches
+	 * scatter:			one thread per physical core first, alternating packages,
+	 *					then the remaining hardware threads
+	 * per_numa_node:	split workers evenly across NUMA nodes, each worker
+	 *					may run on any CPU of its node
+	*/
+	enum class affinity_policy
+	{
+		none,
+		compact,
+		scatter,
+		per_numa_node
+	};
+
+	/*
+	 * Identity of the current thread inside its worker_group.
+	*/
+	struct this_worker
+	{
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+		// Index of the worker in its group, npos outside of any group
+		static std::size_t id() noexcept
+		{
+			return state().id_;
+		}
+		// NUMA node the worker is bound to, 0 when unknown
+		static std::size_t numa_node() noexcept
+		{
+			return state().node_;
+		}
+	private:
+		friend class worker_group;
+		struct ids
+		{
+			std::size_t id_{ npos };
+			std::size_t node_{ 0 };
+		};
+		static ids& state() noexcept
+		{
+			thread_local ids s;
+			return s;
+		}
+	};
+
+	/*
+	 * A runtime-sized group of threads running func(id) once each,
+	 * pinned according to an affinity_policy. Pinning happens on the
+	 * new thread before func runs, so its first-touch allocations
+	 * land on the right NUMA node.
+	*/
+	class worker_group
+	{
+		struct placement
+		{
+			std::vector<unsigned>	cpus_;	// empty: not pinned
+			std::size_t				node_{ 0 };
+		};
+
+		std::vector<std::thread> threads_;
+
+		static std::vector<placement> place(std::size_t n, affinity_policy policy)
+		{
+			std::vector<placement> ret(n);
+			if (policy == affinity_policy::none) return ret;
+
+			const auto& topo = cpu_topology::get();
+			auto cpus = topo.cpus();
+
+			if (policy == affinity_policy::per_numa_node) {
+				std::vector<std::vector<unsigned>> by_node(topo.numa_nodes());
+				for (const auto& c : cpus) by_node[c.node_].push_back(c.id_);
+				by_node.erase(std::remove_if(by_node.begin(), by_node.end(),
+					[](const auto& v) { return v.empty(); }), by_node.end());
+				std::vector<std::size_t> node_ids;
+				for (const auto& v : by_node) {
+					node_ids.push_back(std::find_if(cpus.begin(), cpus.end(),
+						[&](const cpu_info& c) { return c.id_ == v.front(); })->node_);
+				}
+				// Contiguous blocks of IDs per node
+				for (std::size_t i = 0; i < n; ++i) {
+					const auto k = i * by_node.size() / n;
+					ret[i].cpus_ = by_node[k];
+					ret[i].node_ = node_ids[k];
+				}
+				return ret;
+			}
+
+			// Rank of each cpu among the hardware threads of its core,
+			// and of its core within its package
+			std::sort(cpus.begin(), cpus.end(), [](const cpu_info& a, const cpu_info& b) {
+				return std::tie(a.package_, a.core_, a.id_) < std::tie(b.package_, b.core_, b.id_);
+			});
+			std::vector<std::size_t> smt_rank(cpus.size()), core_rank(cpus.size());
+			for (std::size_t i = 0, core_i = 0; i < cpus.size(); ++i) {
+				const bool same_core = i > 0 && cpus[i].core_ == cpus[i - 1].core_;
+				const bool same_package = i > 0 && cpus[i].package_ == cpus[i - 1].package_;
+				smt_rank[i] = same_core ? smt_rank[i - 1] + 1 : 0;
+				core_i = !same_package ? 0 : (same_core ? core_i : core_i + 1);
+				core_rank[i] = core_i;
+			}
+			if (policy == affinity_policy::scatter) {
+				std::vector<std::size_t> order(cpus.size());
+				std::iota(order.begin(), order.end(), 0);
+				std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+					return std::tie(smt_rank[a], core_rank[a], cpus[a].package_) <
+						   std::tie(smt_rank[b], core_rank[b], cpus[b].package_);
+				});
+				std::vector<cpu_info> sorted;
+				for (auto i : order) sorted.push_back(cpus[i]);
+				cpus = std::move(sorted);
+			}
+
+			// Wrap around when there are more workers than CPUs
+			for (std::size_t i = 0; i < n; ++i) {
+				const auto& c = cpus[i % cpus.size()];
+				ret[i].cpus_ = { c.id_ };
+				ret[i].node_ = c.node_;
+			}
+			return ret;
+		}
+
+		static void pin(const std::vector<unsigned>& cpus) noexcept
+		{
+			if (cpus.empty()) return;
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (auto c : cpus) CPU_SET(c, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+			// A thread can only be bound within one processor group
+			GROUP_AFFINITY ga{};
+			ga.Group = static_cast<WORD>(cpus.front() / 64);
+			for (auto c : cpus) {
+				if (c / 64 == ga.Group) ga.Mask |= KAFFINITY{ 1 } << (c % 64);
+			}
+			SetThreadGroupAffinity(GetCurrentThread(), &ga, nullptr);
+#endif
+		}
+	public:
+		/*
+		 * @param	n		number of threads; 0 means cpu_topology::concurrency()
+		 * @param	policy	where to run the threads
+		 * @param	func	invoked as func(id) on every thread, id in [0, n)
+		*/
+		template<typename F>
+		worker_group(std::size_t n, affinity_policy policy, F func)
+		{
+			if (n == 0) n = cpu_topology::get().concurrency();
+			auto placements = place(n, policy);
+			threads_.reserve(n);
+			for (std::size_t i = 0; i < n; ++i) {
+				threads_.emplace_back([func, i, p = std::move(placements[i])]() mutable {
+					pin(p.cpus_);
+					this_worker::state() = this_worker::ids{ i, p.node_ };
+					func(i);
+				});
+			}
+		}
+		worker_group(const worker_group&) = delete;
+		worker_group& operator=(const worker_group&) = delete;
+		~worker_group()
+		{
+			join_all();
+		}
+
+		std::size_t size() const noexcept
+		{
+			return threads_.size();
+		}
+		void join_all()
+		{
+			std::for_each(threads_.begin(), threads_.end(),
+				[](std::thread& t) { if (t.joinable()) t.join(); });
+		}
+	};
+
 	template<std::size_t N>
 	struct thread_array
 	{
@@ -23,10 +440,230 @@ namespace hungbiu
 		{
 			join_all();
 		}
-		void join_all() 
+		void join_all()
 		{
 			std::for_each(data_.begin(), data_.end(),
 				[](std::thread& t) { if (t.joinable()) t.join(); });
 		}
 	};
+
+	/*
+	 * Work-stealing thread pool.
+	 *
+	 * Each worker owns a Chase-Lev deque. Tasks submitted from a worker go to
+	 * the bottom of its own deque, tasks submitted from outside go to a shared
+	 * injection queue. An idle worker looks at its own deque, then the
+	 * injection queue, then tries to steal from randomly chosen workers, and
+	 * finally parks until new work is submitted.
+	 *
+	 * The destructor runs every task submitted before it, then joins the workers.
+	*/
+	class thread_pool
+	{
+		struct task_base
+		{
+			virtual ~task_base() = default;
+			virtual void run() = 0;
+		};
+		template<typename F>
+		struct task_impl : task_base
+		{
+			F func_;
+			explicit task_impl(F&& func) : func_(std::move(func)) {}
+			void run() override { func_(); }
+		};
+
+		struct worker
+		{
+			work_stealing_deque<task_base*>	deque_;
+			std::uint64_t					rng_;
+
+			explicit worker(std::uint64_t seed) : rng_(seed) {}
+
+			// xorshift64
+			std::uint64_t next_random() noexcept
+			{
+				rng_ ^= rng_ << 13;
+				rng_ ^= rng_ >> 7;
+				rng_ ^= rng_ << 17;
+				return rng_;
+			}
+		};
+
+		// Which pool and worker the current thread belongs to, if any
+		struct worker_context
+		{
+			thread_pool*	pool_{ nullptr };
+			worker*			worker_{ nullptr };
+		};
+		static worker_context& current() noexcept
+		{
+			thread_local worker_context ctx;
+			return ctx;
+		}
+
+		std::vector<std::unique_ptr<worker>>	workers_;
+		lock_free_linked_queue<task_base*>		injection_;
+		std::atomic<bool>						stop_{ false };
+		std::optional<worker_group>				group_;
+
+		// Idle parking
+		alignas(False_Sharing_Size)
+		std::atomic<std::size_t>				sleepers_{ 0 };
+		std::mutex								idle_mtx_;
+		std::condition_variable					idle_cv_;
+
+		void schedule(task_base* t)
+		{
+			auto& ctx = current();
+			if (ctx.pool_ == this) {
+				ctx.worker_->deque_.push(t);
+			}
+			else {
+				injection_.push(t);
+			}
+			wake_one();
+		}
+
+		void wake_one()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+			{
+				std::lock_guard lk{ idle_mtx_ };
+			}
+			idle_cv_.notify_one();
+		}
+
+		task_base* find_task(worker& self)
+		{
+			if (auto t = self.deque_.pop()) return *t;
+			if (auto t = injection_.try_pop()) return *t;
+
+			// Steal from random victims
+			const auto n = workers_.size();
+			for (auto i = 0u; i < n * 2; ++i) {
+				auto& victim = *workers_[self.next_random() % n];
+				if (&victim == &self) continue;
+				if (auto t = victim.deque_.steal()) return *t;
+			}
+			return nullptr;
+		}
+
+		bool has_visible_work() const noexcept
+		{
+			if (!injection_.empty()) return true;
+			return std::any_of(workers_.cbegin(), workers_.cend(),
+				[](const auto& w) { return !w->deque_.empty(); });
+		}
+
+		void park()
+		{
+			std::unique_lock lk{ idle_mtx_ };
+			sleepers_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			idle_cv_.wait(lk, [&]() {
+				return stop_.load(std::memory_order_relaxed) || has_visible_work();
+			});
+			sleepers_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		void run(worker& self)
+		{
+			current() = worker_context{ this, &self };
+			for (;;) {
+				if (auto t = find_task(self)) {
+					t->run();
+					delete t;
+					continue;
+				}
+				if (stop_.load(std::memory_order_acquire)) break;
+				park();
+			}
+			current() = worker_context{};
+		}
+	public:
+		/*
+		 * @param	threads_n	number of worker threads; 0 means as many as
+		 *						cpu_topology::concurrency(), which honours the
+		 *						affinity mask and cgroup CPU quota
+		 * @param	policy		where to pin the workers
+		*/
+		explicit thread_pool(std::size_t threads_n = 0,
+							 affinity_policy policy = affinity_policy::none)
+		{
+			if (threads_n == 0) threads_n = cpu_topology::get().concurrency();
+			threads_n = std::max<std::size_t>(threads_n, 1);
+			workers_.reserve(threads_n);
+			for (auto i = 0u; i < threads_n; ++i) {
+				workers_.push_back(std::make_unique<worker>(0x9E3779B97F4A7C15ull * (i + 1)));
+			}
+			// Every worker exists before any of them can try to steal
+			group_.emplace(threads_n, policy, [this](std::size_t id) { run(*workers_[id]); });
+		}
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+
+		~thread_pool()
+		{
+			stop_.store(true, std::memory_order_release);
+			{
+				std::lock_guard lk{ idle_mtx_ };
+			}
+			idle_cv_.notify_all();
+			group_.reset();
+		}
+
+		std::size_t size() const noexcept
+		{
+			return workers_.size();
+		}
+
+		/*
+		 * @brief	run one pending task on the calling thread, if there is any
+		 * @return	false if no task was found
+		 *
+		 * Lets a task wait for the tasks it submitted without blocking its
+		 * worker: waiting on a future inside a task may otherwise deadlock
+		 * once every worker is waiting.
+		*/
+		bool run_one()
+		{
+			auto& ctx = current();
+			task_base* t = nullptr;
+			if (ctx.pool_ == this) {
+				t = find_task(*ctx.worker_);
+			}
+			else if (auto opt = injection_.try_pop()) {
+				t = *opt;
+			}
+			if (!t) return false;
+			t->run();
+			delete t;
+			return true;
+		}
+
+		/*
+		 * @brief	run f(args...) on the pool
+		 * @return	future holding the result or the exception thrown by f
+		 * @exception	may throw std::bad_alloc
+		*/
+		template<typename F, typename ...Args>
+		auto submit(F&& f, Args&&... args)
+			-> std::future<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>
+		{
+			using result_t = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+			std::packaged_task<result_t()> pt{
+				[f = std::forward<F>(f),
+				 args = std::make_tuple(std::forward<Args>(args)...)]() mutable {
+					return std::apply(std::move(f), std::move(args));
+				} };
+			auto fut = pt.get_future();
+
+			auto t = std::make_unique<task_impl<std::packaged_task<result_t()>>>(std::move(pt));
+			schedule(t.get());
+			t.release();
+			return fut;
+		}
+	};
 }
@@ -0,0 +1,155 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "backoff.h"
+#include "cache_line.h"
+
+namespace hungbiu
+{
+	/*
+	 * Wait policies decide what a thread does while the slot it holds a
+	 * ticket for is not ready. A waiter goes through up to three phases:
+	 *   spin  - re-check after an exponential backoff, until spin_limit
+	 *           cpu_relax() rounds have been issued
+	 *   yield - re-check after std::this_thread::yield(), yield_limit times
+	 *   park  - sleep in a parking_lot until the slot is handed over
+	 * A policy that doesn't park keeps yielding after the yield phase.
+	 *
+	 * Waiters that park pay for it: array_blocking_queue has them flag the
+	 * slot before sleeping, and a release only touches the parking_lot when
+	 * it finds the flag, so the uncontended path never fences. Policies
+	 * that never park still leave the release as a plain store.
+	*/
+
+	// Spin forever. Lowest latency when every waiter owns a core.
+	struct busy_wait
+	{
+		static constexpr std::size_t spin_limit = SIZE_MAX;
+		static constexpr std::size_t yield_limit = 0;
+		static constexpr bool parks = false;
+	};
+
+	// Spin for a while, then keep yielding the time slice.
+	template<std::size_t Spins = 128>
+	struct spin_yield_wait
+	{
+		static constexpr std::size_t spin_limit = Spins;
+		static constexpr std::size_t yield_limit = 0;
+		static constexpr bool parks = false;
+	};
+
+	// Spin, then yield, then sleep until the slot is handed over.
+	template<std::size_t Spins = 128, std::size_t Yields = 16>
+	struct spin_park_wait
+	{
+		static constexpr std::size_t spin_limit = Spins;
+		static constexpr std::size_t yield_limit = Yields;
+		static constexpr bool parks = true;
+	};
+
+	/*
+	 * A fixed set of parking cells that waiters sleep in, keyed by slot index.
+	 * Slots share cells round-robin, so a wake-up may be spurious and the
+	 * waiter re-checks its condition.
+	 *
+	 * Each cell counts its sleepers, which lets unpark() skip the mutex and
+	 * the condition variable entirely when nobody is parked.
+	 * park() and unpark() form a Dekker pair: the waiter publishes itself and
+	 * then re-checks the condition, the releaser publishes the condition and
+	 * then checks for waiters; the seq_cst fences make sure at least one side
+	 * sees the other.
+	*/
+	class parking_lot
+	{
+		struct alignas(False_Sharing_Size) cell
+		{
+			std::atomic<std::uint32_t>	waiters_{ 0 };
+			std::mutex					mtx_;
+			std::condition_variable		cv_;
+		};
+
+		static constexpr std::size_t Cells_N = 32;
+		cell cells_[Cells_N];
+
+		cell& get_cell(std::size_t key) noexcept
+		{
+			return cells_[key & (Cells_N - 1)];
+		}
+	public:
+		/*
+		 * @brief	block until ready() returns true
+		 * @param	key		identifies the slot being waited on
+		 * @param	ready	condition to wait for; must be satisfied by a
+		 *					store that is followed by unpark(key), or by
+		 *					an RMW that calls it whenever an RMW made by
+		 *					ready() came first
+		*/
+		template<typename Pred>
+		void park(std::size_t key, Pred ready)
+		{
+			auto& c = get_cell(key);
+			std::unique_lock lk{ c.mtx_ };
+			c.waiters_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!ready()) {
+				c.cv_.wait(lk);
+			}
+			c.waiters_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		/*
+		 * @brief	block until ready() returns true or deadline is reached
+		 * @return	the last value of ready()
+		*/
+		template<typename Pred, typename Clock, typename Duration>
+		bool park_until(std::size_t key, Pred ready,
+						const std::chrono::time_point<Clock, Duration>& deadline)
+		{
+			auto& c = get_cell(key);
+			std::unique_lock lk{ c.mtx_ };
+			c.waiters_.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto ret = ready();
+			while (!ret) {
+				const auto status = c.cv_.wait_until(lk, deadline);
+				ret = ready();
+				if (status == std::cv_status::timeout) break;
+			}
+			c.waiters_.fetch_sub(1, std::memory_order_relaxed);
+			return ret;
+		}
+
+		/*
+		 * @brief	wake the threads parked on key's cell, if there are any
+		*/
+		void unpark(std::size_t key)
+		{
+			auto& c = get_cell(key);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (c.waiters_.load(std::memory_order_relaxed) == 0) return;
+
+			// Taking the mutex makes sure a waiter that has checked its
+			// condition is already inside wait() before we notify
+			{
+				std::lock_guard lk{ c.mtx_ };
+			}
+			c.cv_.notify_all();
+		}
+
+		/*
+		 * @brief	wake every parked thread, whatever it's waiting on
+		*/
+		void unpark_all()
+		{
+			for (std::size_t i = 0; i < Cells_N; ++i) {
+				unpark(i);
+			}
+		}
+	};
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <type_traits>
+#include <new>
+#include "cache_line.h"
+
+namespace hungbiu
+{
+	/*
+	 * Chase-Lev work-stealing deque.
+	 * The owner thread pushes and pops at the bottom without contention in the
+	 * common case; any other thread may steal from the top. The buffer grows
+	 * when full; old buffers are kept until the deque is destroyed because a
+	 * thief may still be reading from them.
+	 *
+	 * Memory orderings follow Le, Pop, Cohen and Zappa Nardelli,
+	 * "Correct and Efficient Work-Stealing for Weak Memory Models", 2013.
+	 * T is stored in std::atomic<T>, so it must be trivially copyable;
+	 * pointers to tasks are the intended use.
+	*/
+	template<typename T>
+	class work_stealing_deque
+	{
+		static_assert(std::is_trivially_copyable_v<T>,
+			"work_stealing_deque requires a trivially copyable T");
+
+		struct ring
+		{
+			const std::int64_t capacity_;
+			const std::int64_t mask_;
+			std::unique_ptr<std::atomic<T>[]> data_;
+
+			explicit ring(std::int64_t capacity) :
+				capacity_(capacity),
+				mask_(capacity - 1),
+				data_(new std::atomic<T>[static_cast<std::size_t>(capacity)]) {}
+
+			T get(std::int64_t i) const noexcept
+			{
+				return data_[i & mask_].load(std::memory_order_relaxed);
+			}
+			void put(std::int64_t i, T val) noexcept
+			{
+				data_[i & mask_].store(val, std::memory_order_relaxed);
+			}
+		};
+
+		alignas(False_Sharing_Size) std::atomic<std::int64_t> top_{ 0 };
+		alignas(False_Sharing_Size) std::atomic<std::int64_t> bottom_{ 0 };
+		std::atomic<ring*> ring_;
+		// Owned by the owner thread, retired rings stay alive until destruction
+		std::vector<std::unique_ptr<ring>> rings_;
+
+		ring* grow(ring* old, std::int64_t bottom, std::int64_t top)
+		{
+			auto p = std::make_unique<ring>(old->capacity_ * 2);
+			for (auto i = top; i != bottom; ++i) {
+				p->put(i, old->get(i));
+			}
+			auto raw = p.get();
+			rings_.push_back(std::move(p));
+			ring_.store(raw, std::memory_order_release);
+			return raw;
+		}
+	public:
+		/*
+		 * @param	capacity	initial capacity, rounded up to a power of two
+		 *						since the ring indexes with a mask
+		*/
+		explicit work_stealing_deque(std::size_t capacity = 256)
+		{
+			std::int64_t n = 1;
+			while (static_cast<std::size_t>(n) < capacity) n *= 2;
+			rings_.push_back(std::make_unique<ring>(n));
+			ring_.store(rings_.back().get(), std::memory_order_relaxed);
+		}
+		work_stealing_deque(const work_stealing_deque&) = delete;
+		work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+		/*
+		 * Approximate number of elements, exact only for the owner
+		 * when there are no concurrent thieves.
+		**/
+		std::size_t size() const noexcept
+		{
+			const auto b = bottom_.load(std::memory_order_relaxed);
+			const auto t = top_.load(std::memory_order_relaxed);
+			return b > t ? static_cast<std::size_t>(b - t) : 0;
+		}
+		bool empty() const noexcept
+		{
+			return size() == 0;
+		}
+
+		// Owner only
+		void push(T val)
+		{
+			const auto b = bottom_.load(std::memory_order_relaxed);
+			const auto t = top_.load(std::memory_order_acquire);
+			auto a = ring_.load(std::memory_order_relaxed);
+			if (b - t > a->capacity_ - 1) {
+				a = grow(a, b, t);
+			}
+			a->put(b, val);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom_.store(b + 1, std::memory_order_relaxed);
+		}
+
+		// Owner only
+		std::optional<T> pop() noexcept
+		{
+			const auto b = bottom_.load(std::memory_order_relaxed) - 1;
+			auto a = ring_.load(std::memory_order_relaxed);
+			bottom_.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			auto t = top_.load(std::memory_order_relaxed);
+
+			std::optional<T> ret{};
+			if (t <= b) {
+				ret = a->get(b);
+				if (t == b) {
+					// Last element, race against thieves for it
+					if (!top_.compare_exchange_strong(t, t + 1,
+													  std::memory_order_seq_cst,
+													  std::memory_order_relaxed)) {
+						ret.reset();
+					}
+					bottom_.store(b + 1, std::memory_order_relaxed);
+				}
+			}
+			else {
+				// Deque was empty
+				bottom_.store(b + 1, std::memory_order_relaxed);
+			}
+			return ret;
+		}
+
+		/*
+		 * Any thread. Returns an empty optional when the deque is empty
+		 * or when another thread won the race for the top element.
+		**/
+		std::optional<T> steal() noexcept
+		{
+			auto t = top_.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const auto b = bottom_.load(std::memory_order_acquire);
+
+			std::optional<T> ret{};
+			if (t < b) {
+				auto a = ring_.load(std::memory_order_acquire);
+				auto val = a->get(t);
+				if (top_.compare_exchange_strong(t, t + 1,
+												 std::memory_order_seq_cst,
+												 std::memory_order_relaxed)) {
+					ret = val;
+				}
+			}
+			return ret;
+		}
+	};
+}
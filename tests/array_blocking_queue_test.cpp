@@ -2,10 +2,16 @@
 #include "../concurrent_data_structures/array_blocking_queue.h"
 #include "../concurrent_data_structures/thread_pool.h"
 #include "../concurrent_data_structures/spinlock.h"
+#include "../concurrent_data_structures/queue_closed.h"
 #include <thread>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
 using namespace std;
 using namespace hungbiu;
 
@@ -111,4 +117,804 @@ TEST(ArrBlkQueue, MPMC_unique_ptr) {
 	sort(outputs.begin(), outputs.end());
 	EXPECT_EQ(inputs.size(), outputs.size());
 	ASSERT_EQ(inputs, outputs);
-}
\ No newline at end of file
+}
+
+/*
+ * Consumers outnumber producers and block in pop() long before
+ * anything is pushed, so they end up parked.
+*/
+TEST(ArrBlkQueue, MPMC_parked_consumers) {
+	const size_t Diff = 1000;
+	const size_t Producers_N = 2;
+	const size_t Consumers_N = 8;
+	const size_t Sum = Diff * Producers_N;
+
+	array_blocking_queue<int, spin_park_wait<16, 4>> abq(64);
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		for (auto i = 0u; i < Sum / Consumers_N; ++i) {
+			int v;
+			abq.pop(v);
+			lock_guard lk{ spnlk };
+			outputs.push_back(v);
+		}
+	} };
+
+	atomic<int> begin = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		this_thread::sleep_for(chrono::milliseconds(100));
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + static_cast<int>(Diff); ++e) {
+			abq.push(e);
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * SPSC with the pure spinning policy
+*/
+TEST(ArrBlkQueue, SPSC_busy_wait) {
+	const size_t N = 1000;
+	array_blocking_queue<int, busy_wait> abq(16);
+
+	thread producer{ [&]() {
+		for (auto i = 0u; i < N; ++i) {
+			abq.push(static_cast<int>(i));
+		}
+	} };
+
+	for (auto i = 0u; i < N; ++i) {
+		int v;
+		abq.pop(v);
+		ASSERT_EQ(static_cast<int>(i), v);
+	}
+	producer.join();
+}
+
+/*
+ * Batch push_n/pop_n, batches larger than the capacity
+*/
+TEST(ArrBlkQueue, SPSC_batch) {
+	const size_t N = 1000;
+	const size_t Batch = 100;
+	vector<int> inputs(N), outputs;
+	iota(inputs.begin(), inputs.end(), 1);
+	outputs.reserve(N);
+
+	array_blocking_queue<int> abq(64);
+
+	thread producer{ [&]() {
+		for (auto it = inputs.cbegin(); it != inputs.cend(); it += Batch) {
+			abq.push_n(it, it + Batch);
+		}
+	} };
+
+	for (auto i = 0u; i < N / Batch; ++i) {
+		abq.pop_n(back_inserter(outputs), Batch);
+	}
+	producer.join();
+
+	int v;
+	ASSERT_FALSE(abq.try_pop(v));
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Batch push_n with concurrent try_pop_n consumers
+*/
+TEST(ArrBlkQueue, MPMC_batch_unique_ptr) {
+	const size_t Diff = 1000;
+	const size_t Batch = 32;
+	const size_t Producers_N = 4;
+	const size_t Consumers_N = 4;
+	const size_t Sum = Diff * Producers_N;
+	atomic<int> begin = 0;
+	atomic<size_t> counter = 0;
+
+	array_blocking_queue<unique_ptr<int>> abq(256);
+
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		vector<unique_ptr<int>> data;
+		for (auto e = b; e < b + static_cast<int>(Diff); ++e) {
+			data.push_back(make_unique<int>(e));
+		}
+		for (auto it = data.begin(); it != data.end(); ) {
+			const auto n = min<size_t>(Batch, data.end() - it);
+			abq.push_n(make_move_iterator(it), make_move_iterator(it + n));
+			it += n;
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		vector<unique_ptr<int>> batch;
+		while (counter.load() < Sum) {
+			batch.clear();
+			const auto n = abq.try_pop_n(back_inserter(batch), Batch);
+			if (n == 0) continue;
+			ASSERT_EQ(n, batch.size());
+
+			lock_guard lk{ spnlk };
+			for (auto& p : batch) outputs.push_back(*p);
+			counter.fetch_add(n);
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Compact layout keeps FIFO order from a single producer
+*/
+TEST(ArrBlkQueue, SPSC_compact) {
+	const size_t N = 10000;
+	array_blocking_queue<int, spin_park_wait<>, compact_layout> abq(64);
+
+	thread producer{ [&]() {
+		for (auto i = 0u; i < N; ++i) {
+			abq.push(static_cast<int>(i));
+		}
+	} };
+
+	for (auto i = 0u; i < N; ++i) {
+		int v;
+		abq.pop(v);
+		ASSERT_EQ(static_cast<int>(i), v);
+	}
+	producer.join();
+
+	// Capacity smaller than a cache line worth of slots
+	array_blocking_queue<char, spin_park_wait<>, compact_layout> small(2);
+	small.push('a');
+	small.push('b');
+	char c;
+	ASSERT_TRUE(small.try_pop(c));
+	ASSERT_EQ('a', c);
+	ASSERT_TRUE(small.try_pop(c));
+	ASSERT_EQ('b', c);
+	ASSERT_FALSE(small.try_pop(c));
+}
+
+/*
+ * Compact layout, MPMC with a move-only type
+*/
+TEST(ArrBlkQueue, MPMC_compact_unique_ptr) {
+	const size_t Diff = 1000;
+	const size_t Producers_N = 4;
+	const size_t Consumers_N = 4;
+	const size_t Sum = Diff * Producers_N;
+	atomic<int> begin = 0;
+
+	array_blocking_queue<unique_ptr<int>, spin_park_wait<>, compact_layout> abq(128);
+
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + static_cast<int>(Diff); ++e) {
+			abq.emplace(make_unique<int>(e));
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		for (auto i = 0u; i < Sum / Consumers_N; ++i) {
+			unique_ptr<int> v;
+			abq.pop(v);
+			lock_guard lk{ spnlk };
+			outputs.push_back(*v);
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Timed push/pop report timeouts without claiming a ticket
+*/
+TEST(ArrBlkQueue, Timed) {
+	array_blocking_queue<unique_ptr<int>, spin_park_wait<16, 4>> abq(2);
+	const auto timeout = chrono::milliseconds(20);
+
+	// Empty: pop_for times out and the queue still works afterwards
+	unique_ptr<int> v;
+	auto start = chrono::steady_clock::now();
+	ASSERT_FALSE(abq.pop_for(v, timeout));
+	ASSERT_GE(chrono::steady_clock::now() - start, timeout);
+
+	// Full: push_for times out and leaves the value alone
+	ASSERT_TRUE(abq.push_for(make_unique<int>(1), timeout));
+	ASSERT_TRUE(abq.push_until(make_unique<int>(2), chrono::steady_clock::now() + timeout));
+	auto p = make_unique<int>(3);
+	ASSERT_FALSE(abq.push_for(std::move(p), timeout));
+	ASSERT_TRUE(p);
+
+	ASSERT_TRUE(abq.pop_for(v, timeout));
+	ASSERT_EQ(1, *v);
+	ASSERT_TRUE(abq.push_for(std::move(p), timeout));
+	ASSERT_FALSE(p);
+	ASSERT_TRUE(abq.pop_until(v, chrono::steady_clock::now() + timeout));
+	ASSERT_EQ(2, *v);
+	ASSERT_TRUE(abq.pop_for(v, timeout));
+	ASSERT_EQ(3, *v);
+
+	// A parked consumer is woken by the producer, long before the deadline
+	thread producer{ [&]() {
+		this_thread::sleep_for(chrono::milliseconds(50));
+		abq.push(make_unique<int>(4));
+	} };
+	start = chrono::steady_clock::now();
+	ASSERT_TRUE(abq.pop_for(v, chrono::seconds(30)));
+	ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(10));
+	ASSERT_EQ(4, *v);
+	producer.join();
+}
+
+/*
+ * Consumers with short timeouts, retrying, see every element exactly once
+*/
+TEST(ArrBlkQueue, MPMC_timed) {
+	const size_t Diff = 1000;
+	const size_t Producers_N = 4;
+	const size_t Consumers_N = 4;
+	const size_t Sum = Diff * Producers_N;
+
+	array_blocking_queue<int> abq(16);
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	atomic<size_t> popped = 0;
+	thread_array<Consumers_N> consumers{ [&]() {
+		int v;
+		while (popped.load() < Sum) {
+			if (!abq.pop_for(v, chrono::microseconds(100))) continue;
+			popped.fetch_add(1);
+			lock_guard lk{ spnlk };
+			outputs.push_back(v);
+		}
+	} };
+
+	atomic<int> begin = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + static_cast<int>(Diff); ) {
+			if (abq.push_for(e, chrono::microseconds(100))) ++e;
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * close() lets consumers drain what was pushed before it,
+ * then releases every consumer blocked on a ticket past the end
+*/
+template<typename WaitPolicy>
+void close_drains()
+{
+	const size_t Consumers_N = 4;
+	const int N = 10;
+	array_blocking_queue<int, WaitPolicy> abq(16);
+
+	atomic<int> popped = 0, closed = 0;
+	atomic<int> sum = 0;
+	thread_array<Consumers_N> consumers{ [&]() {
+		try {
+			for (;;) {
+				int v;
+				abq.pop(v);
+				sum.fetch_add(v);
+				popped.fetch_add(1);
+			}
+		}
+		catch (const queue_closed&) {
+			closed.fetch_add(1);
+		}
+	} };
+
+	for (int i = 1; i <= N; ++i) {
+		abq.push(i);
+	}
+	// Let the consumers block on empty slots
+	this_thread::sleep_for(chrono::milliseconds(50));
+	ASSERT_FALSE(abq.is_closed());
+	abq.close();
+	abq.close();
+	ASSERT_TRUE(abq.is_closed());
+	consumers.join_all();
+
+	ASSERT_EQ(N, popped.load());
+	ASSERT_EQ(N * (N + 1) / 2, sum.load());
+	ASSERT_EQ(static_cast<int>(Consumers_N), closed.load());
+
+	// Pushes are rejected, pops report closed without waiting
+	ASSERT_THROW(abq.push(0), queue_closed);
+	ASSERT_FALSE(abq.try_push(0));
+	ASSERT_FALSE(abq.push_for(0, chrono::seconds(30)));
+	vector<int> in{ 1, 2 };
+	ASSERT_THROW(abq.push_n(in.begin(), in.end()), queue_closed);
+	int v;
+	ASSERT_FALSE(abq.try_pop(v));
+	const auto start = chrono::steady_clock::now();
+	ASSERT_FALSE(abq.pop_for(v, chrono::seconds(30)));
+	ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(10));
+	ASSERT_THROW(abq.pop(v), queue_closed);
+}
+TEST(ArrBlkQueue, Close) {
+	close_drains<spin_park_wait<16, 4>>();
+	close_drains<spin_yield_wait<>>();
+}
+
+/*
+ * Elements left at close() are still handed out, pop_n stops at the end
+*/
+TEST(ArrBlkQueue, Close_drain_batch) {
+	array_blocking_queue<unique_ptr<int>> abq(8);
+	for (int i = 0; i < 5; ++i) {
+		abq.push(make_unique<int>(i));
+	}
+	abq.close();
+
+	unique_ptr<int> v;
+	ASSERT_TRUE(abq.pop_for(v, chrono::milliseconds(10)));
+	ASSERT_EQ(0, *v);
+	vector<unique_ptr<int>> out;
+	abq.pop_n(back_inserter(out), 8);
+	ASSERT_EQ(4u, out.size());
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_EQ(i + 1, *out[i]);
+	}
+	ASSERT_THROW(abq.pop(v), queue_closed);
+}
+
+/*
+ * A batch pop whose output throws still releases every slot it claimed
+*/
+namespace {
+	struct tracked
+	{
+		static inline int live = 0;
+		int v_;
+		explicit tracked(int v) : v_(v) { ++live; }
+		tracked(tracked&& other) noexcept : v_(other.v_) { ++live; }
+		~tracked() { --live; }
+	};
+	struct fussy_sink
+	{
+		int v_ = -1;
+		fussy_sink& operator=(tracked&& t)
+		{
+			if (t.v_ == 2) throw invalid_argument("2");
+			v_ = t.v_;
+			return *this;
+		}
+	};
+}
+TEST(ArrBlkQueue, Batch_throwing_output) {
+	array_blocking_queue<tracked> q{ 4 };
+	vector<fussy_sink> out(4);
+	for (int i = 0; i < 4; ++i) {
+		q.emplace(i);
+	}
+	ASSERT_THROW(q.pop_n(out.begin(), 4), invalid_argument);
+	ASSERT_EQ(0, out[0].v_);
+	ASSERT_EQ(1, out[1].v_);
+	ASSERT_EQ(-1, out[2].v_);
+	// Empty, with room for a full lap again
+	ASSERT_EQ(0, tracked::live);
+	ASSERT_FALSE(q.try_pop());
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_TRUE(q.try_emplace(i));
+	}
+
+	out.assign(4, fussy_sink{});
+	ASSERT_THROW(q.try_pop_n(out.begin(), 4), invalid_argument);
+	ASSERT_EQ(1, out[1].v_);
+	ASSERT_EQ(0, tracked::live);
+	ASSERT_FALSE(q.try_pop());
+
+	// Tickets past the closing tail are given up on, not waited for
+	q.emplace(1);
+	q.emplace(2);
+	q.close();
+	ASSERT_THROW(q.pop_n(out.begin(), 4), invalid_argument);
+	ASSERT_EQ(0, tracked::live);
+	ASSERT_THROW(q.pop(), queue_closed);
+}
+
+/*
+ * A push whose element throws on construction skips its ticket, and
+ * push_n the rest of its batch: consumers step over them, nobody hangs
+*/
+namespace {
+	struct fragile
+	{
+		int v_;
+		explicit fragile(int v) : v_(v) {}
+		fragile(const fragile& other) : v_(other.v_)
+		{
+			if (v_ < 0) throw invalid_argument("negative");
+		}
+	};
+}
+TEST(ArrBlkQueue, Batch_throwing_input) {
+	array_blocking_queue<fragile, spin_park_wait<16, 4>> q{ 4 };
+	// Built in place, copying -1 would throw
+	vector<fragile> in;
+	in.reserve(4);
+	for (int v : { 0, 1, -1, 3 }) {
+		in.emplace_back(v);
+	}
+	ASSERT_THROW(q.push_n(in.begin(), in.end()), invalid_argument);
+	ASSERT_EQ(0, q.pop().v_);
+	ASSERT_EQ(1, q.pop().v_);
+	ASSERT_FALSE(q.try_pop());
+	// Every slot is free again
+	for (int i = 0; i < 4; ++i) {
+		ASSERT_TRUE(q.try_push(fragile{ i }));
+	}
+	vector<fragile> out;
+	ASSERT_EQ(4u, q.try_pop_n(back_inserter(out), 4));
+	ASSERT_EQ(3, out.back().v_);
+
+	// Single pushes and reservations skip their own ticket
+	const fragile bad{ -1 };
+	ASSERT_THROW(q.push(bad), invalid_argument);
+	ASSERT_THROW(q.try_push(bad), invalid_argument);
+	ASSERT_THROW((void)q.reserve(bad), invalid_argument);
+	q.push(fragile{ 4 });
+	ASSERT_EQ(4, q.pop().v_);
+
+	// Consumers already waiting on the skipped tickets move on
+	atomic<int> sum{ 0 };
+	thread_array<2> consumers{ [&]() { sum.fetch_add(q.pop().v_); } };
+	this_thread::sleep_for(chrono::milliseconds(20));
+	ASSERT_THROW(q.push_n(in.begin() + 2, in.end()), invalid_argument);
+	q.push(fragile{ 5 });
+	q.push(fragile{ 6 });
+	consumers.join_all();
+	ASSERT_EQ(11, sum.load());
+
+	// A batch pop comes back short by the skipped tickets
+	ASSERT_THROW(q.push_n(in.begin() + 1, in.end()), invalid_argument);
+	q.push(fragile{ 7 });
+	out.clear();
+	q.pop_n(back_inserter(out), 3);
+	ASSERT_EQ(1u, out.size());
+	ASSERT_EQ(1, out[0].v_);
+	out.clear();
+	ASSERT_EQ(1u, q.try_pop_n(back_inserter(out), 4));
+	ASSERT_EQ(7, out[0].v_);
+
+	// close() drains past them
+	ASSERT_THROW(q.push_n(in.begin() + 1, in.end()), invalid_argument);
+	q.close();
+	ASSERT_EQ(1, q.pop().v_);
+	ASSERT_THROW(q.pop(), queue_closed);
+	ASSERT_TRUE(q.is_drained());
+}
+
+/*
+ * Capacities that aren't powers of two hold exactly capacity elements,
+ * in FIFO order, over several laps of the ring
+*/
+template<typename Layout>
+void arbitrary_capacity()
+{
+	for (size_t cap : { 2, 3, 5, 6, 7, 24, 100, 1000 }) {
+		array_blocking_queue<int, spin_park_wait<>, Layout> q(cap);
+		int v;
+		for (int lap = 0; lap < 3; ++lap) {
+			for (size_t i = 0; i < cap; ++i) {
+				ASSERT_TRUE(q.try_push(static_cast<int>(i)));
+			}
+			ASSERT_FALSE(q.try_push(-1));
+			for (size_t i = 0; i < cap; ++i) {
+				ASSERT_TRUE(q.try_pop(v));
+				ASSERT_EQ(static_cast<int>(i), v);
+			}
+			ASSERT_FALSE(q.try_pop(v));
+		}
+	}
+
+	const int N = 18000;
+	array_blocking_queue<int, spin_park_wait<>, Layout> q(6);
+	atomic<long long> sum = 0;
+	thread_array<3> consumers{ [&]() {
+		int v;
+		for (int i = 0; i < N / 3; ++i) {
+			q.pop(v);
+			sum.fetch_add(v);
+		}
+	} };
+	thread_array<2> producers{ [&]() {
+		for (int i = 1; i <= N / 2; ++i) {
+			q.push(i);
+		}
+	} };
+	producers.join_all();
+	consumers.join_all();
+	ASSERT_EQ(2LL * (N / 2) * (N / 2 + 1) / 2, sum.load());
+	int v;
+	ASSERT_FALSE(q.try_pop(v));
+}
+TEST(ArrBlkQueue, Arbitrary_capacity) {
+	arbitrary_capacity<padded_layout>();
+	arbitrary_capacity<compact_layout>();
+}
+
+/*
+ * Compile time capacity: slots embedded in the object,
+ * same behaviour as the heap allocated queue
+*/
+static_array_blocking_queue<int, 6> static_abq;
+
+template<typename Q>
+void static_capacity(Q& q)
+{
+	int v;
+	for (int lap = 0; lap < 3; ++lap) {
+		for (size_t i = 0; i < q.capacity(); ++i) {
+			ASSERT_TRUE(q.try_push(static_cast<int>(i)));
+		}
+		ASSERT_FALSE(q.try_push(-1));
+		for (size_t i = 0; i < q.capacity(); ++i) {
+			ASSERT_TRUE(q.try_pop(v));
+			ASSERT_EQ(static_cast<int>(i), v);
+		}
+		ASSERT_FALSE(q.try_pop(v));
+	}
+
+	const int N = 6000;
+	atomic<long long> sum = 0;
+	thread_array<2> consumers{ [&]() {
+		int v;
+		for (int i = 0; i < N / 2; ++i) {
+			q.pop(v);
+			sum.fetch_add(v);
+		}
+	} };
+	thread_array<2> producers{ [&]() {
+		for (int i = 1; i <= N / 2; ++i) {
+			q.push(i);
+		}
+	} };
+	producers.join_all();
+	consumers.join_all();
+	ASSERT_EQ(2LL * (N / 2) * (N / 2 + 1) / 2, sum.load());
+}
+TEST(ArrBlkQueue, Static_capacity) {
+	static_assert(sizeof(static_array_blocking_queue<int, 64>) >
+				  64 * Cache_Line_Size);
+	ASSERT_EQ(6u, static_abq.capacity());
+	static_capacity(static_abq);
+
+	auto compact = make_unique<static_array_blocking_queue<int, 24, spin_park_wait<>, compact_layout>>();
+	static_capacity(*compact);
+	auto pow2 = make_unique<static_array_blocking_queue<unique_ptr<int>, 8, busy_wait>>();
+	pow2->push(make_unique<int>(1));
+	pow2->push(make_unique<int>(2));
+	unique_ptr<int> p;
+	pow2->pop(p);
+	ASSERT_EQ(1, *p);
+	// The element left in the queue is destroyed with it
+}
+
+/*
+ * Slot arrays on huge pages and NUMA nodes work the same,
+ * whichever of them the system can actually provide
+*/
+TEST(ArrBlkQueue, Placement) {
+	const memory_placement placements[] = {
+		{ page_size::transparent, numa_policy::none, 0, true },
+		{ page_size::huge_2m, numa_policy::preferred, 0, true },
+		{ page_size::huge_1g, numa_policy::interleave, 0, false },
+		{ page_size::normal, numa_policy::bind, 0, true },
+	};
+	for (const auto& placement : placements) {
+		array_blocking_queue<unique_ptr<int>, spin_park_wait<>, compact_layout> q(1000, placement);
+		thread_array<1> producer{ [&]() {
+			for (int i = 0; i < 5000; ++i) {
+				q.push(make_unique<int>(i));
+			}
+		} };
+		for (int i = 0; i < 4990; ++i) {
+			unique_ptr<int> p;
+			q.pop(p);
+			ASSERT_EQ(i, *p);
+		}
+		producer.join_all();
+		// The rest is destroyed with the queue
+	}
+}
+
+/*
+ * Move-only elements without a default constructor, popped by value
+ * with a single move or consumed in place without any
+*/
+namespace {
+	struct message
+	{
+		static inline atomic<int> moves{ 0 };
+		unique_ptr<int> payload_;
+		explicit message(int v) : payload_(make_unique<int>(v)) {}
+		message(message&& other) noexcept : payload_(std::move(other.payload_)) { ++moves; }
+		message& operator=(message&& other) noexcept
+		{
+			payload_ = std::move(other.payload_);
+			++moves;
+			return *this;
+		}
+	};
+}
+TEST(ArrBlkQueue, Pop_by_value) {
+	array_blocking_queue<message> q{ 8 };
+	for (int i = 0; i < 6; ++i) {
+		q.emplace(i);
+	}
+	message::moves = 0;
+
+	message m = q.pop();
+	ASSERT_EQ(0, *m.payload_);
+	ASSERT_EQ(1, message::moves);
+
+	auto opt = q.try_pop();
+	ASSERT_TRUE(opt);
+	ASSERT_EQ(1, *opt->payload_);
+	ASSERT_EQ(2, message::moves);
+
+	ASSERT_EQ(2, q.consume([](message& in_slot) { return *in_slot.payload_; }));
+	ASSERT_TRUE(q.try_consume([](message& in_slot) { ASSERT_EQ(3, *in_slot.payload_); }));
+	ASSERT_EQ(2, message::moves);
+
+	// A throwing consumer still releases the slot
+	ASSERT_THROW(q.consume([](message&) { throw 42; }), int);
+	ASSERT_EQ(5, *q.pop().payload_);
+	ASSERT_FALSE(q.try_pop());
+	ASSERT_FALSE(q.try_consume([](message&) {}));
+
+	q.emplace(6);
+	q.close();
+	ASSERT_EQ(6, *q.pop().payload_);
+	ASSERT_THROW(q.pop(), queue_closed);
+	ASSERT_THROW(q.consume([](message&) {}), queue_closed);
+}
+
+TEST(ArrBlkQueue, MPMC_consume) {
+	constexpr int Producers = 4, Per_producer = 10000;
+	array_blocking_queue<message, spin_park_wait<16, 4>, compact_layout> q{ 64 };
+	atomic<long long> sum{ 0 };
+	thread_array<Producers> producers{ [&]() {
+		for (int i = 1; i <= Per_producer; ++i) {
+			q.emplace(i);
+		}
+	} };
+	thread_array<Producers> consumers{ [&]() {
+		for (int i = 0; i < Per_producer; ++i) {
+			if (i % 2) {
+				q.consume([&](message& m) { sum += *m.payload_; });
+			}
+			else {
+				sum += *q.pop().payload_;
+			}
+		}
+	} };
+	producers.join_all();
+	consumers.join_all();
+	ASSERT_EQ(Producers * (Per_producer * (Per_producer + 1ll) / 2), sum.load());
+	ASSERT_FALSE(q.try_pop());
+}
+
+/*
+ * Producers filling their slot in place and consumers reading it there
+*/
+namespace {
+	struct packet
+	{
+		std::size_t len_;
+		char data_[256];
+	};
+}
+TEST(ArrBlkQueue, Reserve_peek) {
+	array_blocking_queue<packet> q{ 4 };
+	{
+		auto w = q.reserve();
+		ASSERT_TRUE(w);
+		w->len_ = snprintf(w->data_, sizeof(w->data_), "packet %d", 0);
+		w.commit();
+		ASSERT_FALSE(w);
+	}
+	{
+		// Committed when the handle goes out of scope
+		auto w = q.try_reserve(packet{ 1, { 'a' } });
+		ASSERT_TRUE(w);
+	}
+	ASSERT_TRUE(q.try_push(packet{ 1, { 'b' } }));
+	ASSERT_TRUE(q.try_push(packet{ 1, { 'c' } }));
+	ASSERT_FALSE(q.try_reserve());
+
+	{
+		auto r = q.peek();
+		ASSERT_EQ(string("packet 0"), string(r->data_, r->len_));
+		r.release();
+		ASSERT_FALSE(r);
+	}
+	{
+		// Released when the handle goes out of scope
+		auto r = q.try_peek();
+		ASSERT_TRUE(r);
+		ASSERT_EQ('a', (*r).data_[0]);
+		// Moving hands the slot over
+		auto moved = std::move(r);
+		ASSERT_FALSE(r);
+		ASSERT_TRUE(moved);
+	}
+	packet p;
+	ASSERT_TRUE(q.try_pop(p));
+	ASSERT_EQ('b', p.data_[0]);
+	ASSERT_EQ('c', q.pop().data_[0]);
+	ASSERT_FALSE(q.try_peek());
+
+	q.close();
+	ASSERT_THROW(auto w = q.reserve(), queue_closed);
+	ASSERT_FALSE(q.try_reserve());
+	ASSERT_THROW(auto r = q.peek(), queue_closed);
+}
+
+TEST(ArrBlkQueue, MPMC_reserve_peek) {
+	constexpr int Producers = 4, Per_producer = 10000;
+	array_blocking_queue<packet, spin_park_wait<16, 4>> q{ 64 };
+	atomic<long long> sum{ 0 };
+	thread_array<Producers> producers{ [&]() {
+		for (int i = 1; i <= Per_producer; ++i) {
+			auto w = q.reserve();
+			w->len_ = static_cast<std::size_t>(i);
+			memset(w->data_, i & 0xff, sizeof(w->data_));
+			w.commit();
+		}
+	} };
+	thread_array<Producers> consumers{ [&]() {
+		for (int i = 0; i < Per_producer; ++i) {
+			auto r = q.peek();
+			ASSERT_EQ(static_cast<char>(r->len_ & 0xff), r->data_[sizeof(r->data_) - 1]);
+			sum += r->len_;
+		}
+	} };
+	producers.join_all();
+	consumers.join_all();
+	ASSERT_EQ(Producers * (Per_producer * (Per_producer + 1ll) / 2), sum.load());
+	ASSERT_FALSE(q.try_peek());
+}
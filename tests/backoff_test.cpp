@@ -0,0 +1,26 @@
+#include "pch.h"
+#include "../concurrent_data_structures/backoff.h"
+#include <cstdint>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * pause() doubles its rounds up to the cap and reset() starts over
+*/
+TEST(Backoff, Exponential) {
+	basic_backoff<8> b;
+	const uint32_t expected[] = { 1, 2, 4, 8, 8, 8 };
+	for (auto n : expected) {
+		ASSERT_EQ(n, b.pause());
+	}
+	b.reset();
+	ASSERT_EQ(1u, b.rounds());
+	ASSERT_EQ(1u, b.pause());
+	ASSERT_EQ(2u, b.rounds());
+
+	backoff d;
+	uint64_t total = 0;
+	for (int i = 0; i < 64; ++i) total += d.pause();
+	ASSERT_EQ(Backoff_Cap, d.rounds());
+	ASSERT_LE(total, 64u * Backoff_Cap);
+}
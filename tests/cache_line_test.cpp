@@ -0,0 +1,45 @@
+#include "pch.h"
+#include "../concurrent_data_structures/cache_line.h"
+// Both used to define ALIGN_REQ, differently
+#include "../concurrent_data_structures/array_blocking_queue.h"
+#include "../concurrent_data_structures/linked_blocking_queue.h"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * padded<T> fills exactly its span, so neighbours land in the next one,
+ * and reads like a pointer to its value
+*/
+TEST(CacheLine, Padded) {
+	static_assert(sizeof(padded<char>) == False_Sharing_Size);
+	static_assert(alignof(padded<atomic<uint64_t>>) == False_Sharing_Size);
+	static_assert(sizeof(padded<char[False_Sharing_Size + 1]>) == 2 * False_Sharing_Size);
+	static_assert(False_Sharing_Size % Cache_Line_Size == 0);
+
+	struct pair_t {
+		padded<atomic<uint64_t>> a_{ 1 };
+		padded<atomic<uint64_t>> b_{ 2 };
+	} p;
+	const auto distance = reinterpret_cast<uintptr_t>(&*p.b_) - reinterpret_cast<uintptr_t>(&*p.a_);
+	ASSERT_EQ(False_Sharing_Size, distance);
+	ASSERT_EQ(1u, p.a_->load());
+	p.b_->fetch_add(1);
+	ASSERT_EQ(3u, (*p.b_).load());
+
+	padded<vector<int>> v{ in_place, 3, 7 };
+	ASSERT_EQ(3u, v->size());
+	ASSERT_EQ(7, (*v)[2]);
+
+	// The queues share the same constants
+	array_blocking_queue<int> abq(8);
+	linked_blocking_queue<int> lbq;
+	abq.push(1);
+	lbq.push(2);
+	int x = 0;
+	abq.pop(x);
+	ASSERT_EQ(1, x);
+	ASSERT_EQ(2, lbq.pop());
+}
@@ -0,0 +1,122 @@
+#include "pch.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include "../concurrent_data_structures/concurrent_hash_map.h"
+#include "../concurrent_data_structures/rw_spinlock.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+
+using namespace hungbiu;
+using namespace std;
+
+/*
+ * Single-threaded map semantics
+*/
+TEST(ConcHashMap, Basic) {
+	concurrent_hash_map<string, int> m(4);
+	ASSERT_EQ(4u, m.segments());
+	ASSERT_TRUE(m.empty());
+	ASSERT_FALSE(m.find("a"));
+
+	ASSERT_TRUE(m.insert({ "a", 1 }));
+	ASSERT_FALSE(m.insert({ "a", 2 }));
+	ASSERT_EQ(1, *m.find("a"));
+	ASSERT_TRUE(m.try_emplace("b", 2));
+	ASSERT_FALSE(m.insert_or_assign("b", 3));
+	ASSERT_EQ(3, *m.find("b"));
+	ASSERT_TRUE(m.insert_or_assign("c", 4));
+	ASSERT_EQ(3u, m.size());
+
+	ASSERT_TRUE(m.update("a", [](int& v) { v += 10; }));
+	ASSERT_FALSE(m.update("z", [](int& v) { v += 10; }));
+	ASSERT_EQ(11, *m.find("a"));
+	ASSERT_FALSE(m.upsert("a", [](int& v) { ++v; }, 0));
+	ASSERT_TRUE(m.upsert("d", [](int& v) { ++v; }, 0));
+	ASSERT_EQ(12, *m.find("a"));
+	ASSERT_EQ(1, *m.find("d"));
+
+	int sum = 0;
+	m.for_each([&](const string&, int& v) { sum += v; });
+	ASSERT_EQ(12 + 3 + 4 + 1, sum);
+
+	ASSERT_TRUE(m.erase("a"));
+	ASSERT_FALSE(m.erase("a"));
+	ASSERT_FALSE(m.contains("a"));
+	ASSERT_TRUE(m.contains("b"));
+	m.clear();
+	ASSERT_TRUE(m.empty());
+	ASSERT_FALSE(m.contains("b"));
+}
+
+/*
+ * A single segment grows through many incremental resizes and
+ * rebuilds after churn, finding every key all along
+*/
+TEST(ConcHashMap, Resize) {
+	const int N = 100000;
+	concurrent_hash_map<int, unique_ptr<int>> m(1);
+	for (int i = 0; i < N; ++i) {
+		ASSERT_TRUE(m.try_emplace(i, make_unique<int>(i)));
+		// The oldest keys stay reachable while their table is migrated
+		if (i % 997 == 0) {
+			for (int j = 0; j <= i; j += 101) ASSERT_TRUE(m.contains(j));
+		}
+	}
+	ASSERT_EQ(size_t(N), m.size());
+	for (int i = 0; i < N; i += 2) ASSERT_TRUE(m.erase(i));
+	for (int i = 0; i < N; ++i) {
+		ASSERT_EQ(i % 2 == 1, m.visit(i, [&](const unique_ptr<int>& p) { ASSERT_EQ(i, *p); }));
+	}
+	// Churn leaves tombstones behind
+	for (int round = 0; round < 4; ++round) {
+		for (int i = N; i < 2 * N; ++i) ASSERT_TRUE(m.try_emplace(i, make_unique<int>(i)));
+		for (int i = N; i < 2 * N; ++i) ASSERT_TRUE(m.erase(i));
+	}
+	ASSERT_EQ(size_t(N / 2), m.size());
+
+	concurrent_hash_map<int, int> r(2);
+	r.reserve(1000);
+	for (int i = 0; i < 1000; ++i) ASSERT_TRUE(r.try_emplace(i, i));
+	ASSERT_EQ(1000u, r.size());
+}
+
+/*
+ * Threads upsert shared counters and insert and erase keys of their
+ * own; counts add up and the lookups of other threads stay consistent
+*/
+template<typename Lock>
+void concurrent_ops() {
+	const int Threads_N = 6;
+	const int N = 4000;
+	concurrent_hash_map<int, long long, hash<int>, equal_to<int>, Lock> m(8);
+	atomic<int> tid = 0;
+	thread_array<Threads_N> threads{ [&]() {
+		const int me = tid.fetch_add(1);
+		for (int i = 0; i < N; ++i) {
+			m.upsert(i % 64, [](long long& v) { ++v; }, 0);
+			const int key = 1000 + me * N + i;
+			ASSERT_TRUE(m.try_emplace(key, key));
+			ASSERT_EQ(key, *m.find(key));
+			if (i % 2) {
+				ASSERT_TRUE(m.erase(key));
+			}
+			if (i % 256 == 0) this_thread::yield();
+		}
+	} };
+	threads.join_all();
+
+	long long counted = 0;
+	for (int k = 0; k < 64; ++k) counted += *m.find(k);
+	ASSERT_EQ(Threads_N * N, counted);
+	ASSERT_EQ(size_t(64 + Threads_N * N / 2), m.size());
+	for (int t = 0; t < Threads_N; ++t) {
+		for (int i = 0; i < N; ++i) {
+			ASSERT_EQ(i % 2 == 0, m.contains(1000 + t * N + i));
+		}
+	}
+}
+TEST(ConcHashMap, Concurrent) {
+	concurrent_ops<spinlock>();
+	concurrent_ops<rw_spinlock>();
+}
@@ -0,0 +1,57 @@
+#include "pch.h"
+#include "../concurrent_data_structures/contention_stats.h"
+#include "../concurrent_data_structures/array_blocking_queue.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <string>
+#include <map>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * Sharded counters add up across threads,
+ * snapshots list every counter by name
+*/
+TEST(ContentionStats, Counters) {
+	basic_contention_stats<true> stats;
+	thread_array<8> threads{ [&]() {
+		for (int i = 0; i < 1000; ++i) {
+			stats.add(stat_counter::pushes);
+			stats.add(stat_counter::wait_spins, 3);
+		}
+	} };
+	threads.join_all();
+
+	auto snap = stats.snapshot();
+	ASSERT_EQ(8000u, snap[stat_counter::pushes]);
+	ASSERT_EQ(24000u, snap[stat_counter::wait_spins]);
+	ASSERT_EQ(0u, snap[stat_counter::pops]);
+
+	snap += snap;
+	map<string, uint64_t> exported;
+	snap.for_each([&](const char* name, uint64_t v) { exported[name] = v; });
+	ASSERT_EQ(Stats_N + 1, exported.size());
+	ASSERT_EQ(16000u, exported["pushes"]);
+	ASSERT_EQ(48000u, exported["wait_spins"]);
+	ASSERT_EQ(0u, exported["depth"]);
+
+	basic_contention_stats<false> off;
+	off.add(stat_counter::pushes);
+	ASSERT_EQ(0u, off.snapshot()[stat_counter::pushes]);
+}
+
+/*
+ * array_blocking_queue reports its depth; counters only move
+ * when the library is built with HUNGBIU_ENABLE_STATS
+*/
+TEST(ContentionStats, Depth) {
+	array_blocking_queue<int> abq(8);
+	for (int i = 0; i < 5; ++i) abq.push(i);
+	ASSERT_EQ(5u, abq.stats().depth_);
+	int v;
+	abq.pop(v);
+	ASSERT_EQ(4u, abq.stats().depth_);
+
+	if constexpr (!contention_stats::enabled) {
+		ASSERT_EQ(0u, abq.stats()[stat_counter::parks]);
+	}
+}
@@ -0,0 +1,41 @@
+#include "pch.h"
+#include "../concurrent_data_structures/divider.h"
+#include <cstdint>
+#include <vector>
+#include <limits>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * divide() and modulo() match / and % for small and large divisors,
+ * powers of two or not, including dividends near the top of the range
+*/
+TEST(Divider, Exact) {
+	const auto Max = numeric_limits<uint64_t>::max();
+	vector<uint64_t> divisors;
+	for (uint64_t d = 2; d < 2000; ++d) divisors.push_back(d);
+	for (unsigned s = 11; s < 64; ++s) {
+		const auto p = uint64_t{ 1 } << s;
+		divisors.insert(divisors.end(), { p - 1, p, p + 1, p + p / 3 });
+	}
+	divisors.push_back(Max);
+
+	vector<uint64_t> dividends;
+	for (uint64_t n = 0; n < 5000; ++n) dividends.push_back(n);
+	for (uint64_t n = Max; n > Max - 5000; --n) dividends.push_back(n);
+	for (uint64_t n = 1; n < Max / 77; n = n * 77 + 13) dividends.push_back(n);
+
+	for (auto d : divisors) {
+		const divider div{ d };
+		ASSERT_EQ(d, div.divisor());
+		for (auto n : dividends) {
+			ASSERT_EQ(n / d, div.divide(n)) << n << " / " << d;
+			ASSERT_EQ(n % d, div.modulo(n)) << n << " % " << d;
+		}
+		for (uint64_t k = 1; k < 5; ++k) {
+			if (d > Max / k) break;
+			ASSERT_EQ(k, div.divide(d * k));
+			ASSERT_EQ(k - 1, div.divide(d * k - 1));
+		}
+	}
+}
@@ -1,12 +1,15 @@
 #include "pch.h"
 #include "../concurrent_data_structures/thread_pool.h"
 #include "../concurrent_data_structures/linked_blocking_queue.h"
+#include "../concurrent_data_structures/queue_closed.h"
 #include <vector>
 #include <thread>
 #include <algorithm>
 #include <numeric>
 #include <string>
 #include <chrono>
+#include <memory_resource>
+#include <stdexcept>
 
 using namespace hungbiu;
 using namespace std;
@@ -204,4 +207,453 @@ TEST(LnkBlkQueue, MISC)
 	consumers.join_all();
 
 	ASSERT_TRUE(lbq.empty());
-}
\ No newline at end of file
+}
+/*
+ * Node reuse under churn: several rounds of short-lived threads,
+ * more queues than a thread caches magazines for, and queues
+ * destroyed while threads still hold their nodes
+*/
+TEST(LnkBlkQueue, MPMC_node_reuse) {
+	const size_t Rounds = 4;
+	const size_t Queues_N = 6;
+	const size_t Diff = 500;
+	const size_t Threads_N = 4;
+
+	for (auto r = 0u; r < Rounds; ++r) {
+		vector<unique_ptr<linked_blocking_queue<string>>> queues;
+		for (auto i = 0u; i < Queues_N; ++i) {
+			queues.push_back(make_unique<linked_blocking_queue<string>>());
+		}
+
+		atomic<size_t> popped{ 0 };
+		thread_array<Threads_N> producers{ [&]() {
+			for (auto i = 0u; i < Diff; ++i) {
+				queues[i % Queues_N]->push(to_string(i));
+			}
+		} };
+		thread_array<Threads_N> consumers{ [&]() {
+			for (auto i = 0u; i < Diff; ++i) {
+				auto s = queues[i % Queues_N]->pop();
+				ASSERT_FALSE(s.empty());
+				popped.fetch_add(1);
+			}
+		} };
+		producers.join_all();
+		consumers.join_all();
+
+		ASSERT_EQ(Diff * Threads_N, popped.load());
+		for (auto& q : queues) {
+			ASSERT_TRUE(q->empty());
+			q->push("left in queue");
+		}
+	}
+}
+
+/*
+ * Nodes come from a std::pmr::memory_resource, and reserve()
+ * makes the following pushes allocation-free
+*/
+TEST(LnkBlkQueue, PMR_reserve) {
+	struct counting_resource : std::pmr::memory_resource
+	{
+		size_t allocs_ = 0;
+		size_t live_bytes_ = 0;
+		void* do_allocate(size_t bytes, size_t align) override
+		{
+			++allocs_;
+			live_bytes_ += bytes;
+			return std::pmr::new_delete_resource()->allocate(bytes, align);
+		}
+		void do_deallocate(void* p, size_t bytes, size_t align) override
+		{
+			live_bytes_ -= bytes;
+			std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+		}
+		bool do_is_equal(const memory_resource& oth) const noexcept override
+		{
+			return this == &oth;
+		}
+	} res;
+
+	const size_t N = 1000;
+	{
+		hungbiu::pmr::linked_blocking_queue<int> lbq{ &res };
+		ASSERT_EQ(&res, lbq.get_allocator().resource());
+
+		lbq.reserve(N);
+		const auto allocs = res.allocs_;
+		for (auto i = 0u; i < N; ++i) {
+			lbq.push(static_cast<int>(i));
+		}
+		ASSERT_EQ(allocs, res.allocs_);
+
+		for (auto i = 0u; i < N; ++i) {
+			ASSERT_EQ(static_cast<int>(i), lbq.pop());
+		}
+		ASSERT_TRUE(lbq.empty());
+	}
+	ASSERT_EQ(0u, res.live_bytes_);
+}
+
+/*
+ * A push whose copy throws gives its node back to the pool: pushes that
+ * keep throwing never need a new slab, and the queue keeps working
+*/
+namespace {
+	struct picky
+	{
+		int v_;
+		explicit picky(int v) : v_(v) {}
+		picky(const picky& other) : v_(other.v_)
+		{
+			if (v_ < 0) throw invalid_argument("negative");
+		}
+	};
+}
+TEST(LnkBlkQueue, Throwing_ctor) {
+	struct counting_resource : std::pmr::memory_resource
+	{
+		size_t allocs_ = 0;
+		void* do_allocate(size_t bytes, size_t align) override
+		{
+			++allocs_;
+			return std::pmr::new_delete_resource()->allocate(bytes, align);
+		}
+		void do_deallocate(void* p, size_t bytes, size_t align) override
+		{
+			std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+		}
+		bool do_is_equal(const memory_resource& oth) const noexcept override
+		{
+			return this == &oth;
+		}
+	} res;
+
+	const size_t N = 100;
+	hungbiu::pmr::linked_blocking_queue<picky> lbq{ &res };
+	lbq.reserve(N);
+	const auto allocs = res.allocs_;
+	const picky bad{ -1 };
+	for (auto i = 0u; i < 10 * N; ++i) {
+		ASSERT_THROW(lbq.push(bad), invalid_argument);
+	}
+	ASSERT_TRUE(lbq.empty());
+	ASSERT_FALSE(lbq.try_pop());
+
+	for (auto i = 0u; i < N; ++i) {
+		lbq.push(picky{ static_cast<int>(i) });
+		if (i % 10 == 0) {
+			ASSERT_THROW(lbq.push(bad), invalid_argument);
+		}
+	}
+	ASSERT_EQ(allocs, res.allocs_);
+	for (auto i = 0u; i < N; ++i) {
+		ASSERT_EQ(static_cast<int>(i), lbq.pop().v_);
+	}
+	ASSERT_TRUE(lbq.empty());
+}
+
+/*
+ * pop_for/pop_until time out on an empty queue
+ * and return as soon as a value arrives
+*/
+TEST(LnkBlkQueue, Timed) {
+	linked_blocking_queue<string> lbq;
+	const auto timeout = chrono::milliseconds(20);
+
+	auto start = chrono::steady_clock::now();
+	ASSERT_FALSE(lbq.pop_for(timeout));
+	ASSERT_GE(chrono::steady_clock::now() - start, timeout);
+	ASSERT_FALSE(lbq.pop_until(chrono::steady_clock::now() + timeout));
+
+	lbq.push("ready");
+	auto r = lbq.pop_for(timeout);
+	ASSERT_TRUE(r);
+	ASSERT_EQ("ready", *r);
+
+	auto producer = thread{ [&]() {
+		this_thread::sleep_for(chrono::milliseconds(50));
+		lbq.push("done");
+	} };
+	start = chrono::steady_clock::now();
+	r = lbq.pop_for(chrono::seconds(30));
+	ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(10));
+	ASSERT_TRUE(r);
+	ASSERT_EQ("done", *r);
+	producer.join();
+	ASSERT_TRUE(lbq.empty());
+}
+
+/*
+ * close() wakes every blocked consumer once the queue is drained,
+ * no poison pills needed
+*/
+TEST(LnkBlkQueue, Close) {
+	const size_t Consumers_N = 4;
+	const int N = 100;
+	linked_blocking_queue<string> lbq;
+
+	atomic<int> popped = 0, closed = 0;
+	thread_array<Consumers_N> consumers{ [&]() {
+		try {
+			for (;;) {
+				auto s = lbq.pop();
+				ASSERT_EQ("value", s);
+				popped.fetch_add(1);
+			}
+		}
+		catch (const queue_closed&) {
+			closed.fetch_add(1);
+		}
+	} };
+
+	for (int i = 0; i < N; ++i) {
+		lbq.push("value");
+	}
+	this_thread::sleep_for(chrono::milliseconds(50));
+	ASSERT_FALSE(lbq.is_closed());
+	lbq.close();
+	lbq.close();
+	ASSERT_TRUE(lbq.is_closed());
+	consumers.join_all();
+
+	ASSERT_EQ(N, popped.load());
+	ASSERT_EQ(static_cast<int>(Consumers_N), closed.load());
+	ASSERT_THROW(lbq.push("late"), queue_closed);
+	ASSERT_FALSE(lbq.try_pop());
+	const auto start = chrono::steady_clock::now();
+	ASSERT_FALSE(lbq.pop_for(chrono::seconds(30)));
+	ASSERT_LT(chrono::steady_clock::now() - start, chrono::seconds(10));
+	ASSERT_TRUE(lbq.empty());
+}
+
+/*
+ * Consumers keep falling asleep on an empty queue while producers push
+ * in bursts; every push must reach a consumer even though producers only
+ * notify when they see a waiter
+*/
+TEST(LnkBlkQueue, MPMC_wakeup) {
+	const size_t Producers_N = 2;
+	const size_t Consumers_N = 2;
+	const int Rounds = 200;
+	linked_blocking_queue<int> lbq;
+
+	atomic<int> sum = 0;
+	thread_array<Consumers_N> consumers{ [&]() {
+		for (auto i = 0; i < Rounds * static_cast<int>(Producers_N / Consumers_N); ++i) {
+			sum.fetch_add(lbq.pop());
+		}
+	} };
+	thread_array<Producers_N> producers{ [&]() {
+		for (auto i = 0; i < Rounds; ++i) {
+			if (i % 8 == 0) this_thread::sleep_for(chrono::microseconds(200));
+			lbq.push(1);
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+	ASSERT_EQ(Rounds * static_cast<int>(Producers_N), sum.load());
+	ASSERT_TRUE(lbq.empty());
+}
+
+/*
+ * drain_into/pop_all take batches in queue order
+*/
+TEST(LnkBlkQueue, Batch) {
+	linked_blocking_queue<unique_ptr<int>> lbq;
+	vector<unique_ptr<int>> out;
+	ASSERT_EQ(0u, lbq.drain_into(back_inserter(out)));
+
+	for (int i = 0; i < 10; ++i) {
+		lbq.push(make_unique<int>(i));
+	}
+	ASSERT_EQ(4u, lbq.drain_into(back_inserter(out), 4));
+	ASSERT_EQ(6u, lbq.drain_into(back_inserter(out)));
+	ASSERT_TRUE(lbq.empty());
+	for (int i = 0; i < 10; ++i) {
+		ASSERT_EQ(i, *out[i]);
+	}
+
+	// pop_all blocks until there is something to take
+	auto producer = thread{ [&]() {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		lbq.push(make_unique<int>(10));
+	} };
+	auto all = lbq.pop_all();
+	ASSERT_EQ(1u, all.size());
+	ASSERT_EQ(10, *all[0]);
+	producer.join();
+
+	// A closed queue is drained first, then reported closed
+	lbq.push(make_unique<int>(11));
+	lbq.close();
+	all = lbq.pop_all();
+	ASSERT_EQ(1u, all.size());
+	ASSERT_THROW(lbq.pop_all(), queue_closed);
+}
+
+/*
+ * Batch consumers racing with single-element ones
+*/
+TEST(LnkBlkQueue, MPMC_batch) {
+	const int Diff = 10000;
+	const size_t Producers_N = 4;
+	const int Sum = Diff * static_cast<int>(Producers_N);
+	linked_blocking_queue<int> lbq;
+
+	atomic<int> begin = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + Diff; ++e) {
+			lbq.push(e);
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	thread_array<2> consumers{ [&]() {
+		vector<int> local;
+		try {
+			for (;;) {
+				if (local.size() % 2) {
+					auto r = lbq.pop_all();
+					local.insert(local.end(), r.begin(), r.end());
+				}
+				else if (!lbq.drain_into(back_inserter(local), 64)) {
+					local.push_back(lbq.pop());
+				}
+			}
+		}
+		catch (const queue_closed&) {}
+		lock_guard lk{ spnlk };
+		outputs.insert(outputs.end(), local.begin(), local.end());
+	} };
+
+	producers.join_all();
+	lbq.close();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Batches taken from a queue kept nearly empty, so they keep racing with
+ * a push that has linked its node but not yet moved back.ptr; a batch
+ * must stop at the back instead of taking that unwritten node
+*/
+TEST(LnkBlkQueue, MPMC_batch_racing_push) {
+	const int Diff = 20000;
+	const size_t Producers_N = 3;
+	const int Sum = Diff * static_cast<int>(Producers_N);
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+
+	// The window is a few instructions wide, so it takes a few rounds
+	for (int round = 0; round < 4; ++round) {
+		linked_blocking_queue<int> lbq;
+
+		atomic<int> begin = 0;
+		thread_array<Producers_N> producers{ [&]() {
+			const auto b = begin.fetch_add(Diff);
+			for (auto e = b; e < b + Diff; ++e) {
+				lbq.push(e);
+			}
+		} };
+
+		spinlock spnlk;
+		vector<int> outputs;
+		thread_array<3> consumers{ [&]() {
+			vector<int> local;
+			try {
+				for (;;) {
+					// Small batches, taken as soon as anything is there
+					if (lbq.drain_into(back_inserter(local), 1 + local.size() % 3)) {
+						continue;
+					}
+					if (local.size() % 2) {
+						auto r = lbq.pop_all();
+						local.insert(local.end(), r.begin(), r.end());
+					}
+					else {
+						local.push_back(lbq.pop());
+					}
+				}
+			}
+			catch (const queue_closed&) {}
+			lock_guard lk{ spnlk };
+			outputs.insert(outputs.end(), local.begin(), local.end());
+		} };
+
+		producers.join_all();
+		lbq.close();
+		consumers.join_all();
+
+		sort(outputs.begin(), outputs.end());
+		ASSERT_EQ(inputs, outputs);
+		ASSERT_TRUE(lbq.empty());
+	}
+}
+
+/*
+ * Pushes, pops and pool counters when built with HUNGBIU_ENABLE_STATS,
+ * all zero otherwise
+*/
+TEST(LnkBlkQueue, Stats) {
+	linked_blocking_queue<int> lbq;
+	for (int i = 0; i < 5; ++i) lbq.push(i);
+	(void)lbq.pop();
+	const auto snap = lbq.stats();
+	if constexpr (contention_stats::enabled) {
+		ASSERT_EQ(5u, snap[stat_counter::pushes]);
+		ASSERT_EQ(1u, snap[stat_counter::pops]);
+		ASSERT_EQ(4u, snap.depth_);
+		ASSERT_GT(snap[stat_counter::free_list_hits] + snap[stat_counter::slab_allocations], 0u);
+	}
+	else {
+		ASSERT_EQ(0u, snap[stat_counter::pushes]);
+		ASSERT_EQ(0u, snap.depth_);
+	}
+}
+
+/*
+ * Every lock of spinlock.h guards both ends,
+ * including the scoped_lock taken by the destructor
+*/
+template<typename Lock>
+void lock_policy() {
+	const int Diff = 2000;
+	const size_t Producers_N = 4;
+	linked_blocking_queue<int, std::allocator<int>, Lock> lbq;
+	atomic<int> begin = 0;
+	atomic<long long> sum = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + Diff; ++e) {
+			lbq.push(e);
+		}
+	} };
+	thread_array<4> consumers{ [&]() {
+		try {
+			for (;;) sum.fetch_add(lbq.pop());
+		}
+		catch (const queue_closed&) {}
+	} };
+	producers.join_all();
+	lbq.close();
+	consumers.join_all();
+
+	const long long n = Diff * static_cast<long long>(Producers_N);
+	ASSERT_EQ(n * (n - 1) / 2, sum.load());
+	ASSERT_TRUE(lbq.empty());
+}
+TEST(LnkBlkQueue, Lock_policy) {
+	lock_policy<spinlock>();
+	lock_policy<ticket_lock>();
+	lock_policy<mcs_lock>();
+	lock_policy<hybrid_lock>();
+	lock_policy<std::mutex>();
+}
@@ -0,0 +1,188 @@
+#include "pch.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include "../concurrent_data_structures/lock_free_linked_queue.h"
+#include "../concurrent_data_structures/spinlock.h"
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+
+using namespace hungbiu;
+using namespace std;
+
+/*
+ * Single producer and single consumer
+ * queue<int>
+ * Confirm that the queue basically work and keeps FIFO order
+*/
+TEST(LockFreeQueue, SPSC) {
+	const size_t N = 10000;
+	vector<int> inputs, outputs;
+	inputs.resize(N);
+	iota(inputs.begin(), inputs.end(), 1);
+	outputs.reserve(inputs.size());
+
+	lock_free_linked_queue<int> q;
+	ASSERT_TRUE(q.empty());
+	ASSERT_FALSE(q.try_pop());
+
+	thread t1{ [&]() {
+		for_each(inputs.cbegin(), inputs.cend(),
+			[&](auto e) { q.push(e); });
+	} };
+
+	thread t2{ [&]() {
+		for (auto i = 0u; i < inputs.size(); ++i) {
+			outputs.push_back(q.pop());
+		}
+	} };
+
+	t1.join();
+	t2.join();
+
+	ASSERT_TRUE(q.empty());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Multiple producers and multiple consumers
+ * queue<unique_ptr<int>> for move-only types
+*/
+TEST(LockFreeQueue, MPMC_unique_ptr) {
+	const size_t Diff = 1000;
+	const size_t Producers_N = 4;
+	const size_t Consumers_N = 4;
+	const size_t Sum = Diff * Producers_N;
+	atomic<int> begin = 0;
+	atomic<size_t> counter = 0;
+
+	lock_free_linked_queue<unique_ptr<int>> q;
+
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + static_cast<int>(Diff); ++e) {
+			q.push(make_unique<int>(e));
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		while (counter.load() < Sum) {
+			auto opt_e = q.try_pop();
+			if (!opt_e) continue;
+
+			lock_guard lk{ spnlk };
+			outputs.push_back(**opt_e);
+			counter.fetch_add(1);
+		}
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+
+	EXPECT_TRUE(q.empty());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Consumers park in pop() until a late producer shows up,
+ * and the queue is destroyed with elements left in it
+*/
+TEST(LockFreeQueue, MISC) {
+	const size_t Consumers_N = 4;
+	lock_free_linked_queue<string> q;
+
+	atomic<size_t> done{ 0 };
+	thread_array<Consumers_N> consumers{ [&]() {
+		auto s = q.pop();
+		ASSERT_EQ("done", s);
+		done.fetch_add(1);
+	} };
+
+	this_thread::sleep_for(chrono::milliseconds(100));
+	for (auto i = 0u; i < Consumers_N; ++i) {
+		q.push("done");
+	}
+	consumers.join_all();
+	ASSERT_EQ(Consumers_N, done.load());
+
+	q.push(string(100, 'x'));
+	ASSERT_FALSE(q.empty());
+}
+
+/*
+ * A throwing constructor leaves the queue untouched; the node taken for
+ * it goes back through the hazard domain while others pop and push
+*/
+namespace {
+	// Copying or moving it into the queue throws for multiples of 5
+	struct picky
+	{
+		int v_;
+		picky(int v) noexcept : v_(v) {}
+		picky(const picky& o) : v_(o.v_)
+		{
+			if (v_ % 5 == 0) throw invalid_argument("picky");
+		}
+		picky(picky&& o) : picky(static_cast<const picky&>(o)) {}
+	};
+}
+TEST(LockFreeQueue, MPMC_throwing_ctor) {
+	const int Diff = 10000;
+	const size_t Producers_N = 4;
+	lock_free_linked_queue<picky> q;
+
+	ASSERT_THROW(q.push(picky{ 0 }), invalid_argument);
+	ASSERT_TRUE(q.empty());
+	ASSERT_FALSE(q.try_pop());
+
+	atomic<int> begin = 0;
+	atomic<int> thrown = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + Diff; ++e) {
+			try {
+				const picky p{ e };
+				q.push(p);
+			}
+			catch (const invalid_argument&) {
+				thrown.fetch_add(1);
+			}
+		}
+	} };
+
+	const int Expected = static_cast<int>(Producers_N) * Diff * 4 / 5;
+	atomic<int> popped = 0;
+	spinlock spnlk;
+	vector<int> outputs;
+	thread_array<2> consumers{ [&]() {
+		vector<int> local;
+		while (popped.fetch_add(1) < Expected) {
+			local.push_back(q.pop().v_);
+		}
+		lock_guard lk{ spnlk };
+		outputs.insert(outputs.end(), local.begin(), local.end());
+	} };
+	producers.join_all();
+	consumers.join_all();
+
+	ASSERT_EQ(static_cast<int>(Producers_N) * Diff / 5, thrown.load());
+	vector<int> inputs;
+	for (int e = 0; e < static_cast<int>(Producers_N) * Diff; ++e) {
+		if (e % 5) inputs.push_back(e);
+	}
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+	ASSERT_TRUE(q.empty());
+}
@@ -0,0 +1,39 @@
+#include "pch.h"
+#include "../concurrent_data_structures/page_allocator.h"
+#include <cstring>
+#include <utility>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * Every page size and NUMA policy gives usable, zeroed memory of at least
+ * the requested size, rounded to the pages it actually got
+*/
+TEST(PageRegion, Allocate) {
+	const size_t Bytes = 3 * 1000 * 1000;
+	for (auto pages : { page_size::normal, page_size::transparent,
+						page_size::huge_2m, page_size::huge_1g }) {
+		for (auto numa : { numa_policy::none, numa_policy::bind,
+						   numa_policy::preferred, numa_policy::interleave }) {
+			page_region r{ Bytes, { pages, numa, 0, true } };
+			ASSERT_NE(nullptr, r.data());
+			ASSERT_GE(r.size(), Bytes);
+			ASSERT_GT(r.page_bytes(), 0u);
+			ASSERT_EQ(0u, r.size() % r.page_bytes());
+
+			auto p = static_cast<unsigned char*>(r.data());
+			ASSERT_EQ(0, p[0]);
+			ASSERT_EQ(0, p[Bytes - 1]);
+			memset(p, 0xab, Bytes);
+			ASSERT_EQ(0xab, p[Bytes / 2]);
+		}
+	}
+
+	page_region a{ 100, {} };
+	auto data = a.data();
+	page_region b{ std::move(a) };
+	ASSERT_EQ(nullptr, a.data());
+	ASSERT_EQ(data, b.data());
+	a = std::move(b);
+	ASSERT_EQ(data, a.data());
+}
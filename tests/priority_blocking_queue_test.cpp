@@ -0,0 +1,137 @@
+#include "pch.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include "../concurrent_data_structures/priority_blocking_queue.h"
+#include "../concurrent_data_structures/queue_closed.h"
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <random>
+
+using namespace hungbiu;
+using namespace std;
+
+/*
+ * A single heap is an exact priority queue,
+ * greatest first by default, earliest first with greater<>
+*/
+TEST(PriBlkQueue, Exact_order) {
+	priority_blocking_queue<int> max_q(1);
+	priority_blocking_queue<int, greater<int>> min_q(1);
+	ASSERT_EQ(1u, max_q.heaps());
+	ASSERT_FALSE(max_q.try_pop());
+
+	vector<int> inputs(1000);
+	iota(inputs.begin(), inputs.end(), 0);
+	shuffle(inputs.begin(), inputs.end(), mt19937{ 42 });
+	for (auto e : inputs) {
+		max_q.push(e);
+		min_q.push(e);
+	}
+	ASSERT_EQ(inputs.size(), max_q.size());
+	for (int i = 999; i >= 0; --i) {
+		ASSERT_EQ(i, max_q.pop());
+	}
+	for (int i = 0; i < 1000; ++i) {
+		ASSERT_EQ(i, *min_q.try_pop());
+	}
+	ASSERT_TRUE(max_q.empty());
+	ASSERT_FALSE(min_q.try_pop());
+}
+
+/*
+ * Many heaps relax the order but keep it close: the top elements
+ * come out long before the bottom ones
+*/
+TEST(PriBlkQueue, Relaxed_order) {
+	const int N = 10000;
+	priority_blocking_queue<int> q(8);
+	vector<int> inputs(N);
+	iota(inputs.begin(), inputs.end(), 0);
+	shuffle(inputs.begin(), inputs.end(), mt19937{ 42 });
+	for (auto e : inputs) q.push(e);
+
+	vector<int> outputs;
+	while (auto v = q.try_pop()) outputs.push_back(*v);
+	ASSERT_EQ(size_t(N), outputs.size());
+
+	// Rank error: how far each element is from its place in exact order
+	long long total_error = 0;
+	for (int i = 0; i < N; ++i) {
+		total_error += abs((N - 1 - i) - outputs[i]);
+	}
+	ASSERT_LT(total_error / N, 64);
+
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs.size(), outputs.size());
+	for (int i = 0; i < N; ++i) ASSERT_EQ(i, outputs[i]);
+}
+
+/*
+ * Multiple producers and consumers of move-only values,
+ * nothing lost or duplicated
+*/
+TEST(PriBlkQueue, MPMC_unique_ptr) {
+	const int Per_producer = 2000;
+	const int Producers_N = 4;
+	const int Consumers_N = 4;
+	priority_blocking_queue<unique_ptr<int>,
+		function<bool(const unique_ptr<int>&, const unique_ptr<int>&)>> q(
+			8, [](const auto& a, const auto& b) { return *a < *b; });
+
+	atomic<int> next = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto beg = next.fetch_add(Per_producer);
+		for (int i = beg; i < beg + Per_producer; ++i) {
+			q.push(make_unique<int>(i));
+			if (i % 64 == 0) this_thread::yield();
+		}
+	} };
+
+	vector<vector<int>> outputs(Consumers_N);
+	atomic<int> cid = 0;
+	atomic<int> popped = 0;
+	thread_array<Consumers_N> consumers{ [&]() {
+		auto& out = outputs[cid.fetch_add(1)];
+		while (popped.fetch_add(1) < Producers_N * Per_producer) {
+			out.push_back(*q.pop());
+		}
+	} };
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> all;
+	for (auto& o : outputs) all.insert(all.end(), o.begin(), o.end());
+	sort(all.begin(), all.end());
+	ASSERT_EQ(size_t(Producers_N * Per_producer), all.size());
+	for (int i = 0; i < Producers_N * Per_producer; ++i) ASSERT_EQ(i, all[i]);
+	ASSERT_TRUE(q.empty());
+}
+
+/*
+ * Blocked consumers wake up on push and on close(),
+ * timed pops give up, pushes after close() throw
+*/
+TEST(PriBlkQueue, Close) {
+	priority_blocking_queue<int> q(4);
+	ASSERT_FALSE(q.pop_for(chrono::milliseconds{ 20 }));
+
+	thread_array<3> consumers{ [&]() {
+		try {
+			for (;;) (void)q.pop();
+		}
+		catch (const queue_closed&) {}
+	} };
+	for (int i = 0; i < 100; ++i) q.push(i);
+	while (!q.empty()) this_thread::yield();
+	q.close();
+	consumers.join_all();
+
+	ASSERT_THROW(q.push(1), queue_closed);
+	ASSERT_THROW((void)q.pop(), queue_closed);
+	ASSERT_FALSE(q.try_pop());
+	ASSERT_FALSE(q.pop_for(chrono::milliseconds{ 1 }));
+}
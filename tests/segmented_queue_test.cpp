@@ -0,0 +1,114 @@
+#include "pch.h"
+#include "../concurrent_data_structures/segmented_queue.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include "../concurrent_data_structures/spinlock.h"
+#include <thread>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <algorithm>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * A single thread sees FIFO order across many segments,
+ * with segments recycled as the queue goes empty and back
+*/
+TEST(SegmentedQueue, SPSC) {
+	segmented_queue<int, spin_park_wait<>, 8> q;
+
+	int v;
+	ASSERT_FALSE(q.try_pop(v));
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < 100; ++i) {
+			q.push(i);
+		}
+		for (int i = 0; i < 100; ++i) {
+			ASSERT_TRUE(q.try_pop(v));
+			ASSERT_EQ(i, v);
+		}
+		ASSERT_FALSE(q.try_pop(v));
+	}
+
+	// Elements left in the queue are destroyed with it
+	segmented_queue<shared_ptr<int>, spin_park_wait<>, 4> sq;
+	auto p = make_shared<int>(1);
+	for (int i = 0; i < 10; ++i) {
+		sq.push(p);
+	}
+	shared_ptr<int> out;
+	sq.pop(out);
+	ASSERT_EQ(p, out);
+	out.reset();
+	ASSERT_EQ(10, p.use_count());
+}
+
+/*
+ * Every element is popped exactly once, consumers running ahead
+ * of producers into segments that aren't written yet
+*/
+TEST(SegmentedQueue, MPMC_unique_ptr) {
+	const int Diff = 5000;
+	const size_t Producers_N = 4;
+	const size_t Consumers_N = 4;
+	const int Sum = Diff * static_cast<int>(Producers_N);
+
+	segmented_queue<unique_ptr<int>, spin_park_wait<16, 4>, 16> q;
+
+	atomic<int> begin = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + Diff; ++e) {
+			q.push(make_unique<int>(e));
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		vector<int> local;
+		for (int i = 0; i < Sum / static_cast<int>(Consumers_N); ++i) {
+			unique_ptr<int> p;
+			if (i % 2 == 0 || !q.try_pop(p)) {
+				q.pop(p);
+			}
+			local.push_back(*p);
+		}
+		lock_guard lk{ spnlk };
+		outputs.insert(outputs.end(), local.begin(), local.end());
+	} };
+
+	producers.join_all();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+	unique_ptr<int> p;
+	ASSERT_FALSE(q.try_pop(p));
+}
+
+/*
+ * Consumers parked on an empty queue are woken by pushes
+*/
+TEST(SegmentedQueue, Blocking) {
+	segmented_queue<int, spin_park_wait<16, 4>, 4> q;
+	atomic<int> sum = 0;
+	thread_array<4> consumers{ [&]() {
+		for (int i = 0; i < 5; ++i) {
+			int v;
+			q.pop(v);
+			sum.fetch_add(v);
+		}
+	} };
+
+	this_thread::sleep_for(chrono::milliseconds(50));
+	for (int i = 1; i <= 20; ++i) {
+		q.push(i);
+	}
+	consumers.join_all();
+	ASSERT_EQ(210, sum.load());
+}
@@ -0,0 +1,126 @@
+#include "pch.h"
+#include "../concurrent_data_structures/sharded_queue.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include "../concurrent_data_structures/spinlock.h"
+#include <thread>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <algorithm>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * A single thread stays on its home shard, so it sees FIFO order
+ * until the shard overflows into the others
+*/
+TEST(ShardedQueue, SPSC) {
+	sharded_queue<int> q(64, 4);
+	ASSERT_EQ(4u, q.shards());
+
+	int v;
+	ASSERT_FALSE(q.try_pop(v));
+	for (int i = 0; i < 64; ++i) {
+		ASSERT_TRUE(q.try_push(i));
+	}
+	for (int i = 0; i < 64; ++i) {
+		ASSERT_TRUE(q.try_pop(v));
+		ASSERT_EQ(i, v);
+	}
+
+	// Fill every shard, then nothing more fits
+	for (int i = 0; i < 64 * 4; ++i) {
+		ASSERT_TRUE(q.try_push(i));
+	}
+	ASSERT_FALSE(q.try_push(-1));
+	vector<int> out;
+	while (q.try_pop(v)) out.push_back(v);
+	vector<int> expected(64 * 4);
+	iota(expected.begin(), expected.end(), 0);
+	ASSERT_EQ(expected, out);
+}
+
+/*
+ * Producers and consumers on different home shards,
+ * every element is popped exactly once
+*/
+TEST(ShardedQueue, MPMC_unique_ptr) {
+	const int Diff = 5000;
+	const size_t Producers_N = 8;
+	const size_t Consumers_N = 4;
+	const int Sum = Diff * static_cast<int>(Producers_N);
+
+	sharded_queue<unique_ptr<int>> q(16, 4);
+
+	atomic<int> begin = 0;
+	thread_array<Producers_N> producers{ [&]() {
+		const auto b = begin.fetch_add(Diff);
+		for (auto e = b; e < b + Diff; ++e) {
+			q.push(make_unique<int>(e));
+		}
+	} };
+
+	spinlock spnlk;
+	vector<int> outputs;
+	outputs.reserve(Sum);
+	thread_array<Consumers_N> consumers{ [&]() {
+		vector<int> local;
+		try {
+			for (;;) {
+				unique_ptr<int> p;
+				q.pop(p);
+				local.push_back(*p);
+			}
+		}
+		catch (const queue_closed&) {}
+		lock_guard lk{ spnlk };
+		outputs.insert(outputs.end(), local.begin(), local.end());
+	} };
+
+	producers.join_all();
+	q.close();
+	consumers.join_all();
+
+	vector<int> inputs(Sum);
+	iota(inputs.begin(), inputs.end(), 0);
+	sort(outputs.begin(), outputs.end());
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Parked consumers are woken by pushes to any shard, and by close()
+*/
+TEST(ShardedQueue, Close) {
+	sharded_queue<int, spin_park_wait<16, 4>> q(8, 3);
+	atomic<int> sum = 0, closed = 0;
+	thread_array<4> consumers{ [&]() {
+		try {
+			for (;;) {
+				int v;
+				q.pop(v);
+				sum.fetch_add(v);
+			}
+		}
+		catch (const queue_closed&) {
+			closed.fetch_add(1);
+		}
+	} };
+
+	this_thread::sleep_for(chrono::milliseconds(50));
+	for (int i = 1; i <= 10; ++i) {
+		q.push(i);
+	}
+	q.close();
+	q.close();
+	consumers.join_all();
+
+	ASSERT_TRUE(q.is_closed());
+	ASSERT_EQ(55, sum.load());
+	ASSERT_EQ(4, closed.load());
+	ASSERT_FALSE(q.try_push(0));
+	ASSERT_THROW(q.push(0), queue_closed);
+	int v;
+	ASSERT_FALSE(q.try_pop(v));
+	ASSERT_THROW(q.pop(v), queue_closed);
+}
@@ -0,0 +1,110 @@
+#include "pch.h"
+#include "../concurrent_data_structures/shared_memory_queue.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <thread>
+#include <string>
+#include <system_error>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+using namespace std;
+using namespace hungbiu;
+
+struct message
+{
+	int seq_;
+	char text_[12];
+};
+
+static string region_name(const char* test)
+{
+#if defined(_WIN32)
+	return string{ "Local\\hungbiu_" } + test + "_" + to_string(GetCurrentProcessId());
+#else
+	return string{ "/hungbiu_" } + test + "_" + to_string(getpid());
+#endif
+}
+
+/*
+ * Two mappings of the same region, at different addresses,
+ * see the same queue; the creator removes the name
+*/
+TEST(SharedMemoryQueue, Attach) {
+	using queue_t = shared_memory_queue<message, 6>;
+	const auto name = region_name("attach");
+	{
+		auto producer = queue_t::create(name);
+		ASSERT_THROW(queue_t::create(name), system_error);
+		auto consumer = queue_t::open(name);
+		ASSERT_NE(&producer.queue(), &consumer.queue());
+		ASSERT_EQ(6u, consumer->capacity());
+
+		const int N = 10000;
+		thread_array<1> t{ [&]() {
+			for (int i = 0; i < N; ++i) {
+				message m{ i, "hello" };
+				producer->push(m);
+			}
+		} };
+		for (int i = 0; i < N; ++i) {
+			message m;
+			consumer->pop(m);
+			ASSERT_EQ(i, m.seq_);
+			ASSERT_STREQ("hello", m.text_);
+		}
+		t.join_all();
+
+		// Another queue type doesn't attach
+		ASSERT_THROW((shared_memory_queue<message, 8>::open(name)), shared_memory_mismatch);
+		ASSERT_THROW((shared_memory_queue<int, 6>::open(name)), shared_memory_mismatch);
+	}
+#if !defined(_WIN32)
+	ASSERT_THROW(queue_t::open(name), system_error);
+	ASSERT_FALSE(queue_t::remove(name));
+#endif
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+/*
+ * Producer in a child process, consumer in the parent
+*/
+TEST(SharedMemoryQueue, Fork) {
+	using queue_t = shared_memory_queue<message, 64>;
+	const auto name = region_name("fork");
+	auto q = queue_t::create(name);
+
+	const int N = 10000;
+	const auto pid = fork();
+	ASSERT_NE(-1, pid);
+	if (pid == 0) {
+		int status = 0;
+		try {
+			auto child = queue_t::open(name);
+			for (int i = 0; i < N; ++i) {
+				child->push(message{ i, "child" });
+			}
+			child->close();
+		}
+		catch (...) {
+			status = 1;
+		}
+		_exit(status);
+	}
+
+	long long sum = 0;
+	try {
+		for (;;) {
+			message m;
+			q->pop(m);
+			sum += m.seq_;
+		}
+	}
+	catch (const queue_closed&) {}
+	int status = -1;
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+	ASSERT_EQ(1LL * N * (N - 1) / 2, sum);
+}
+#endif
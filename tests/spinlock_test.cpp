@@ -0,0 +1,148 @@
+#include "pch.h"
+#include "../concurrent_data_structures/spinlock.h"
+#include "../concurrent_data_structures/rw_spinlock.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * Mutual exclusion under contention, try_lock and std::scoped_lock
+*/
+template<typename Lock>
+void mutual_exclusion() {
+	Lock lk;
+	long long counter = 0;
+	thread_array<6> threads{ [&]() {
+		for (int i = 0; i < 5000; ++i) {
+			if (i % 4 == 0 && lk.try_lock()) {
+				++counter;
+				lk.unlock();
+				continue;
+			}
+			lock_guard g{ lk };
+			++counter;
+		}
+	} };
+	threads.join_all();
+	ASSERT_EQ(6 * 5000, counter);
+
+	ASSERT_TRUE(lk.try_lock());
+	ASSERT_FALSE(lk.try_lock());
+	lk.unlock();
+
+	Lock other;
+	{
+		scoped_lock both{ lk, other };
+		ASSERT_FALSE(other.try_lock());
+	}
+	ASSERT_TRUE(other.try_lock());
+	other.unlock();
+}
+TEST(Spinlock, Mutual_exclusion) {
+	mutual_exclusion<spinlock>();
+	mutual_exclusion<ticket_lock>();
+	mutual_exclusion<mcs_lock>();
+	mutual_exclusion<hybrid_lock>();
+}
+
+/*
+ * ticket_lock and mcs_lock hand the lock over in arrival order
+*/
+template<typename Lock>
+void fifo() {
+	Lock lk;
+	lk.lock();
+	vector<int> order;
+	atomic<int> arrived = 0;
+	vector<thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		// Wait for the previous one to queue up
+		while (arrived.load() != i) this_thread::yield();
+		threads.emplace_back([&, i]() {
+			arrived.fetch_add(1);
+			lock_guard g{ lk };
+			order.push_back(i);
+		});
+		this_thread::sleep_for(chrono::milliseconds(20));
+	}
+	lk.unlock();
+	for (auto& t : threads) t.join();
+	ASSERT_EQ((vector<int>{ 0, 1, 2, 3 }), order);
+}
+TEST(Spinlock, FIFO) {
+	fifo<ticket_lock>();
+	fifo<mcs_lock>();
+}
+
+/*
+ * MCS locks released in any order by the thread holding them
+*/
+TEST(Spinlock, MCS_nested) {
+	mcs_lock a, b, c;
+	a.lock();
+	b.lock();
+	c.lock();
+	b.unlock();
+	a.unlock();
+	thread t{ [&]() {
+		lock_guard ga{ a };
+		lock_guard gb{ b };
+	} };
+	t.join();
+	c.unlock();
+	ASSERT_TRUE(a.try_lock() && b.try_lock() && c.try_lock());
+	c.unlock();
+	a.unlock();
+	b.unlock();
+}
+
+/*
+ * Readers share the lock and keep writers out, writers exclude everyone;
+ * readers never see a half-written pair
+*/
+template<typename Lock>
+void reader_writer() {
+	Lock lk;
+	{
+		shared_lock r1{ lk };
+		ASSERT_TRUE(lk.try_lock_shared());
+		ASSERT_FALSE(lk.try_lock());
+		lk.unlock_shared();
+	}
+	{
+		unique_lock w{ lk };
+		ASSERT_FALSE(lk.try_lock_shared());
+		ASSERT_FALSE(lk.try_lock());
+	}
+	ASSERT_TRUE(lk.try_lock());
+	lk.unlock();
+
+	long long a = 0, b = 0;
+	atomic<long long> reads = 0;
+	thread_array<6> threads{ [&]() {
+		for (int i = 0; i < 4000; ++i) {
+			if (i % 8 == 0) {
+				lock_guard g{ lk };
+				++a;
+				++b;
+			}
+			else {
+				shared_lock g{ lk };
+				ASSERT_EQ(a, b);
+				reads.fetch_add(1, memory_order_relaxed);
+			}
+		}
+	} };
+	threads.join_all();
+	ASSERT_EQ(6 * 500, a);
+	ASSERT_EQ(a, b);
+	ASSERT_EQ(6 * 3500, reads.load());
+}
+TEST(Spinlock, Reader_writer) {
+	reader_writer<rw_spinlock>();
+	reader_writer<elided_rw_spinlock>();
+	reader_writer<basic_rw_spinlock<false, 1>>();
+}
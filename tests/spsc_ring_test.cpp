@@ -0,0 +1,94 @@
+#include "pch.h"
+#include "../concurrent_data_structures/spsc_ring.h"
+#include <thread>
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <string>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * SPSC
+*/
+TEST(SpscRing, SPSC) {
+	const size_t N = 100000;
+	vector<int> inputs, outputs;
+	inputs.resize(N);
+	iota(inputs.begin(), inputs.end(), 1);
+	outputs.reserve(inputs.size());
+
+	spsc_ring<int> ring(100);
+
+	// Pop from an empty ring
+	int v;
+	ASSERT_FALSE(ring.try_pop(v));
+
+	thread producer{ [&]() {
+		for_each(inputs.cbegin(), inputs.cend(),
+			[&](auto e) { ring.push(e); });
+	} };
+
+	thread consumer{ [&]() {
+		int v;
+		for (auto i = 0u; i < inputs.size(); ++i) {
+			ring.pop(v);
+			outputs.push_back(v);
+		}
+	} };
+
+	producer.join();
+	consumer.join();
+
+	ASSERT_FALSE(ring.try_pop(v));
+	ASSERT_EQ(inputs, outputs);
+}
+
+/*
+ * Move-only type with the non-blocking interface
+*/
+TEST(SpscRing, SPSC_unique_ptr) {
+	const int N = 10000;
+	spsc_ring<unique_ptr<int>> ring(7);
+
+	thread producer{ [&]() {
+		for (auto i = 0; i < N; ) {
+			if (ring.try_emplace(make_unique<int>(i))) ++i;
+			else this_thread::yield();
+		}
+	} };
+
+	for (auto i = 0; i < N; ) {
+		unique_ptr<int> p;
+		if (!ring.try_pop(p)) {
+			this_thread::yield();
+			continue;
+		}
+		ASSERT_EQ(i, *p);
+		++i;
+	}
+	producer.join();
+	ASSERT_TRUE(ring.empty());
+}
+
+TEST(SpscRing, MISC) {
+	spsc_ring<string> ring(3);
+	ASSERT_EQ(3u, ring.capacity());
+	ASSERT_TRUE(ring.empty());
+
+	ASSERT_TRUE(ring.try_push("a"));
+	ASSERT_TRUE(ring.try_push("b"));
+	ASSERT_TRUE(ring.try_push("c"));
+	ASSERT_FALSE(ring.try_push("d"));
+	ASSERT_EQ(3u, ring.size());
+
+	string s;
+	ASSERT_TRUE(ring.try_pop(s));
+	ASSERT_EQ("a", s);
+	ASSERT_TRUE(ring.try_push("d"));
+	ASSERT_EQ(3u, ring.size());
+
+	// Leave elements in the ring for the destructor to release
+	ASSERT_TRUE(ring.try_pop(s));
+	ASSERT_TRUE(ring.try_push(string(100, 'x')));
+}
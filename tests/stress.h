@@ -0,0 +1,253 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <thread>
+#include "../concurrent_data_structures/backoff.h"		// cpu_relax
+
+namespace hungbiu::stress
+{
+	/*
+	 * Stress and linearizability harness for the queues.
+	 *
+	 * Producers push values tagged with their id and a sequence number,
+	 * consumers pop them, and every operation is logged with an invoke and
+	 * a response timestamp from one logical clock. The history is checked
+	 * afterwards, against the violations that characterize a linearizable
+	 * queue (Henzinger et al., "Aspect-oriented linearizability proofs"):
+	 *	fresh:		a value is popped that was never pushed
+	 *	repeat:		a value is popped twice
+	 *	lost:		a value pushed is never popped, the queue being drained
+	 *	early:		a pop returns before the push of its value started
+	 *	order:		push(a) returns before push(b) starts, yet pop(b) returns
+	 *				before pop(a) starts; implies per-producer FIFO
+	 * Pops that find the queue empty aren't checked: try_pop may fail while
+	 * a push ahead of it is still being written, by design.
+	 *
+	 * Schedules are explored the way relacy or CDSChecker can't without
+	 * swapping std::atomic for their own: every run is seeded, and threads
+	 * are perturbed between operations, yielding or spinning at random, so
+	 * repeated rounds with small capacities wrap around and hit the CAS
+	 * retry paths under many interleavings. A failing check names its seed.
+	 *
+	 * The defaults keep the suite quick; HUNGBIU_STRESS_SCALE=n multiplies
+	 * rounds and operations for long runs, e.g. with --gtest_filter=Stress*
+	 * on a build with -fsanitize=thread; the harness keeps one log per
+	 * thread and an atomic clock, so any race reported is the queue's.
+	*/
+
+	// Multiplier for rounds and operations, from HUNGBIU_STRESS_SCALE
+	inline std::size_t scale() noexcept
+	{
+#if defined(_MSC_VER)
+#pragma warning(suppress: 4996)
+#endif
+		const char* env = std::getenv("HUNGBIU_STRESS_SCALE");
+		const auto n = env ? std::strtoull(env, nullptr, 10) : 0;
+		return n ? static_cast<std::size_t>(n) : 1;
+	}
+
+	struct options
+	{
+		std::size_t producers_ = 4;
+		std::size_t consumers_ = 4;
+		std::size_t per_producer_ = 2000;
+		std::uint64_t seed_ = 0;
+		// Whether push order has to be kept, false for relaxed queues
+		bool fifo_ = true;
+	};
+
+	// Producer id in the upper half, sequence number in the lower one
+	inline std::uint64_t make_value(std::size_t producer, std::size_t seq) noexcept
+	{
+		return (static_cast<std::uint64_t>(producer) << 32) | seq;
+	}
+
+	struct op
+	{
+		std::uint64_t value_;
+		std::uint64_t invoke_;
+		std::uint64_t respond_;
+	};
+
+	/*
+	 * Seeded per-thread schedule noise: mostly nothing, sometimes a yield
+	 * or a short spin, so threads drift in and out of lockstep.
+	*/
+	class perturbation
+	{
+		std::uint64_t x_;
+	public:
+		explicit perturbation(std::uint64_t seed) noexcept :
+			x_((seed + 1) * 0x9e3779b97f4a7c15ull | 1)
+		{}
+		void operator()() noexcept
+		{
+			// xorshift64*
+			x_ ^= x_ >> 12;
+			x_ ^= x_ << 25;
+			x_ ^= x_ >> 27;
+			const auto r = x_ * 0x2545f4914f6cdd1dull;
+			switch (r >> 60) {
+			case 0:
+				std::this_thread::yield();
+				break;
+			case 1:
+				for (auto n = (r >> 40) & 0xff; n; --n) cpu_relax();
+				break;
+			default:
+				break;
+			}
+		}
+	};
+
+	/*
+	 * Check a history against the violations listed above.
+	 * @return	empty if it's linearizable as far as checked, else the first
+	 *			violation found
+	*/
+	inline std::string check(const options& opts,
+							 const std::vector<std::vector<op>>& pushes,
+							 const std::vector<std::vector<op>>& pops)
+	{
+		struct entry
+		{
+			const op* push_ = nullptr;
+			const op* pop_ = nullptr;
+		};
+		const auto n = opts.producers_ * opts.per_producer_;
+		const auto index = [&](std::uint64_t v) {
+			return (v >> 32) * opts.per_producer_ + (v & 0xffffffffu);
+		};
+		const auto name = [](std::uint64_t v) {
+			return std::to_string(v >> 32) + ":" + std::to_string(v & 0xffffffffu);
+		};
+		const auto fail = [&](const std::string& what) {
+			return what + " (seed " + std::to_string(opts.seed_) + ")";
+		};
+
+		std::vector<entry> entries(n);
+		for (const auto& log : pushes) {
+			for (const auto& o : log) entries[index(o.value_)].push_ = &o;
+		}
+		for (const auto& log : pops) {
+			for (const auto& o : log) {
+				if ((o.value_ >> 32) >= opts.producers_ ||
+					(o.value_ & 0xffffffffu) >= opts.per_producer_ ||
+					!entries[index(o.value_)].push_) {
+					return fail("fresh: popped " + name(o.value_) + ", never pushed");
+				}
+				auto& e = entries[index(o.value_)];
+				if (e.pop_) return fail("repeat: popped " + name(o.value_) + " twice");
+				e.pop_ = &o;
+				if (o.respond_ < e.push_->invoke_) {
+					return fail("early: popped " + name(o.value_) + " before pushing it");
+				}
+			}
+		}
+		for (std::size_t i = 0; i < n; ++i) {
+			if (!entries[i].pop_) return fail("lost: " + name(entries[i].push_->value_));
+		}
+		if (!opts.fifo_) return {};
+
+		// Visit b by push invoke; the a whose push returned before it, and
+		// whose pop started last, is the one to compare against
+		std::vector<std::size_t> by_respond(n), by_invoke(n);
+		std::iota(by_respond.begin(), by_respond.end(), 0);
+		std::iota(by_invoke.begin(), by_invoke.end(), 0);
+		std::sort(by_respond.begin(), by_respond.end(), [&](auto l, auto r) {
+			return entries[l].push_->respond_ < entries[r].push_->respond_;
+		});
+		std::sort(by_invoke.begin(), by_invoke.end(), [&](auto l, auto r) {
+			return entries[l].push_->invoke_ < entries[r].push_->invoke_;
+		});
+		std::size_t next = 0;
+		const entry* latest = nullptr;
+		for (auto b : by_invoke) {
+			const auto& eb = entries[b];
+			for (; next < n && entries[by_respond[next]].push_->respond_ < eb.push_->invoke_; ++next) {
+				const auto& ea = entries[by_respond[next]];
+				if (!latest || ea.pop_->invoke_ > latest->pop_->invoke_) latest = &ea;
+			}
+			if (latest && eb.pop_->respond_ < latest->pop_->invoke_) {
+				return fail("order: " + name(latest->push_->value_) + " was pushed before " +
+							name(eb.push_->value_) + " but popped after it");
+			}
+		}
+		return {};
+	}
+
+	/*
+	 * Run one round: producers call push(value), consumers call pop(),
+	 * returning the value, until every value pushed has been popped.
+	 * pop() may block; a non-blocking one retries on its own.
+	 * @return	the result of check()
+	*/
+	template<typename Push, typename Pop>
+	std::string run(const options& opts, Push push, Pop pop)
+	{
+		const auto total = opts.producers_ * opts.per_producer_;
+		std::atomic<std::uint64_t> clock{ 0 };
+		std::atomic<std::size_t> claimed{ 0 };
+		std::atomic<std::size_t> producer_ids{ 0 }, consumer_ids{ 0 };
+		std::vector<std::vector<op>> pushes(opts.producers_), pops(opts.consumers_);
+		const auto tick = [&]() { return clock.fetch_add(1, std::memory_order_seq_cst); };
+
+		std::vector<std::thread> threads;
+		for (std::size_t t = 0; t < opts.producers_; ++t) {
+			threads.emplace_back([&]() {
+				const auto id = producer_ids.fetch_add(1);
+				auto& log = pushes[id];
+				log.reserve(opts.per_producer_);
+				perturbation perturb{ opts.seed_ * 1009 + id };
+				for (std::size_t seq = 0; seq < opts.per_producer_; ++seq) {
+					const auto v = make_value(id, seq);
+					const auto invoke = tick();
+					push(v);
+					log.push_back({ v, invoke, tick() });
+					perturb();
+				}
+			});
+		}
+		for (std::size_t t = 0; t < opts.consumers_; ++t) {
+			threads.emplace_back([&]() {
+				const auto id = consumer_ids.fetch_add(1);
+				auto& log = pops[id];
+				perturbation perturb{ opts.seed_ * 1013 + opts.producers_ + id };
+				// Claiming a pop up front leaves nobody blocked at the end
+				while (claimed.fetch_add(1, std::memory_order_relaxed) < total) {
+					const auto invoke = tick();
+					const std::uint64_t v = pop();
+					log.push_back({ v, invoke, tick() });
+					perturb();
+				}
+			});
+		}
+		for (auto& t : threads) t.join();
+		return check(opts, pushes, pops);
+	}
+
+	/*
+	 * Run rounds seeded 0, 1, ..., make_queue() building a fresh queue for
+	 * each, and stop at the first failing one.
+	 * @param	round	called as round(queue, opts), returns run()'s result
+	*/
+	template<typename MakeQueue, typename Round>
+	std::string explore(options opts, std::size_t rounds, MakeQueue make_queue, Round round)
+	{
+		rounds *= scale();
+		opts.per_producer_ *= scale();
+		for (std::size_t seed = 0; seed < rounds; ++seed) {
+			opts.seed_ = seed;
+			auto q = make_queue();
+			auto result = round(*q, opts);
+			if (!result.empty()) return result;
+		}
+		return {};
+	}
+}
@@ -0,0 +1,219 @@
+#include "pch.h"
+#include "stress.h"
+#include "../concurrent_data_structures/array_blocking_queue.h"
+#include "../concurrent_data_structures/linked_blocking_queue.h"
+#include "../concurrent_data_structures/lock_free_linked_queue.h"
+#include "../concurrent_data_structures/segmented_queue.h"
+#include "../concurrent_data_structures/spsc_ring.h"
+#include "../concurrent_data_structures/sharded_queue.h"
+#include "../concurrent_data_structures/priority_blocking_queue.h"
+#include "../concurrent_data_structures/spinlock.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <thread>
+using namespace std;
+using namespace hungbiu;
+using namespace hungbiu::stress;
+
+/*
+ * The checker itself catches every kind of violation
+*/
+TEST(Stress, Checker) {
+	options opts;
+	opts.producers_ = 2;
+	opts.per_producer_ = 2;
+	const auto a = make_value(0, 0), b = make_value(0, 1);
+	const auto c = make_value(1, 0), d = make_value(1, 1);
+	// a, b pushed one after the other; c, d overlapping everything
+	const vector<vector<op>> pushes{ { { a, 0, 1 }, { b, 2, 3 } }, { { c, 0, 9 }, { d, 0, 9 } } };
+
+	ASSERT_EQ("", check(opts, pushes, { { { a, 4, 5 }, { c, 6, 7 } }, { { d, 4, 5 }, { b, 6, 7 } } }));
+	// Overlapping pops may return in either order
+	ASSERT_EQ("", check(opts, pushes, { { { b, 4, 6 }, { c, 10, 11 } }, { { a, 5, 7 }, { d, 10, 11 } } }));
+
+	auto fails = [&](const vector<vector<op>>& pops, const string& what) {
+		const auto result = check(opts, pushes, pops);
+		return result.compare(0, what.size(), what) == 0;
+	};
+	ASSERT_TRUE(fails({ { { b, 4, 5 }, { a, 6, 7 }, { c, 8, 9 }, { d, 10, 11 } } }, "order"));
+	ASSERT_TRUE(fails({ { { a, 4, 5 }, { a, 6, 7 }, { c, 8, 9 }, { d, 10, 11 } } }, "repeat"));
+	ASSERT_TRUE(fails({ { { a, 4, 5 }, { b, 6, 7 }, { c, 8, 9 } } }, "lost"));
+	ASSERT_TRUE(fails({ { { make_value(2, 0), 4, 5 } } }, "fresh"));
+	ASSERT_TRUE(fails({ { { b, 0, 1 } } }, "early"));
+
+	// Relaxed queues only need every value exactly once
+	opts.fifo_ = false;
+	ASSERT_EQ("", check(opts, pushes, { { { b, 4, 5 }, { a, 6, 7 }, { c, 8, 9 }, { d, 10, 11 } } }));
+}
+
+/*
+ * array_blocking_queue, blocking and non-blocking, on capacities small
+ * enough that every few tickets wrap around
+*/
+TEST(Stress, ArrBlkQueue) {
+	using padded_q = array_blocking_queue<uint64_t, spin_park_wait<16, 4>>;
+	ASSERT_EQ("", explore({}, 8, []() { return make_unique<padded_q>(2); },
+		[](padded_q& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() { uint64_t v; q.pop(v); return v; });
+		}));
+
+	// try_ paths only, where the CAS retries are
+	using compact_q = array_blocking_queue<uint64_t, busy_wait, compact_layout>;
+	ASSERT_EQ("", explore({}, 8, []() { return make_unique<compact_q>(6); },
+		[](compact_q& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { while (!q.try_push(v)) this_thread::yield(); },
+				[&]() {
+					for (;;) {
+						if (auto v = q.try_pop()) return *v;
+						this_thread::yield();
+					}
+				});
+		}));
+}
+
+TEST(Stress, ArrBlkQueue_in_place) {
+	using queue_t = array_blocking_queue<uint64_t, spin_yield_wait<>, compact_layout>;
+	ASSERT_EQ("", explore({}, 8, []() { return make_unique<queue_t>(4); },
+		[](queue_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) {
+					if (v & 1) {
+						auto w = q.reserve();
+						*w = v;
+						w.commit();
+					}
+					// Committed as the handle goes away
+					else if (!q.try_reserve(v)) {
+						q.emplace(v);
+					}
+				},
+				[&]() {
+					uint64_t v = 0;
+					if (q.try_consume([&](uint64_t& in_slot) { v = in_slot; })) return v;
+					return *q.peek();
+				});
+		}));
+}
+
+TEST(Stress, ArrBlkQueue_timed) {
+	using queue_t = array_blocking_queue<uint64_t, spin_park_wait<16, 4>>;
+	ASSERT_EQ("", explore({}, 4, []() { return make_unique<queue_t>(3); },
+		[](queue_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { while (!q.push_for(v, chrono::microseconds(50))) {} },
+				[&]() {
+					uint64_t v;
+					while (!q.pop_for(v, chrono::microseconds(50))) {}
+					return v;
+				});
+		}));
+}
+
+/*
+ * Every lock policy; an observer polls empty() meanwhile, which runs
+ * without either lock
+*/
+template<typename Lock>
+string lnk_blk_queue_stress()
+{
+	using queue_t = linked_blocking_queue<uint64_t, allocator<uint64_t>, Lock>;
+	return explore({}, 4, []() { return make_unique<queue_t>(); },
+		[](queue_t& q, const options& opts) {
+			atomic<bool> done{ false };
+			thread_array<1> observer{ [&]() {
+				while (!done.load()) {
+					(void)q.empty();
+					this_thread::yield();
+				}
+			} };
+			auto result = run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() {
+					if (auto v = q.try_pop()) return *v;
+					return q.pop();
+				});
+			done.store(true);
+			return result;
+		});
+}
+TEST(Stress, LnkBlkQueue) {
+	ASSERT_EQ("", lnk_blk_queue_stress<spinlock>());
+	ASSERT_EQ("", lnk_blk_queue_stress<ticket_lock>());
+	ASSERT_EQ("", lnk_blk_queue_stress<mcs_lock>());
+	ASSERT_EQ("", lnk_blk_queue_stress<hybrid_lock>());
+}
+
+TEST(Stress, LockFreeQueue) {
+	using queue_t = lock_free_linked_queue<uint64_t>;
+	ASSERT_EQ("", explore({}, 4, []() { return make_unique<queue_t>(); },
+		[](queue_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() {
+					if (auto v = q.try_pop()) return *v;
+					return q.pop();
+				});
+		}));
+}
+
+TEST(Stress, SegmentedQueue) {
+	using queue_t = segmented_queue<uint64_t, spin_park_wait<16, 4>, 4>;
+	ASSERT_EQ("", explore({}, 4, []() { return make_unique<queue_t>(); },
+		[](queue_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() {
+					uint64_t v;
+					if (!q.try_pop(v)) q.pop(v);
+					return v;
+				});
+		}));
+}
+
+TEST(Stress, SpscRing) {
+	using queue_t = spsc_ring<uint64_t>;
+	options opts;
+	opts.producers_ = opts.consumers_ = 1;
+	opts.per_producer_ = 20000;
+	ASSERT_EQ("", explore(opts, 4, []() { return make_unique<queue_t>(3); },
+		[](queue_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { if (!q.try_push(v)) q.push(v); },
+				[&]() { uint64_t v; q.pop(v); return v; });
+		}));
+}
+
+/*
+ * Relaxed queues: no order to keep, but nothing lost or duplicated
+*/
+TEST(Stress, Relaxed) {
+	options opts;
+	opts.fifo_ = false;
+
+	using sharded_t = sharded_queue<uint64_t, spin_park_wait<16, 4>>;
+	ASSERT_EQ("", explore(opts, 4, []() { return make_unique<sharded_t>(4, 3); },
+		[](sharded_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() { uint64_t v; q.pop(v); return v; });
+		}));
+
+	using priority_t = priority_blocking_queue<uint64_t>;
+	ASSERT_EQ("", explore(opts, 4, []() { return make_unique<priority_t>(4); },
+		[](priority_t& q, const options& opts) {
+			return run(opts,
+				[&](uint64_t v) { q.push(v); },
+				[&]() {
+					if (auto v = q.try_pop()) return *v;
+					return q.pop();
+				});
+		}));
+}
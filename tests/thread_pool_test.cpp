@@ -0,0 +1,118 @@
+#include "pch.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <vector>
+#include <future>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <set>
+#include <mutex>
+using namespace std;
+using namespace hungbiu;
+
+TEST(ThreadPool, Submit) {
+	thread_pool pool(4);
+	ASSERT_EQ(4u, pool.size());
+
+	vector<future<int>> results;
+	for (auto i = 0; i < 1000; ++i) {
+		results.push_back(pool.submit([](int a, int b) { return a * b; }, i, 2));
+	}
+	for (auto i = 0; i < 1000; ++i) {
+		ASSERT_EQ(i * 2, results[i].get());
+	}
+
+	// void result, move-only argument
+	auto p = make_unique<string>("moved");
+	string out;
+	pool.submit([&out](unique_ptr<string> s) { out = *s; }, std::move(p)).get();
+	ASSERT_EQ("moved", out);
+
+	// Exceptions are forwarded through the future
+	auto f = pool.submit([]() -> int { throw runtime_error("task failed"); });
+	ASSERT_THROW(f.get(), runtime_error);
+}
+
+/*
+ * Tasks spawning tasks go to the worker's own deque
+ * and get stolen by the others
+*/
+int fib(thread_pool& pool, int n)
+{
+	if (n < 2) return n;
+	if (n < 12) return fib(pool, n - 1) + fib(pool, n - 2);
+	auto lhs = pool.submit([&pool, n]() { return fib(pool, n - 1); });
+	auto rhs = fib(pool, n - 2);
+	// Help with pending tasks instead of blocking the worker
+	while (lhs.wait_for(chrono::seconds(0)) != future_status::ready) {
+		if (!pool.run_one()) this_thread::yield();
+	}
+	return lhs.get() + rhs;
+}
+
+TEST(ThreadPool, Nested) {
+	thread_pool pool(4);
+	ASSERT_EQ(6765, pool.submit([&pool]() { return fib(pool, 20); }).get());
+}
+
+/*
+ * The destructor runs everything submitted before it
+*/
+TEST(ThreadPool, Drain) {
+	atomic<int> counter{ 0 };
+	{
+		thread_pool pool(2);
+		for (auto i = 0; i < 1000; ++i) {
+			pool.submit([&counter]() { counter.fetch_add(1); });
+		}
+	}
+	ASSERT_EQ(1000, counter.load());
+}
+
+TEST(ThreadPool, Topology) {
+	const auto& topo = cpu_topology::get();
+	ASSERT_FALSE(topo.cpus().empty());
+	ASSERT_GE(topo.numa_nodes(), 1u);
+	ASSERT_GE(topo.concurrency(), 1u);
+	ASSERT_LE(topo.concurrency(), topo.cpus().size());
+
+	// Runtime-sized by default
+	thread_pool pool;
+	ASSERT_EQ(topo.concurrency(), pool.size());
+}
+
+/*
+ * Every policy starts the requested number of workers
+ * with distinct IDs in [0, n)
+*/
+TEST(ThreadPool, WorkerGroup) {
+	ASSERT_EQ(this_worker::npos, this_worker::id());
+
+	const auto policies = { affinity_policy::none,
+							affinity_policy::compact,
+							affinity_policy::scatter,
+							affinity_policy::per_numa_node };
+	for (auto policy : policies) {
+		mutex mtx;
+		set<size_t> ids;
+		{
+			// More workers than CPUs wrap around
+			worker_group group(5, policy, [&](size_t id) {
+				ASSERT_EQ(id, this_worker::id());
+				ASSERT_LT(this_worker::numa_node(), cpu_topology::get().numa_nodes());
+				lock_guard lk{ mtx };
+				ids.insert(id);
+			});
+			ASSERT_EQ(5u, group.size());
+		}
+		ASSERT_EQ(5u, ids.size());
+		ASSERT_EQ(4u, *ids.rbegin());
+	}
+
+	// Pool workers can tell who they are
+	thread_pool pool(3, affinity_policy::compact);
+	auto id = pool.submit([]() { return this_worker::id(); }).get();
+	ASSERT_LT(id, 3u);
+}
@@ -0,0 +1,96 @@
+#include "pch.h"
+#include "../concurrent_data_structures/work_stealing_deque.h"
+#include "../concurrent_data_structures/thread_pool.h"
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
+#include <mutex>
+using namespace std;
+using namespace hungbiu;
+
+/*
+ * Owner alone: LIFO at the bottom, growing past the initial capacity
+*/
+TEST(WorkStealingDeque, Owner) {
+	work_stealing_deque<int> dq(4);
+	ASSERT_FALSE(dq.pop());
+	ASSERT_FALSE(dq.steal());
+
+	for (auto i = 0; i < 100; ++i) {
+		dq.push(i);
+	}
+	ASSERT_EQ(100u, dq.size());
+	ASSERT_EQ(0, *dq.steal());
+	for (auto i = 99; i > 0; --i) {
+		ASSERT_EQ(i, *dq.pop());
+	}
+	ASSERT_TRUE(dq.empty());
+	ASSERT_FALSE(dq.pop());
+}
+
+/*
+ * Capacities that aren't powers of two are rounded up, so no two
+ * elements share a slot of the masked ring
+*/
+TEST(WorkStealingDeque, Arbitrary_capacity) {
+	for (size_t cap : { 0, 1, 3, 100, 1000 }) {
+		work_stealing_deque<int> dq(cap);
+		for (int lap = 0; lap < 3; ++lap) {
+			for (auto i = 0; i < 150; ++i) {
+				dq.push(i);
+			}
+			ASSERT_EQ(0, *dq.steal());
+			ASSERT_EQ(1, *dq.steal());
+			for (auto i = 149; i > 1; --i) {
+				ASSERT_EQ(i, *dq.pop());
+			}
+			ASSERT_TRUE(dq.empty());
+		}
+	}
+}
+
+/*
+ * Owner pushes and pops while thieves steal,
+ * every element is taken exactly once
+*/
+TEST(WorkStealingDeque, Thieves) {
+	const int N = 20000;
+	const size_t Thieves_N = 3;
+	work_stealing_deque<int> dq(8);
+
+	atomic<bool> done{ false };
+	mutex mtx;
+	vector<int> outputs;
+	outputs.reserve(N);
+
+	thread_array<Thieves_N> thieves{ [&]() {
+		vector<int> local;
+		while (!done.load()) {
+			if (auto v = dq.steal()) local.push_back(*v);
+			else this_thread::yield();
+		}
+		lock_guard lk{ mtx };
+		outputs.insert(outputs.end(), local.begin(), local.end());
+	} };
+
+	vector<int> local;
+	for (auto i = 0; i < N; ++i) {
+		dq.push(i);
+		if (i % 3 == 0) {
+			if (auto v = dq.pop()) local.push_back(*v);
+		}
+	}
+	while (auto v = dq.pop()) {
+		local.push_back(*v);
+	}
+	done.store(true);
+	thieves.join_all();
+
+	outputs.insert(outputs.end(), local.begin(), local.end());
+	sort(outputs.begin(), outputs.end());
+	vector<int> inputs(N);
+	iota(inputs.begin(), inputs.end(), 0);
+	ASSERT_EQ(inputs, outputs);
+}